@@ -7,6 +7,7 @@
 #ifndef SPICE_STREAMING_AGENT_FRAME_CAPTURE_HPP
 #define SPICE_STREAMING_AGENT_FRAME_CAPTURE_HPP
 #include <cstdio>
+#include <cstdint>
 
 #include <spice/enums.h>
 
@@ -22,13 +23,33 @@ struct FrameSize
 struct FrameInfo
 {
     FrameSize size;
-    /*! Memory buffer, valid till next frame is read */
+    /*! Memory buffer, valid till next frame is read.
+     * If it points into a FrameBuffer lent by Agent::AcquireFrameBuffer
+     * the agent takes its own reference on the buffer and can hold the
+     * frame longer.
+     */
     const void *buffer;
     size_t buffer_size;
     /*! Start of a new stream */
     bool stream_start;
 };
 
+/*!
+ * Reference counted memory lent by the agent to store encoded frames.
+ * See Agent::AcquireFrameBuffer.
+ */
+class FrameBuffer
+{
+public:
+    virtual uint8_t *Data() = 0;
+    virtual size_t Capacity() const = 0;
+    virtual void Ref() = 0;
+    /*! Release a reference, the buffer goes back to the agent with the last one */
+    virtual void Unref() = 0;
+protected:
+    virtual ~FrameBuffer() = default;
+};
+
 /*!
  * Pure base class implementing the frame capture
  */
@@ -7,6 +7,7 @@
 #ifndef SPICE_STREAMING_AGENT_PLUGIN_HPP
 #define SPICE_STREAMING_AGENT_PLUGIN_HPP
 
+#include <cstddef>
 #include <spice/enums.h>
 
 /*!
@@ -21,13 +22,20 @@ namespace spice {
 namespace streaming_agent {
 
 class FrameCapture;
+class FrameBuffer;
 
 /*!
  * Plugin version, only using few bits, schema is 0xMMmm
  * where MM is major and mm is the minor, can be easily expanded
  * using more bits in the future
+ *
+ * 1.1: added Agent::AcquireFrameBuffer
+ * 1.2: added Agent::RateFactor
+ * 1.3: added Agent::WaitNextFrame
+ * 1.4: added Agent::KeyframeRequests
+ * 1.5: added Agent::RestartSchedule
  */
-enum Constants : unsigned { PluginVersion = 0x100u };
+enum Constants : unsigned { PluginVersion = 0x105u };
 
 enum Ranks : unsigned {
     /// this plugin should not be used
@@ -114,6 +122,57 @@ public:
      * \todo passing options to entry point instead?
      */
     virtual const ConfigureOption* Options() const = 0;
+
+    /*!
+     * Borrow a buffer able to hold size bytes from the agent's pool.
+     * The caller owns a reference to the buffer and should release it
+     * with FrameBuffer::Unref when done, usually when the next frame
+     * is captured. Returning a frame stored in such a buffer from
+     * FrameCapture::CaptureFrame allows the agent to keep it while
+     * the next one is captured without copying it.
+     * \return nullptr if no buffer is available, in this case the frame
+     * should be stored in plugin's memory
+     * \since 1.1
+     */
+    virtual FrameBuffer *AcquireFrameBuffer(size_t size) = 0;
+
+    /*!
+     * Fraction, between 0 and 1, of the configured quality, bitrate or
+     * frame rate the stream should currently use.
+     * It is lowered when frames cannot be sent to the client as fast as
+     * they are produced and raised again when they can. Plugins should
+     * check it while capturing.
+     * \since 1.2
+     */
+    virtual double RateFactor() const = 0;
+
+    /*!
+     * Sleep till the next frame should be captured to stream fps frames
+     * per second.
+     * Deadlines are absolute, the time spent capturing and encoding the
+     * previous frame is accounted for. Should be called once per frame
+     * from the thread calling FrameCapture::CaptureFrame.
+     * \since 1.3
+     */
+    virtual void WaitNextFrame(unsigned fps) = 0;
+
+    /*!
+     * Number of keyframes requested so far, for instance because the
+     * client failed to decode the stream. When it changed since the last
+     * frame the next frame should be a keyframe, decodable on its own,
+     * and it should be captured without waiting for the screen to change.
+     * \since 1.4
+     */
+    virtual unsigned KeyframeRequests() const = 0;
+
+    /*!
+     * Tell the agent the frame being captured waited after WaitNextFrame,
+     * e.g. for the screen to change. If the next deadline passed meanwhile
+     * the schedule restarts from now, so the next frame still comes one
+     * period after this one instead of right away.
+     * \since 1.5
+     */
+    virtual void RestartSchedule() = 0;
 };
 
 typedef bool PluginInitFunc(spice::streaming_agent::Agent* agent);
@@ -0,0 +1,394 @@
+/* Benchmark of the frame encoders, without X server nor streaming device.
+ *
+ * Synthetic or recorded BGRx frames are encoded and the throughput,
+ * latency, size and CPU usage are reported for each encoder.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include <config.h>
+#include "jpeg.hpp"
+#include "dirty-map.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if WITH_GST
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
+#endif
+
+using namespace spice::streaming_agent;
+
+namespace {
+
+uint64_t get_time()
+{
+    timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+uint64_t get_cpu_time()
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    return ((uint64_t)usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000u +
+        ((uint64_t)usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000u;
+}
+
+struct Frames
+{
+    unsigned width, height;
+    std::vector<std::vector<uint8_t>> data;
+};
+
+/* Desktop like content: a static background with a window moving over
+ * it and a changing text like area, so only a part of each frame changes */
+Frames make_synthetic_frames(unsigned width, unsigned height, unsigned count)
+{
+    Frames frames{width, height, {}};
+    std::vector<uint8_t> background((size_t) width * height * 4);
+    for (unsigned y = 0; y < height; ++y) {
+        uint8_t *line = &background[(size_t) y * width * 4];
+        for (unsigned x = 0; x < width; ++x) {
+            line[x * 4] = x * 255 / width;
+            line[x * 4 + 1] = y * 255 / height;
+            line[x * 4 + 2] = 128;
+            line[x * 4 + 3] = 0;
+        }
+    }
+
+    const unsigned win_width = width / 3, win_height = height / 3;
+    uint32_t seed = 1;
+    for (unsigned n = 0; n < count; ++n) {
+        std::vector<uint8_t> frame(background);
+        const unsigned win_x = (n * 16) % (width - win_width);
+        const unsigned win_y = height / 4;
+        for (unsigned y = win_y; y < win_y + win_height; ++y) {
+            uint8_t *line = &frame[((size_t) y * width + win_x) * 4];
+            for (unsigned x = 0; x < win_width; ++x) {
+                // some "text" on a white window
+                seed = seed * 1103515245u + 12345u;
+                const uint8_t value = (seed >> 16) % 8 == 0 ? 0 : 240;
+                line[x * 4] = line[x * 4 + 1] = line[x * 4 + 2] = value;
+            }
+        }
+        frames.data.push_back(std::move(frame));
+    }
+    return frames;
+}
+
+Frames read_frames(const char *filename, unsigned width, unsigned height, unsigned count)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error(std::string("Cannot open ") + filename);
+    }
+
+    Frames frames{width, height, {}};
+    std::vector<uint8_t> frame((size_t) width * height * 4);
+    while (frames.data.size() < count &&
+           file.read(reinterpret_cast<char *>(&frame[0]), frame.size())) {
+        frames.data.push_back(frame);
+    }
+    if (frames.data.empty()) {
+        throw std::runtime_error(std::string("No complete frame in ") + filename);
+    }
+    return frames;
+}
+
+class Encoder
+{
+public:
+    virtual ~Encoder() = default;
+    virtual std::string name() const = 0;
+    /*! \return the size of the encoded frame */
+    virtual size_t encode(uint8_t *data, unsigned width, unsigned height) = 0;
+};
+
+class JpegEncoder final : public Encoder
+{
+public:
+    JpegEncoder(int quality): quality(quality) {}
+    std::string name() const override { return "jpeg"; }
+    size_t encode(uint8_t *data, unsigned width, unsigned height) override
+    {
+        write_JPEG_file(buffer, quality, data, width, height);
+        return buffer.size();
+    }
+private:
+    const int quality;
+    std::vector<uint8_t> buffer;
+};
+
+// what the MJPEG plugin does, only compressing again the changed strips
+class JpegStripsEncoder final : public Encoder
+{
+public:
+    JpegStripsEncoder(int quality, unsigned threads):
+        quality(quality), threads(threads), encoder(threads) {}
+    std::string name() const override { return "jpeg-strips/" + std::to_string(threads); }
+    size_t encode(uint8_t *data, unsigned width, unsigned height) override
+    {
+        const unsigned strip_height = JpegStripEncoder::strip_height;
+        dirty_map.update(data, width, height, width * 4);
+        dirty_strips.resize(JpegStripEncoder::strip_count(height));
+        for (unsigned n = 0; n < dirty_strips.size(); ++n) {
+            dirty_strips[n] = dirty_map.rows_dirty(n * strip_height, strip_height);
+        }
+        encoder.encode(buffer, quality, data, width, height, dirty_strips);
+        return buffer.size();
+    }
+private:
+    const int quality;
+    const unsigned threads;
+    JpegStripEncoder encoder;
+    DirtyMap dirty_map;
+    std::vector<bool> dirty_strips;
+    std::vector<uint8_t> buffer;
+};
+
+#if WITH_GST
+/* Same elements and settings as the GStreamer plugin, the frames are
+ * pushed to appsrc and the encoded ones pulled from appsink */
+class GstEncoder final : public Encoder
+{
+public:
+    GstEncoder(const std::string &element): element(element) {}
+    ~GstEncoder()
+    {
+        if (pipeline) {
+            gst_element_set_state(pipeline, GST_STATE_NULL);
+            gst_object_unref(src);
+            gst_object_unref(sink);
+            gst_object_unref(pipeline);
+        }
+    }
+    std::string name() const override { return "gst/" + element; }
+    size_t encode(uint8_t *data, unsigned width, unsigned height) override
+    {
+        if (!pipeline) {
+            init(width, height);
+        }
+
+        GstBuffer *buf = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, data,
+                                                     (size_t) width * height * 4, 0,
+                                                     (size_t) width * height * 4,
+                                                     nullptr, nullptr);
+        if (gst_app_src_push_buffer(GST_APP_SRC(src), buf) != GST_FLOW_OK) {
+            throw std::runtime_error("Cannot push frame to " + element);
+        }
+
+        GstSample *sample = gst_app_sink_pull_sample(GST_APP_SINK(sink));
+        if (!sample) {
+            throw std::runtime_error("No frame encoded by " + element);
+        }
+        const size_t size = gst_buffer_get_size(gst_sample_get_buffer(sample));
+        gst_sample_unref(sample);
+        return size;
+    }
+private:
+    void init(unsigned width, unsigned height)
+    {
+        const std::string description = "appsrc name=src ! videoconvert ! " + element +
+            " name=encoder ! appsink name=sink sync=false";
+        GError *error = nullptr;
+        pipeline = gst_parse_launch(description.c_str(), &error);
+        if (!pipeline) {
+            std::string message = error ? error->message : "unknown error";
+            g_clear_error(&error);
+            throw std::runtime_error("Cannot create pipeline '" + description + "': " + message);
+        }
+        g_clear_error(&error);
+
+        GstElement *encoder = gst_bin_get_by_name(GST_BIN(pipeline), "encoder");
+        gst_util_set_object_arg(G_OBJECT(encoder), "tune", "zerolatency");
+        gst_util_set_object_arg(G_OBJECT(encoder), "bframes", "0");
+        gst_util_set_object_arg(G_OBJECT(encoder), "speed-preset", "1");
+        gst_object_unref(encoder);
+
+        src = gst_bin_get_by_name(GST_BIN(pipeline), "src");
+        sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+        GstCaps *caps = gst_caps_new_simple("video/x-raw",
+                                            "format", G_TYPE_STRING, "BGRx",
+                                            "width", G_TYPE_INT, width,
+                                            "height", G_TYPE_INT, height,
+                                            "framerate", GST_TYPE_FRACTION, 25, 1,
+                                            nullptr);
+        g_object_set(src, "caps", caps, "format", GST_FORMAT_TIME, "do-timestamp", TRUE, nullptr);
+        gst_caps_unref(caps);
+
+        gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    }
+
+    const std::string element;
+    GstElement *pipeline = nullptr, *src = nullptr, *sink = nullptr;
+};
+#endif
+
+uint64_t percentile(const std::vector<uint64_t> &sorted, unsigned percent)
+{
+    size_t index = (sorted.size() * percent + 99) / 100;
+    return sorted[std::max<size_t>(index, 1) - 1];
+}
+
+void run(Encoder &encoder, Frames &frames, unsigned count)
+{
+    std::vector<uint64_t> latencies;
+    uint64_t total_size = 0;
+
+    const uint64_t cpu_start = get_cpu_time();
+    const uint64_t start = get_time();
+    for (unsigned n = 0; n < count; ++n) {
+        std::vector<uint8_t> &frame = frames.data[n % frames.data.size()];
+        const uint64_t before = get_time();
+        total_size += encoder.encode(&frame[0], frames.width, frames.height);
+        latencies.push_back(get_time() - before);
+    }
+    const uint64_t elapsed = get_time() - start;
+    const uint64_t cpu = get_cpu_time() - cpu_start;
+
+    std::sort(latencies.begin(), latencies.end());
+    printf("%-20s %5ux%-5u %8.1f fps  latency ms p50 %7.2f p90 %7.2f p99 %7.2f max %7.2f"
+           "  %10.0f bytes/frame  cpu %7.2f ms/frame (%.0f%%)\n",
+           encoder.name().c_str(), frames.width, frames.height,
+           count * 1e9 / elapsed,
+           percentile(latencies, 50) / 1e6, percentile(latencies, 90) / 1e6,
+           percentile(latencies, 99) / 1e6, latencies.back() / 1e6,
+           (double) total_size / count, cpu / 1e6 / count, cpu * 100.0 / elapsed);
+    fflush(stdout);
+}
+
+void usage(const char *progname)
+{
+    printf("usage: %s <options>\n", progname);
+    printf("options are:\n");
+    printf("\t-s WIDTHxHEIGHT -- frame size, can be repeated (default 1280x720, 1920x1080 and 3840x2160)\n");
+    printf("\t-i file -- encode the raw BGRx frames of the file, of the single given size\n");
+    printf("\t-n count -- number of frames to encode (default 100)\n");
+    printf("\t-q quality -- JPEG quality (default 80)\n");
+    printf("\t-t threads -- threads compressing JPEG strips (default 1)\n");
+    printf("\t-e encoder -- jpeg, jpeg-strips"
+#if WITH_GST
+           " or gst:ELEMENT, can be repeated"
+#else
+           ", can be repeated"
+#endif
+           " (default jpeg and jpeg-strips)\n");
+    printf("\n");
+    printf("\t-h or --help     -- print this help message\n");
+
+    exit(1);
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::pair<unsigned, unsigned>> sizes;
+    std::vector<std::string> encoders;
+    const char *input = nullptr;
+    unsigned count = 100;
+    int quality = 80;
+    unsigned threads = 1;
+    int opt;
+    static const struct option long_options[] = {
+        { "help", no_argument, NULL, 'h'},
+        { 0, 0, 0, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "hs:i:n:q:t:e:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 's': {
+            unsigned width, height;
+            if (sscanf(optarg, "%ux%u", &width, &height) != 2 || width < 16 || height < 16) {
+                fprintf(stderr, "Invalid frame size '%s'\n", optarg);
+                usage(argv[0]);
+            }
+            sizes.push_back({width, height});
+            break;
+        }
+        case 'i':
+            input = optarg;
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'q':
+            quality = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'e':
+            encoders.push_back(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            break;
+        }
+    }
+
+    if (count < 1 || threads < 1 || (input && sizes.size() != 1)) {
+        usage(argv[0]);
+    }
+    if (sizes.empty()) {
+        sizes = { {1280, 720}, {1920, 1080}, {3840, 2160} };
+    }
+    if (encoders.empty()) {
+        encoders = { "jpeg", "jpeg-strips" };
+    }
+
+#if WITH_GST
+    gst_init(&argc, &argv);
+#endif
+
+    try {
+        for (const auto &size: sizes) {
+            Frames frames = input ?
+                read_frames(input, size.first, size.second, count) :
+                make_synthetic_frames(size.first, size.second, std::min(count, 16u));
+
+            for (const std::string &name: encoders) {
+                std::unique_ptr<Encoder> encoder;
+                if (name == "jpeg") {
+                    encoder.reset(new JpegEncoder(quality));
+                } else if (name == "jpeg-strips") {
+                    encoder.reset(new JpegStripsEncoder(quality, threads));
+#if WITH_GST
+                } else if (name.compare(0, 4, "gst:") == 0) {
+                    encoder.reset(new GstEncoder(name.substr(4)));
+#endif
+                } else {
+                    throw std::runtime_error("Unknown encoder '" + name + "'");
+                }
+                run(*encoder, frames, count);
+            }
+        }
+    }
+    catch (std::exception &err) {
+        fprintf(stderr, "%s\n", err.what());
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,181 @@
+/* Results of the plugins' probing kept across the agent runs.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "capability-cache.hpp"
+
+#include <fstream>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <dlfcn.h>
+#include <sys/stat.h>
+
+
+namespace spice {
+namespace streaming_agent {
+
+namespace {
+
+const char header[] = "# spice-streaming-agent capability cache";
+
+std::string stamp(const std::string &path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return "- " + path;
+    }
+    return std::to_string(st.st_mtim.tv_sec) + "." +
+        std::to_string(st.st_mtim.tv_nsec) + " " + path;
+}
+
+// create the directory and its parent, they usually exist
+void make_directory(const std::string &filename)
+{
+    const size_t slash = filename.rfind('/');
+    if (slash == std::string::npos || slash == 0) {
+        return;
+    }
+    const std::string dir = filename.substr(0, slash);
+    if (mkdir(dir.c_str(), 0700) != 0 && errno == ENOENT) {
+        make_directory(dir);
+        mkdir(dir.c_str(), 0700);
+    }
+}
+
+} // namespace
+
+CapabilityCache::CapabilityCache(const std::string &filename,
+                                 const std::vector<std::string> &dependencies):
+    cache_filename(filename)
+{
+    for (const auto &dependency: dependencies) {
+        stamps.push_back(stamp(dependency));
+    }
+    load();
+}
+
+bool CapabilityCache::lookup(const std::string &key, std::string &value) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto entry = entries.find(key);
+    if (entry == entries.end()) {
+        return false;
+    }
+    value = entry->second;
+    return true;
+}
+
+void CapabilityCache::store(const std::string &key, const std::string &value)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto entry = entries.find(key);
+    if (entry != entries.end() && entry->second == value) {
+        return;
+    }
+    entries[key] = value;
+    save();
+}
+
+void CapabilityCache::remove(const std::string &key)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (entries.erase(key)) {
+        save();
+    }
+}
+
+void CapabilityCache::load()
+{
+    if (cache_filename.empty()) {
+        return;
+    }
+    std::ifstream file(cache_filename);
+    std::string line;
+    if (!std::getline(file, line) || line != header) {
+        return;
+    }
+
+    std::vector<std::string> saved_stamps;
+    std::map<std::string, std::string> saved_entries;
+    while (std::getline(file, line)) {
+        if (line.empty()) {
+            continue;
+        }
+        if (line[0] == '@') {
+            saved_stamps.push_back(line.substr(1));
+            continue;
+        }
+        const size_t equal = line.find('=');
+        if (equal == std::string::npos) {
+            syslog(LOG_WARNING, "Ignoring the invalid capability cache \"%s\"",
+                   cache_filename.c_str());
+            return;
+        }
+        saved_entries[line.substr(0, equal)] = line.substr(equal + 1);
+    }
+
+    if (saved_stamps == stamps) {
+        entries.swap(saved_entries);
+    }
+}
+
+void CapabilityCache::save() const
+{
+    if (cache_filename.empty()) {
+        return;
+    }
+    make_directory(cache_filename);
+
+    // another agent reading the file never sees it partially written
+    const std::string tmp_filename = cache_filename + ".tmp";
+    FILE *file = fopen(tmp_filename.c_str(), "w");
+    if (!file) {
+        syslog(LOG_WARNING, "Failed to open the capability cache \"%s\": %s",
+               tmp_filename.c_str(), strerror(errno));
+        return;
+    }
+
+    std::string content = std::string(header) + "\n";
+    for (const auto &dependency: stamps) {
+        content += "@" + dependency + "\n";
+    }
+    for (const auto &entry: entries) {
+        content += entry.first + "=" + entry.second + "\n";
+    }
+    const bool written = fwrite(content.data(), content.size(), 1, file) == 1;
+    if (fclose(file) != 0 || !written ||
+        rename(tmp_filename.c_str(), cache_filename.c_str()) != 0) {
+        syslog(LOG_WARNING, "Failed to write the capability cache \"%s\": %s",
+               cache_filename.c_str(), strerror(errno));
+        ::remove(tmp_filename.c_str());
+    }
+}
+
+std::string CapabilityCache::default_directory()
+{
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    if (cache_home && cache_home[0] == '/') {
+        return std::string(cache_home) + "/spice-streaming-agent";
+    }
+    const char *home = getenv("HOME");
+    if (home && home[0] == '/') {
+        return std::string(home) + "/.cache/spice-streaming-agent";
+    }
+    return std::string();
+}
+
+std::string CapabilityCache::module_path(const void *symbol)
+{
+    Dl_info info;
+    if (!dladdr(symbol, &info) || !info.dli_fname) {
+        return std::string();
+    }
+    return info.dli_fname;
+}
+
+}} // namespace spice::streaming_agent
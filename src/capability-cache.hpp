@@ -0,0 +1,64 @@
+/* Results of the plugins' probing kept across the agent runs.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_CAPABILITY_CACHE_HPP
+#define SPICE_STREAMING_AGENT_CAPABILITY_CACHE_HPP
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Key/value pairs saved in a small text file, so a plugin does not have to
+ * scan the encoders again at every start.
+ *
+ * The file records the modification times of the files the results depend
+ * on, like the plugin itself and the GStreamer plugin directories. When any
+ * of them changed, was created or was removed the saved entries are
+ * ignored. Failing to read or write the file is not an error, the cache is
+ * then simply empty.
+ *
+ * Keys must not contain '=' and neither keys nor values can contain new
+ * lines.
+ */
+class CapabilityCache
+{
+public:
+    CapabilityCache(const std::string &filename, const std::vector<std::string> &dependencies);
+
+    bool lookup(const std::string &key, std::string &value) const;
+    /*! Set the entry and save the file */
+    void store(const std::string &key, const std::string &value);
+    /*! Remove the entry, if it was found to be wrong */
+    void remove(const std::string &key);
+
+    const std::string &filename() const { return cache_filename; }
+
+    /*! Directory of the cache files, under $XDG_CACHE_HOME or ~/.cache,
+     * empty if neither is known */
+    static std::string default_directory();
+    /*! File name of the shared object defining symbol, empty if unknown */
+    static std::string module_path(const void *symbol);
+
+private:
+    void load();
+    void save() const;
+
+    const std::string cache_filename;
+    // "<mtime> <path>" of each dependency, "-" as mtime for missing files
+    std::vector<std::string> stamps;
+    std::map<std::string, std::string> entries;
+    mutable std::mutex mutex;
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_CAPABILITY_CACHE_HPP
@@ -0,0 +1,396 @@
+/* Conversion of the captured BGRx frames to the YUV 4:2:0 formats taken
+ * by the encoders.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "color-convert.hpp"
+
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_AVX2_KERNEL 1
+#include <immintrin.h>
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+
+namespace spice {
+namespace streaming_agent {
+
+namespace {
+
+/* BT.709 limited range coefficients scaled by 256. The chroma is computed
+ * from the rounded average of 2x2 pixels. The SIMD kernels use the same
+ * integer operations, the intermediate values fit in 16 bits. */
+
+inline uint8_t luma(unsigned b, unsigned g, unsigned r)
+{
+    return ((16 * b + 157 * g + 47 * r + 128) >> 8) + 16;
+}
+
+inline uint8_t chroma_u(int b, int g, int r)
+{
+    return ((112 * b - 86 * g - 26 * r + 128) >> 8) + 128;
+}
+
+inline uint8_t chroma_v(int b, int g, int r)
+{
+    return ((-10 * b - 102 * g + 112 * r + 128) >> 8) + 128;
+}
+
+/* Convert the pixels of two rows starting at x, which must be even.
+ * For NV12 u points to the interleaved chroma and v is not used. */
+void convert_pixels(const uint8_t *row0, const uint8_t *row1, unsigned x, unsigned width,
+                    uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, bool interleaved)
+{
+    for (; x < width; x += 2) {
+        const uint8_t *p0 = row0 + 4 * x, *p1 = row1 + 4 * x;
+        y0[x] = luma(p0[0], p0[1], p0[2]);
+        y1[x] = luma(p1[0], p1[1], p1[2]);
+        unsigned b = p0[0] + p1[0], g = p0[1] + p1[1], r = p0[2] + p1[2];
+        if (x + 1 < width) {
+            y0[x + 1] = luma(p0[4], p0[5], p0[6]);
+            y1[x + 1] = luma(p1[4], p1[5], p1[6]);
+            b += p0[4] + p1[4];
+            g += p0[5] + p1[5];
+            r += p0[6] + p1[6];
+        } else {
+            // the last column of an odd width is averaged with itself
+            b *= 2;
+            g *= 2;
+            r *= 2;
+        }
+        b = (b + 2) >> 2;
+        g = (g + 2) >> 2;
+        r = (r + 2) >> 2;
+        if (interleaved) {
+            u[x] = chroma_u(b, g, r);
+            u[x + 1] = chroma_v(b, g, r);
+        } else {
+            u[x / 2] = chroma_u(b, g, r);
+            v[x / 2] = chroma_v(b, g, r);
+        }
+    }
+}
+
+/* The x86 kernels split the BGRx pixels in 16 bits lanes, the B,R pairs
+ * and the G,X pairs, so _mm_madd_epi16 computes a sum of products for
+ * each pixel in 32 bits lanes. */
+
+#if defined(__SSE2__) || HAVE_AVX2_KERNEL
+// the coefficients of a pair of 16 bits lanes
+inline int coefficients(int16_t low, int16_t high)
+{
+    return (uint16_t) low | (uint32_t) (uint16_t) high << 16;
+}
+#endif
+
+#if defined(__SSE2__)
+inline __m128i luma_sse2(__m128i br, __m128i gx)
+{
+    __m128i y = _mm_add_epi32(_mm_madd_epi16(br, _mm_set1_epi32(coefficients(16, 47))),
+                              _mm_madd_epi16(gx, _mm_set1_epi32(coefficients(157, 0))));
+    y = _mm_srli_epi32(_mm_add_epi32(y, _mm_set1_epi32(128)), 8);
+    return _mm_add_epi32(y, _mm_set1_epi32(16));
+}
+
+inline __m128i chroma_sse2(__m128i br, __m128i gx, __m128i cbr, __m128i cgx)
+{
+    __m128i c = _mm_add_epi32(_mm_madd_epi16(br, cbr), _mm_madd_epi16(gx, cgx));
+    c = _mm_srai_epi32(_mm_add_epi32(c, _mm_set1_epi32(128)), 8);
+    return _mm_add_epi32(c, _mm_set1_epi32(128));
+}
+
+// keep the even 32 bits lanes, where the chroma of the pixel pairs is
+inline __m128i even_lanes_sse2(__m128i a, __m128i b)
+{
+    return _mm_unpacklo_epi64(_mm_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0)),
+                              _mm_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 2, 0)));
+}
+
+template <bool interleaved>
+unsigned convert_sse2(const uint8_t *row0, const uint8_t *row1, unsigned width,
+                      uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v)
+{
+    const __m128i low_bytes = _mm_set1_epi16(0xff);
+    const __m128i cu_br = _mm_set1_epi32(coefficients(112, -26));
+    const __m128i cu_gx = _mm_set1_epi32(coefficients(-86, 0));
+    const __m128i cv_br = _mm_set1_epi32(coefficients(-10, 112));
+    const __m128i cv_gx = _mm_set1_epi32(coefficients(-102, 0));
+
+    unsigned x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i l0[4], l1[4], cu[4], cv[4];
+        for (unsigned n = 0; n < 4; ++n) {
+            const __m128i p0 = _mm_loadu_si128((const __m128i *) (row0 + 4 * x) + n);
+            const __m128i p1 = _mm_loadu_si128((const __m128i *) (row1 + 4 * x) + n);
+            const __m128i br0 = _mm_and_si128(p0, low_bytes), gx0 = _mm_srli_epi16(p0, 8);
+            const __m128i br1 = _mm_and_si128(p1, low_bytes), gx1 = _mm_srli_epi16(p1, 8);
+            l0[n] = luma_sse2(br0, gx0);
+            l1[n] = luma_sse2(br1, gx1);
+
+            // sum the pixel pairs of both rows, then round the average
+            __m128i br = _mm_add_epi16(br0, br1), gx = _mm_add_epi16(gx0, gx1);
+            br = _mm_add_epi16(br, _mm_srli_epi64(br, 32));
+            gx = _mm_add_epi16(gx, _mm_srli_epi64(gx, 32));
+            br = _mm_srli_epi16(_mm_add_epi16(br, _mm_set1_epi16(2)), 2);
+            gx = _mm_srli_epi16(_mm_add_epi16(gx, _mm_set1_epi16(2)), 2);
+            cu[n] = chroma_sse2(br, gx, cu_br, cu_gx);
+            cv[n] = chroma_sse2(br, gx, cv_br, cv_gx);
+        }
+
+        _mm_storeu_si128((__m128i *) (y0 + x),
+                         _mm_packus_epi16(_mm_packs_epi32(l0[0], l0[1]),
+                                          _mm_packs_epi32(l0[2], l0[3])));
+        _mm_storeu_si128((__m128i *) (y1 + x),
+                         _mm_packus_epi16(_mm_packs_epi32(l1[0], l1[1]),
+                                          _mm_packs_epi32(l1[2], l1[3])));
+
+        const __m128i u8 = _mm_packus_epi16(_mm_packs_epi32(even_lanes_sse2(cu[0], cu[1]),
+                                                            even_lanes_sse2(cu[2], cu[3])),
+                                            _mm_setzero_si128());
+        const __m128i v8 = _mm_packus_epi16(_mm_packs_epi32(even_lanes_sse2(cv[0], cv[1]),
+                                                            even_lanes_sse2(cv[2], cv[3])),
+                                            _mm_setzero_si128());
+        if (interleaved) {
+            _mm_storeu_si128((__m128i *) (u + x), _mm_unpacklo_epi8(u8, v8));
+        } else {
+            _mm_storel_epi64((__m128i *) (u + x / 2), u8);
+            _mm_storel_epi64((__m128i *) (v + x / 2), v8);
+        }
+    }
+    return x;
+}
+#endif
+
+#if HAVE_AVX2_KERNEL
+/* Same as the SSE2 kernel with twice the pixels. The packing instructions
+ * work within 128 bits lanes, the results are put back in order with
+ * cross lane permutations. */
+
+AVX2_TARGET inline __m256i luma_avx2(__m256i br, __m256i gx)
+{
+    __m256i y = _mm256_add_epi32(_mm256_madd_epi16(br, _mm256_set1_epi32(coefficients(16, 47))),
+                                 _mm256_madd_epi16(gx, _mm256_set1_epi32(coefficients(157, 0))));
+    y = _mm256_srli_epi32(_mm256_add_epi32(y, _mm256_set1_epi32(128)), 8);
+    return _mm256_add_epi32(y, _mm256_set1_epi32(16));
+}
+
+AVX2_TARGET inline __m256i chroma_avx2(__m256i br, __m256i gx, __m256i cbr, __m256i cgx)
+{
+    __m256i c = _mm256_add_epi32(_mm256_madd_epi16(br, cbr), _mm256_madd_epi16(gx, cgx));
+    c = _mm256_srai_epi32(_mm256_add_epi32(c, _mm256_set1_epi32(128)), 8);
+    return _mm256_add_epi32(c, _mm256_set1_epi32(128));
+}
+
+AVX2_TARGET inline __m256i even_lanes_avx2(__m256i a, __m256i b)
+{
+    const __m256i ab = _mm256_unpacklo_epi64(_mm256_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0)),
+                                             _mm256_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 2, 0)));
+    return _mm256_permute4x64_epi64(ab, _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+template <bool interleaved>
+AVX2_TARGET unsigned convert_avx2(const uint8_t *row0, const uint8_t *row1, unsigned width,
+                                  uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v)
+{
+    const __m256i low_bytes = _mm256_set1_epi16(0xff);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    const __m256i cu_br = _mm256_set1_epi32(coefficients(112, -26));
+    const __m256i cu_gx = _mm256_set1_epi32(coefficients(-86, 0));
+    const __m256i cv_br = _mm256_set1_epi32(coefficients(-10, 112));
+    const __m256i cv_gx = _mm256_set1_epi32(coefficients(-102, 0));
+
+    unsigned x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m256i l0[4], l1[4], cu[4], cv[4];
+        for (unsigned n = 0; n < 4; ++n) {
+            const __m256i p0 = _mm256_loadu_si256((const __m256i *) (row0 + 4 * x) + n);
+            const __m256i p1 = _mm256_loadu_si256((const __m256i *) (row1 + 4 * x) + n);
+            const __m256i br0 = _mm256_and_si256(p0, low_bytes), gx0 = _mm256_srli_epi16(p0, 8);
+            const __m256i br1 = _mm256_and_si256(p1, low_bytes), gx1 = _mm256_srli_epi16(p1, 8);
+            l0[n] = luma_avx2(br0, gx0);
+            l1[n] = luma_avx2(br1, gx1);
+
+            __m256i br = _mm256_add_epi16(br0, br1), gx = _mm256_add_epi16(gx0, gx1);
+            br = _mm256_add_epi16(br, _mm256_srli_epi64(br, 32));
+            gx = _mm256_add_epi16(gx, _mm256_srli_epi64(gx, 32));
+            br = _mm256_srli_epi16(_mm256_add_epi16(br, _mm256_set1_epi16(2)), 2);
+            gx = _mm256_srli_epi16(_mm256_add_epi16(gx, _mm256_set1_epi16(2)), 2);
+            cu[n] = chroma_avx2(br, gx, cu_br, cu_gx);
+            cv[n] = chroma_avx2(br, gx, cv_br, cv_gx);
+        }
+
+        __m256i y = _mm256_packus_epi16(_mm256_packs_epi32(l0[0], l0[1]),
+                                        _mm256_packs_epi32(l0[2], l0[3]));
+        _mm256_storeu_si256((__m256i *) (y0 + x), _mm256_permutevar8x32_epi32(y, order));
+        y = _mm256_packus_epi16(_mm256_packs_epi32(l1[0], l1[1]),
+                                _mm256_packs_epi32(l1[2], l1[3]));
+        _mm256_storeu_si256((__m256i *) (y1 + x), _mm256_permutevar8x32_epi32(y, order));
+
+        __m256i c = _mm256_packs_epi32(even_lanes_avx2(cu[0], cu[1]), even_lanes_avx2(cu[2], cu[3]));
+        c = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(c, c), order);
+        const __m128i u16 = _mm256_castsi256_si128(c);
+        c = _mm256_packs_epi32(even_lanes_avx2(cv[0], cv[1]), even_lanes_avx2(cv[2], cv[3]));
+        c = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(c, c), order);
+        const __m128i v16 = _mm256_castsi256_si128(c);
+        if (interleaved) {
+            _mm_storeu_si128((__m128i *) (u + x), _mm_unpacklo_epi8(u16, v16));
+            _mm_storeu_si128((__m128i *) (u + x) + 1, _mm_unpackhi_epi8(u16, v16));
+        } else {
+            _mm_storeu_si128((__m128i *) (u + x / 2), u16);
+            _mm_storeu_si128((__m128i *) (v + x / 2), v16);
+        }
+    }
+    return x;
+}
+#endif
+
+#if defined(__ARM_NEON)
+/* vld4 splits the channels, the luma is computed in 16 bits lanes */
+
+inline uint8x8_t luma_neon(uint8x8_t b, uint8x8_t g, uint8x8_t r)
+{
+    uint16x8_t y = vmull_u8(b, vdup_n_u8(16));
+    y = vmlal_u8(y, g, vdup_n_u8(157));
+    y = vmlal_u8(y, r, vdup_n_u8(47));
+    return vadd_u8(vrshrn_n_u16(y, 8), vdup_n_u8(16));
+}
+
+inline uint8x8_t chroma_neon(int16x8_t b, int16x8_t g, int16x8_t r, int16_t cb, int16_t cg,
+                             int16_t cr)
+{
+    int16x8_t c = vmulq_n_s16(b, cb);
+    c = vmlaq_n_s16(c, g, cg);
+    c = vmlaq_n_s16(c, r, cr);
+    c = vshrq_n_s16(vaddq_s16(c, vdupq_n_s16(128)), 8);
+    return vqmovun_s16(vaddq_s16(c, vdupq_n_s16(128)));
+}
+
+// rounded average of 2x2 pixels
+inline int16x8_t average_neon(uint8x16_t row0, uint8x16_t row1)
+{
+    return vreinterpretq_s16_u16(vrshrq_n_u16(vpadalq_u8(vpaddlq_u8(row0), row1), 2));
+}
+
+template <bool interleaved>
+unsigned convert_neon(const uint8_t *row0, const uint8_t *row1, unsigned width,
+                      uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v)
+{
+    unsigned x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const uint8x16x4_t p0 = vld4q_u8(row0 + 4 * x);
+        const uint8x16x4_t p1 = vld4q_u8(row1 + 4 * x);
+
+        vst1q_u8(y0 + x,
+                 vcombine_u8(luma_neon(vget_low_u8(p0.val[0]), vget_low_u8(p0.val[1]),
+                                       vget_low_u8(p0.val[2])),
+                             luma_neon(vget_high_u8(p0.val[0]), vget_high_u8(p0.val[1]),
+                                       vget_high_u8(p0.val[2]))));
+        vst1q_u8(y1 + x,
+                 vcombine_u8(luma_neon(vget_low_u8(p1.val[0]), vget_low_u8(p1.val[1]),
+                                       vget_low_u8(p1.val[2])),
+                             luma_neon(vget_high_u8(p1.val[0]), vget_high_u8(p1.val[1]),
+                                       vget_high_u8(p1.val[2]))));
+
+        const int16x8_t b = average_neon(p0.val[0], p1.val[0]);
+        const int16x8_t g = average_neon(p0.val[1], p1.val[1]);
+        const int16x8_t r = average_neon(p0.val[2], p1.val[2]);
+        uint8x8x2_t uv;
+        uv.val[0] = chroma_neon(b, g, r, 112, -86, -26);
+        uv.val[1] = chroma_neon(b, g, r, -10, -102, 112);
+        if (interleaved) {
+            vst2_u8(u + x, uv);
+        } else {
+            vst1_u8(u + x / 2, uv.val[0]);
+            vst1_u8(v + x / 2, uv.val[1]);
+        }
+    }
+    return x;
+}
+#endif
+
+} // namespace
+
+ColorConverter::ColorConverter(unsigned threads, bool use_simd) :
+    workers(std::max(threads, 1u))
+{
+    if (!use_simd) {
+        return;
+    }
+#if defined(__SSE2__)
+    name = "SSE2";
+    kernel_i420 = convert_sse2<false>;
+    kernel_nv12 = convert_sse2<true>;
+#endif
+#if HAVE_AVX2_KERNEL
+    if (__builtin_cpu_supports("avx2")) {
+        name = "AVX2";
+        kernel_i420 = convert_avx2<false>;
+        kernel_nv12 = convert_avx2<true>;
+    }
+#endif
+#if defined(__ARM_NEON)
+    name = "NEON";
+    kernel_i420 = convert_neon<false>;
+    kernel_nv12 = convert_neon<true>;
+#endif
+}
+
+const char *ColorConverter::kernel_name() const
+{
+    return name;
+}
+
+void ColorConverter::convert_rows(const uint8_t *src, size_t src_stride, unsigned width,
+                                  unsigned height, YuvFormat format, const YuvPlanes &dst,
+                                  unsigned row, unsigned end)
+{
+    const bool interleaved = format == YuvFormat::NV12;
+    Kernel *kernel = interleaved ? kernel_nv12 : kernel_i420;
+
+    for (; row < end; row += 2) {
+        // the last row of an odd height is averaged with itself
+        const bool pair = row + 1 < height;
+        const uint8_t *row0 = src + row * src_stride;
+        const uint8_t *row1 = pair ? row0 + src_stride : row0;
+        uint8_t *y0 = dst.data[0] + row * dst.stride[0];
+        uint8_t *y1 = pair ? y0 + dst.stride[0] : y0;
+        uint8_t *u = dst.data[1] + row / 2 * dst.stride[1];
+        uint8_t *v = interleaved ? nullptr : dst.data[2] + row / 2 * dst.stride[2];
+
+        const unsigned x = kernel ? kernel(row0, row1, width, y0, y1, u, v) : 0;
+        convert_pixels(row0, row1, x, width, y0, y1, u, v, interleaved);
+    }
+}
+
+void ColorConverter::convert(const uint8_t *src, size_t src_stride, unsigned width,
+                             unsigned height, YuvFormat format, const YuvPlanes &dst)
+{
+    // bands start on an even row
+    const unsigned pairs = (height + 1) / 2;
+    const unsigned bands = std::min(workers.size(), std::max(1u, height / min_band_height));
+    if (bands <= 1) {
+        convert_rows(src, src_stride, width, height, format, dst, 0, height);
+        return;
+    }
+
+    const unsigned band_height = (pairs + bands - 1) / bands * 2;
+    workers.run(bands, [&](unsigned band) {
+        const unsigned row = band * band_height;
+        const unsigned end = std::min(height, row + band_height);
+        if (row < end) {
+            convert_rows(src, src_stride, width, height, format, dst, row, end);
+        }
+    });
+}
+
+}} // namespace spice::streaming_agent
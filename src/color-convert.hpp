@@ -0,0 +1,73 @@
+/* Conversion of the captured BGRx frames to the YUV 4:2:0 formats taken
+ * by the encoders.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_COLOR_CONVERT_HPP
+#define SPICE_STREAMING_AGENT_COLOR_CONVERT_HPP
+
+#include "worker-pool.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+
+namespace spice {
+namespace streaming_agent {
+
+enum class YuvFormat
+{
+    I420,
+    NV12,
+};
+
+/*! Destination planes, NV12 only uses the first two */
+struct YuvPlanes
+{
+    uint8_t *data[3];
+    size_t stride[3];
+};
+
+/*!
+ * Converts BGRx images to YUV 4:2:0 with the BT.709 limited range matrix.
+ *
+ * The rows are converted by SIMD kernels when the CPU has them (SSE2 or
+ * AVX2 on x86, NEON on ARM), all of them giving the same result as the
+ * plain C code. With more than one thread the image is split in bands of
+ * rows converted in parallel.
+ */
+class ColorConverter
+{
+public:
+    /*! Without use_simd the plain C code is used, mostly for testing */
+    ColorConverter(unsigned threads, bool use_simd = true);
+
+    void convert(const uint8_t *src, size_t src_stride, unsigned width, unsigned height,
+                 YuvFormat format, const YuvPlanes &dst);
+
+    /*! Name of the instructions used, for the logs */
+    const char *kernel_name() const;
+
+    /*! Bands are not made smaller than this, the threads would only
+     * wait for each other */
+    static const unsigned min_band_height = 64;
+
+    typedef unsigned Kernel(const uint8_t *row0, const uint8_t *row1, unsigned width,
+                            uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v);
+
+private:
+    void convert_rows(const uint8_t *src, size_t src_stride, unsigned width, unsigned height,
+                      YuvFormat format, const YuvPlanes &dst, unsigned row, unsigned end);
+
+    WorkerPool workers;
+    const char *name = "C";
+    // convert the leading pixels of two rows, return how many
+    Kernel *kernel_i420 = nullptr;
+    Kernel *kernel_nv12 = nullptr;
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_COLOR_CONVERT_HPP
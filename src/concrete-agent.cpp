@@ -12,6 +12,7 @@
 #include <string>
 
 #include "concrete-agent.hpp"
+#include "frame-log.hpp"
 
 using namespace spice::streaming_agent;
 
@@ -25,11 +26,20 @@ static inline unsigned MinorVersion(unsigned version)
     return version & 0xffu;
 }
 
-ConcreteAgent::ConcreteAgent()
+// enough for a frame being sent, one queued and one being captured
+static const unsigned frame_buffers = 4;
+
+ConcreteAgent::ConcreteAgent():
+    buffer_pool(frame_buffers)
 {
     options.push_back(ConcreteConfigureOption(nullptr, nullptr));
 }
 
+ConcreteAgent::~ConcreteAgent()
+{
+    WaitPreparedCapture();
+}
+
 bool ConcreteAgent::PluginVersionIsCompatible(unsigned pluginVersion) const
 {
     unsigned version = PluginVersion;
@@ -55,6 +65,22 @@ void ConcreteAgent::AddOption(const char *name, const char *value)
     options.insert(--options.end(), ConcreteConfigureOption(name, value));
 }
 
+FrameBuffer *ConcreteAgent::AcquireFrameBuffer(size_t size)
+{
+    return buffer_pool.Acquire(size);
+}
+
+void ConcreteAgent::WaitNextFrame(unsigned fps)
+{
+    scheduler.wait(fps);
+    last_wake_time = FrameLog::get_time();
+}
+
+void ConcreteAgent::RestartSchedule()
+{
+    scheduler.restart();
+}
+
 void ConcreteAgent::LoadPlugins(const std::string &directory)
 {
     std::string pattern = directory + "/*.so";
@@ -76,7 +102,9 @@ void ConcreteAgent::LoadPlugins(const std::string &directory)
 
 void ConcreteAgent::LoadPlugin(const std::string &plugin_filename)
 {
-    void *dl = dlopen(plugin_filename.c_str(), RTLD_LOCAL|RTLD_NOW);
+    // the symbols are resolved when used, most of a plugin's code does
+    // not run if the plugin is not chosen
+    void *dl = dlopen(plugin_filename.c_str(), RTLD_LOCAL|RTLD_LAZY);
     if (!dl) {
         syslog(LOG_ERR, "error loading plugin %s: %s",
                plugin_filename.c_str(), dlerror());
@@ -113,35 +141,137 @@ void ConcreteAgent::LoadPlugin(const std::string &plugin_filename)
     }
 }
 
-FrameCapture *ConcreteAgent::GetBestFrameCapture(const std::set<SpiceVideoCodecType>& codecs)
+std::vector<std::shared_ptr<Plugin>>
+ConcreteAgent::SortedPlugins(const std::set<SpiceVideoCodecType>& codecs)
 {
-    std::vector<std::pair<unsigned, std::shared_ptr<Plugin>>> sorted_plugins;
+    std::vector<std::pair<unsigned, std::shared_ptr<Plugin>>> ranked_plugins;
 
     // sort plugins base on ranking, reverse order
     for (const auto& plugin: plugins) {
-        sorted_plugins.push_back(make_pair(plugin->Rank(), plugin));
+        ranked_plugins.push_back(make_pair(plugin->Rank(), plugin));
     }
-    sort(sorted_plugins.rbegin(), sorted_plugins.rend());
+    sort(ranked_plugins.rbegin(), ranked_plugins.rend());
 
-    // return first not null
-    for (const auto& plugin: sorted_plugins) {
+    std::vector<std::shared_ptr<Plugin>> sorted_plugins;
+    for (const auto& plugin: ranked_plugins) {
         if (plugin.first == DontUse) {
             break;
         }
         // check client supports the codec
         if (codecs.find(plugin.second->VideoCodecType()) == codecs.end())
             continue;
+        sorted_plugins.push_back(plugin.second);
+    }
+    return sorted_plugins;
+}
 
-        FrameCapture *capture;
-        try {
-            capture = plugin.second->CreateCapture();
-        } catch (const std::exception &err) {
-            syslog(LOG_ERR, "Error creating capture engine: %s", err.what());
-            continue;
-        }
+FrameCapture *ConcreteAgent::CreatePluginCapture(Plugin &plugin)
+{
+    try {
+        return plugin.CreateCapture();
+    } catch (const std::exception &err) {
+        syslog(LOG_ERR, "Error creating capture engine: %s", err.what());
+        return nullptr;
+    }
+}
+
+FrameCapture *ConcreteAgent::CreateFrameCapture(const std::set<SpiceVideoCodecType>& codecs,
+                                                Plugin *&creator)
+{
+    // return first not null
+    for (const auto& plugin: SortedPlugins(codecs)) {
+        FrameCapture *capture = CreatePluginCapture(*plugin);
         if (capture) {
+            creator = plugin.get();
             return capture;
         }
     }
+    creator = nullptr;
     return nullptr;
 }
+
+FrameCapture *ConcreteAgent::GetBestFrameCapture(const std::set<SpiceVideoCodecType>& codecs)
+{
+    Plugin *creator;
+    return CreateFrameCapture(codecs, creator);
+}
+
+void ConcreteAgent::WaitPreparedCapture()
+{
+    if (preparer.joinable()) {
+        preparer.join();
+    }
+}
+
+std::unique_ptr<FrameCapture>
+ConcreteAgent::TakeFrameCapture(const std::set<SpiceVideoCodecType>& codecs, Plugin *&creator)
+{
+    // a plugin which failed to create a capture may work now, the plugins
+    // are tried in order and the cached capture of the first one working
+    // is reused, the captures of the other plugins are kept
+    for (const auto& plugin: SortedPlugins(codecs)) {
+        std::unique_ptr<FrameCapture> capture;
+        auto cached = cached_captures.find(plugin.get());
+        if (cached != cached_captures.end()) {
+            syslog(LOG_DEBUG, "reusing the previous capture engine");
+            capture = std::move(cached->second);
+            cached_captures.erase(cached);
+            capture->Reset();
+        } else {
+            capture.reset(CreatePluginCapture(*plugin));
+        }
+        if (capture) {
+            creator = plugin.get();
+            return capture;
+        }
+    }
+    creator = nullptr;
+    return std::unique_ptr<FrameCapture>();
+}
+
+std::unique_ptr<FrameCapture>
+ConcreteAgent::GetFrameCapture(const std::set<SpiceVideoCodecType>& codecs)
+{
+    WaitPreparedCapture();
+    return TakeFrameCapture(codecs, active_plugin);
+}
+
+void ConcreteAgent::ReleaseFrameCapture(std::unique_ptr<FrameCapture> capture)
+{
+    WaitPreparedCapture();
+
+    if (capture && active_plugin) {
+        cached_captures[active_plugin] = std::move(capture);
+    }
+    active_plugin = nullptr;
+}
+
+void ConcreteAgent::PrepareFrameCapture(const std::set<SpiceVideoCodecType>& codecs)
+{
+    WaitPreparedCapture();
+
+    // creating a capture may take seconds, for instance to start an encoder
+    preparer = std::thread([this, codecs] {
+        Plugin *creator;
+        std::unique_ptr<FrameCapture> capture(TakeFrameCapture(codecs, creator));
+        if (capture) {
+            cached_captures[creator] = std::move(capture);
+        }
+    });
+}
+
+std::set<SpiceVideoCodecType> ConcreteAgent::SupportedCodecs() const
+{
+    std::set<SpiceVideoCodecType> codecs;
+    for (const auto& plugin: plugins) {
+        codecs.insert(plugin->VideoCodecType());
+    }
+    return codecs;
+}
+
+bool ConcreteAgent::CanCapture(const std::set<SpiceVideoCodecType>& codecs)
+{
+    // the plugins are ranked by the preparing thread too
+    WaitPreparedCapture();
+    return !SortedPlugins(codecs).empty();
+}
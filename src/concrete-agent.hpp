@@ -7,10 +7,18 @@
 #define SPICE_STREAMING_AGENT_CONCRETE_AGENT_HPP
 
 #include <vector>
+#include <map>
 #include <set>
 #include <memory>
+#include <atomic>
+#include <thread>
 #include <spice-streaming-agent/plugin.hpp>
 
+#include "frame-buffer-pool.hpp"
+#include "frame-scheduler.hpp"
+#include "metrics.hpp"
+#include "rate-controller.hpp"
+
 namespace spice {
 namespace streaming_agent {
 
@@ -27,17 +35,64 @@ class ConcreteAgent final : public Agent
 {
 public:
     ConcreteAgent();
+    ~ConcreteAgent();
     void Register(Plugin& plugin) override;
     const ConfigureOption* Options() const override;
+    FrameBuffer *AcquireFrameBuffer(size_t size) override;
+    FrameBufferPool &BufferPool() { return buffer_pool; }
+    double RateFactor() const override { return rate_controller.factor(); }
+    RateController &RateControl() { return rate_controller; }
+    void WaitNextFrame(unsigned fps) override;
+    void RestartSchedule() override;
+    FrameScheduler &Scheduler() { return scheduler; }
+    unsigned KeyframeRequests() const override { return keyframe_requests; }
+    /*! Ask the capture for a keyframe, see Agent::KeyframeRequests() */
+    void RequestKeyframe() { ++keyframe_requests; }
+    /*! Time WaitNextFrame() last returned, see FrameLog::get_time() */
+    uint64_t LastWakeTime() const { return last_wake_time; }
+    Metrics &GetMetrics() { return metrics; }
     void LoadPlugins(const std::string &directory);
     // pointer must remain valid
     void AddOption(const char *name, const char *value);
     FrameCapture *GetBestFrameCapture(const std::set<SpiceVideoCodecType>& codecs);
+    /*! Like GetBestFrameCapture() but reuses a capture given back with
+     * ReleaseFrameCapture() or prepared by PrepareFrameCapture() when its
+     * plugin is still the best one for codecs */
+    std::unique_ptr<FrameCapture> GetFrameCapture(const std::set<SpiceVideoCodecType>& codecs);
+    /*! Keep a capture returned by GetFrameCapture() for the next streams,
+     * one per plugin, so switching back and forth between codecs, e.g.
+     * with the screen content, reuses them */
+    void ReleaseFrameCapture(std::unique_ptr<FrameCapture> capture);
+    /*! Create in a background thread the capture GetFrameCapture() would
+     * return for codecs, so the next stream starts without waiting for it */
+    void PrepareFrameCapture(const std::set<SpiceVideoCodecType>& codecs);
+    /*! Codecs the registered plugins can encode */
+    std::set<SpiceVideoCodecType> SupportedCodecs() const;
+    /*! Whether a usable plugin encodes one of codecs */
+    bool CanCapture(const std::set<SpiceVideoCodecType>& codecs);
 private:
     bool PluginVersionIsCompatible(unsigned pluginVersion) const;
     void LoadPlugin(const std::string &plugin_filename);
+    std::vector<std::shared_ptr<Plugin>> SortedPlugins(const std::set<SpiceVideoCodecType>& codecs);
+    FrameCapture *CreatePluginCapture(Plugin &plugin);
+    FrameCapture *CreateFrameCapture(const std::set<SpiceVideoCodecType>& codecs, Plugin *&creator);
+    std::unique_ptr<FrameCapture> TakeFrameCapture(const std::set<SpiceVideoCodecType>& codecs,
+                                                   Plugin *&creator);
+    void WaitPreparedCapture();
     std::vector<std::shared_ptr<Plugin>> plugins;
     std::vector<ConcreteConfigureOption> options;
+    FrameBufferPool buffer_pool;
+    RateController rate_controller;
+    FrameScheduler scheduler;
+    std::atomic<uint64_t> last_wake_time{0};
+    std::atomic<unsigned> keyframe_requests{0};
+    Metrics metrics;
+    // the captures kept warm by the plugin which created them, last so
+    // they are destroyed before the buffers they may hold
+    std::map<Plugin *, std::unique_ptr<FrameCapture>> cached_captures;
+    // plugin of the capture in use
+    Plugin *active_plugin = nullptr;
+    std::thread preparer;
 };
 
 }} // namespace spice::streaming_agent
@@ -13,53 +13,19 @@
 #include <spice/enums.h>
 
 #include <cstring>
-#include <functional>
-#include <memory>
-#include <X11/extensions/Xfixes.h>
+#include <syslog.h>
+#include <X11/extensions/XInput2.h>
 
 
 namespace spice {
 namespace streaming_agent {
 
-namespace {
-
-void send_cursor(StreamPort &stream_port, unsigned width, unsigned height, int hotspot_x, int hotspot_y,
-                 std::function<void(uint32_t *)> fill_cursor)
-{
-    if (width >= STREAM_MSG_CURSOR_SET_MAX_WIDTH || height >= STREAM_MSG_CURSOR_SET_MAX_HEIGHT) {
-        return;
-    }
-
-    size_t cursor_size =
-        sizeof(StreamDevHeader) + sizeof(StreamMsgCursorSet) +
-        width * height * sizeof(uint32_t);
-    std::unique_ptr<uint8_t[]> msg(new uint8_t[cursor_size]);
-
-    StreamDevHeader &dev_hdr(*reinterpret_cast<StreamDevHeader*>(msg.get()));
-    memset(&dev_hdr, 0, sizeof(dev_hdr));
-    dev_hdr.protocol_version = STREAM_DEVICE_PROTOCOL;
-    dev_hdr.type = STREAM_TYPE_CURSOR_SET;
-    dev_hdr.size = cursor_size - sizeof(StreamDevHeader);
-
-    StreamMsgCursorSet &cursor_msg(*reinterpret_cast<StreamMsgCursorSet *>(msg.get() + sizeof(StreamDevHeader)));
-    memset(&cursor_msg, 0, sizeof(cursor_msg));
-
-    cursor_msg.type = SPICE_CURSOR_TYPE_ALPHA;
-    cursor_msg.width = width;
-    cursor_msg.height = height;
-    cursor_msg.hot_spot_x = hotspot_x;
-    cursor_msg.hot_spot_y = hotspot_y;
-
-    uint32_t *pixels = reinterpret_cast<uint32_t *>(cursor_msg.data);
-    fill_cursor(pixels);
-
-    std::lock_guard<std::mutex> guard(stream_port.mutex);
-    stream_port.write(msg.get(), cursor_size);
-}
-
-} // namespace
-
-CursorUpdater::CursorUpdater(StreamPort *stream_port) : stream_port(stream_port)
+CursorUpdater::CursorUpdater(StreamWriter *stream_writer, bool track_position,
+                             const std::string &output, const StreamSize *stream_size,
+                             Metrics *metrics) :
+    stream_writer(stream_writer),
+    stream_size(stream_size),
+    metrics(metrics)
 {
     display = XOpenDisplay(nullptr);
     if (display == nullptr) {
@@ -72,6 +38,32 @@ CursorUpdater::CursorUpdater(StreamPort *stream_port) : stream_port(stream_port)
     }
 
     XFixesSelectCursorInput(display, DefaultRootWindow(display), XFixesDisplayCursorNotifyMask);
+
+    if (track_position) {
+        output_selector.reset(new OutputSelector(display, output));
+        select_motion_events();
+    }
+}
+
+void CursorUpdater::select_motion_events()
+{
+    int event_base, error_base;
+    int major = 2, minor = 0;
+    if (!XQueryExtension(display, "XInputExtension", &xi_opcode, &event_base, &error_base) ||
+        XIQueryVersion(display, &major, &minor) != Success) {
+        ::syslog(LOG_WARNING, "XInput 2 is not available, the cursor position is not sent");
+        xi_opcode = -1;
+        return;
+    }
+
+    // raw events are received whatever window the pointer is in
+    unsigned char mask_bits[XIMaskLen(XI_LASTEVENT)] = {};
+    XISetMask(mask_bits, XI_RawMotion);
+    XIEventMask mask;
+    mask.deviceid = XIAllMasterDevices;
+    mask.mask_len = sizeof(mask_bits);
+    mask.mask = mask_bits;
+    XISelectEvents(display, DefaultRootWindow(display), &mask, 1);
 }
 
 void CursorUpdater::operator()()
@@ -79,28 +71,127 @@ void CursorUpdater::operator()()
     unsigned long last_serial = 0;
 
     while (1) {
-        XEvent event;
-        XNextEvent(display, &event);
-        if (event.type != xfixes_event_base + 1) {
-            continue;
+        bool shape_changed = false, moved = false;
+
+        // handle all the pending events at once, only the current cursor matters
+        do {
+            XEvent event;
+            XNextEvent(display, &event);
+            if (event.type == xfixes_event_base + XFixesCursorNotify) {
+                shape_changed = true;
+            } else if (event.type == GenericEvent && event.xcookie.extension == xi_opcode &&
+                       event.xcookie.evtype == XI_RawMotion) {
+                moved = true;
+            }
+        } while (XPending(display));
+
+        if (shape_changed) {
+            XFixesCursorImage *cursor = XFixesGetCursorImage(display);
+            if (cursor) {
+                if (cursor->cursor_serial != last_serial) {
+                    last_serial = cursor->cursor_serial;
+                    send_cursor(cursor);
+                }
+                XFree(cursor);
+            }
         }
 
-        XFixesCursorImage *cursor = XFixesGetCursorImage(display);
-        if (!cursor) {
-            continue;
+        if (moved) {
+            send_position();
         }
+    }
+}
 
-        if (cursor->cursor_serial == last_serial) {
-            continue;
-        }
+void CursorUpdater::send_position()
+{
+    Window root, child;
+    int x, y, win_x, win_y;
+    unsigned int buttons;
+    if (!XQueryPointer(display, DefaultRootWindow(display), &root, &child,
+                       &x, &y, &win_x, &win_y, &buttons)) {
+        return;
+    }
+    const ScreenArea area = output_selector->area();
+    x -= area.x;
+    y -= area.y;
+    // the plugin scaled the frames down
+    const unsigned width = stream_size->width, height = stream_size->height;
+    if (width && height && area.width && area.height &&
+        (width != area.width || height != area.height)) {
+        x = (int64_t) x * width / area.width;
+        y = (int64_t) y * height / area.height;
+    }
+    if (x == last_x && y == last_y) {
+        return;
+    }
+    last_x = x;
+    last_y = y;
+
+    struct {
+        StreamDevHeader hdr;
+        StreamMsgCursorMove msg;
+    } move;
+    memset(&move, 0, sizeof(move));
+    move.hdr.protocol_version = STREAM_DEVICE_PROTOCOL;
+    move.hdr.type = STREAM_TYPE_CURSOR_MOVE;
+    move.hdr.size = sizeof(move.msg);
+    move.msg.x = x;
+    move.msg.y = y;
+
+    struct iovec iov = { &move, sizeof(move) };
+    // a position not sent yet is outdated by the new one
+    stream_writer->post(&iov, 1, STREAM_TYPE_CURSOR_MOVE);
+    ++metrics->cursor_moves;
+}
+
+void CursorUpdater::send_cursor(const XFixesCursorImage *cursor)
+{
+    const unsigned width = cursor->width, height = cursor->height;
+    if (width >= STREAM_MSG_CURSOR_SET_MAX_WIDTH || height >= STREAM_MSG_CURSOR_SET_MAX_HEIGHT) {
+        return;
+    }
+
+    const size_t pixels_size = width * height * sizeof(uint32_t);
+    const size_t msg_size = sizeof(StreamDevHeader) + sizeof(StreamMsgCursorSet) + pixels_size;
+    // the buffer is kept from one cursor to the next
+    message.resize(msg_size);
+
+    StreamDevHeader &dev_hdr = *reinterpret_cast<StreamDevHeader *>(message.data());
+    memset(&dev_hdr, 0, sizeof(dev_hdr));
+    dev_hdr.protocol_version = STREAM_DEVICE_PROTOCOL;
+    dev_hdr.type = STREAM_TYPE_CURSOR_SET;
+    dev_hdr.size = sizeof(StreamMsgCursorSet) + pixels_size;
+
+    StreamMsgCursorSet &cursor_msg =
+        *reinterpret_cast<StreamMsgCursorSet *>(message.data() + sizeof(StreamDevHeader));
+    memset(&cursor_msg, 0, sizeof(cursor_msg));
+    cursor_msg.type = SPICE_CURSOR_TYPE_ALPHA;
+    cursor_msg.width = width;
+    cursor_msg.height = height;
+    cursor_msg.hot_spot_x = cursor->xhot;
+    cursor_msg.hot_spot_y = cursor->yhot;
+
+    // XFixes stores each ARGB pixel in an unsigned long, a simple loop the
+    // compiler can vectorize narrows them to the 32 bits of the protocol
+    uint32_t *pixels = reinterpret_cast<uint32_t *>(message.data() + sizeof(StreamDevHeader) +
+                                                    sizeof(StreamMsgCursorSet));
+    const unsigned long *src = cursor->pixels;
+    for (size_t i = 0; i < (size_t) width * height; ++i) {
+        pixels[i] = (uint32_t) src[i];
+    }
 
-        last_serial = cursor->cursor_serial;
-        auto fill_cursor = [cursor](uint32_t *pixels) {
-            for (unsigned i = 0; i < cursor->width * cursor->height; ++i)
-                pixels[i] = cursor->pixels[i];
-        };
-        send_cursor(*stream_port, cursor->width, cursor->height, cursor->xhot, cursor->yhot, fill_cursor);
+    // only a message identical to the last one sent is dropped, like the
+    // same shape set again with a new serial, switching back to an older
+    // shape sends it again
+    if (message == last_message) {
+        return;
     }
+
+    struct iovec iov = { message.data(), message.size() };
+    // not sent yet, the previous cursor shape does not matter anymore
+    stream_writer->post(&iov, 1, STREAM_TYPE_CURSOR_SET);
+    ++metrics->cursor_updates;
+    message.swap(last_message);
 }
 
 }} // namespace spice::streaming_agent
@@ -8,25 +8,55 @@
 #ifndef SPICE_STREAMING_AGENT_CURSOR_UPDATER_HPP
 #define SPICE_STREAMING_AGENT_CURSOR_UPDATER_HPP
 
-#include "stream-port.hpp"
+#include "metrics.hpp"
+#include "stream-writer.hpp"
+#include "x11-capture.hpp"
 
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
 #include <X11/Xlib.h>
+#include <X11/extensions/Xfixes.h>
 
 
 namespace spice {
 namespace streaming_agent {
 
+/*! Size of the frames streamed, set by the agent when a stream starts */
+struct StreamSize
+{
+    std::atomic<unsigned> width{0}, height{0};
+};
+
 class CursorUpdater
 {
 public:
-    CursorUpdater(StreamPort *stream_port);
+    /*! With track_position the pointer moves are sent too, the captured
+     * frames should then not include the cursor. The position is relative
+     * to the captured output, see CaptureSettings::output, and scaled like
+     * the frames when they are smaller than the output, see stream_size */
+    CursorUpdater(StreamWriter *stream_writer, bool track_position, const std::string &output,
+                  const StreamSize *stream_size, Metrics *metrics);
 
     [[noreturn]] void operator()();
 
 private:
-    StreamPort *stream_port;
+    void select_motion_events();
+    void send_cursor(const XFixesCursorImage *cursor);
+    void send_position();
+
+    StreamWriter *stream_writer;
+    const StreamSize *stream_size;
+    Metrics *metrics;
     Display *display;  // the X11 display
     int xfixes_event_base;  // event number for the XFixes events
+    int xi_opcode = -1;  // major opcode of XInput, if the position is tracked
+    std::unique_ptr<OutputSelector> output_selector;  // area of the captured output
+    int last_x = -1, last_y = -1;  // the last position sent
+    std::vector<uint8_t> message;  // the message of the current cursor
+    std::vector<uint8_t> last_message;  // the last message sent
 };
 
 }} // namespace spice::streaming_agent
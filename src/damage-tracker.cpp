@@ -0,0 +1,144 @@
+/* A class that tracks changes of the X11 screen content through XDamage.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "damage-tracker.hpp"
+#include "frame-scheduler.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <errno.h>
+#include <poll.h>
+#include <X11/extensions/Xfixes.h>
+
+
+namespace spice {
+namespace streaming_agent {
+
+DamageTracker::DamageTracker(Display *display, Window window) : display(display)
+{
+    int error_base;
+    if (!XDamageQueryExtension(display, &damage_event_base, &error_base)) {
+        throw std::runtime_error("XDamageQueryExtension failed");
+    }
+
+    // a single event is generated when the damage becomes non empty,
+    // the next one only after it is subtracted
+    damage = XDamageCreate(display, window, XDamageReportNonEmpty);
+    if (!damage) {
+        throw std::runtime_error("XDamageCreate failed");
+    }
+}
+
+DamageTracker::~DamageTracker()
+{
+    XDamageDestroy(display, damage);
+    XSync(display, False);
+}
+
+void DamageTracker::process_events()
+{
+    while (XPending(display)) {
+        XEvent event;
+        XNextEvent(display, &event);
+        if (event.type == damage_event_base + XDamageNotify) {
+            damaged = true;
+        }
+    }
+}
+
+bool DamageTracker::wait_for_damage(int timeout_ms, const std::function<bool()> &interrupted)
+{
+    using namespace std::chrono;
+    const auto deadline = steady_clock::now() + milliseconds(timeout_ms);
+
+    process_events();
+    while (!damaged) {
+        auto remaining = duration_cast<milliseconds>(deadline - steady_clock::now()).count();
+        if (remaining <= 0 || (interrupted && interrupted())) {
+            return false;
+        }
+        if (interrupted) {
+            remaining = std::min<decltype(remaining)>(remaining, interrupt_poll_ms);
+        }
+
+        struct pollfd pollfd = {ConnectionNumber(display), POLLIN, 0};
+        if (poll(&pollfd, 1, remaining) < 0 && errno != EINTR) {
+            throw std::runtime_error("poll failed on the X connection");
+        }
+        process_events();
+    }
+
+    damaged = false;
+    XDamageSubtract(display, damage, None, None);
+    return true;
+}
+
+void DamageTracker::wait_for_settle(int max_ms)
+{
+    using namespace std::chrono;
+    auto now = [] {
+        return (uint64_t) duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+    };
+    SettleTimer timer(settle_quiet_ms * 1000000ull, std::max(max_ms, 0) * 1000000ull);
+    timer.start(now());
+
+    while (true) {
+        process_events();
+        if (damaged) {
+            // the next event only comes once the damage is subtracted
+            damaged = false;
+            XDamageSubtract(display, damage, None, None);
+            XFlush(display);
+            timer.changed(now());
+        }
+
+        const uint64_t current = now();
+        if (current >= timer.deadline()) {
+            return;
+        }
+        // rounded up, not to spin for the last fraction of a millisecond
+        const int remaining = (timer.deadline() - current + 999999) / 1000000;
+        struct pollfd pollfd = {ConnectionNumber(display), POLLIN, 0};
+        if (poll(&pollfd, 1, remaining) < 0 && errno != EINTR) {
+            throw std::runtime_error("poll failed on the X connection");
+        }
+    }
+}
+
+uint64_t DamageTracker::take_damaged_area(int x, int y, unsigned width, unsigned height)
+{
+    process_events();
+    if (!damaged) {
+        return 0;
+    }
+    damaged = false;
+
+    XserverRegion region = XFixesCreateRegion(display, nullptr, 0);
+    XDamageSubtract(display, damage, None, region);
+    int count = 0;
+    XRectangle *rects = XFixesFetchRegion(display, region, &count);
+
+    // the rectangles of a region do not overlap
+    uint64_t area = 0;
+    const int right = x + (int) width, bottom = y + (int) height;
+    for (int i = 0; i < count; ++i) {
+        const int left = std::max<int>(rects[i].x, x);
+        const int top = std::max<int>(rects[i].y, y);
+        const int w = std::min<int>(rects[i].x + rects[i].width, right) - left;
+        const int h = std::min<int>(rects[i].y + rects[i].height, bottom) - top;
+        if (w > 0 && h > 0) {
+            area += (uint64_t) w * h;
+        }
+    }
+    if (rects) {
+        XFree(rects);
+    }
+    XFixesDestroyRegion(display, region);
+    return area;
+}
+
+}} // namespace spice::streaming_agent
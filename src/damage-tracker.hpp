@@ -0,0 +1,70 @@
+/* A class that tracks changes of the X11 screen content through XDamage.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_DAMAGE_TRACKER_HPP
+#define SPICE_STREAMING_AGENT_DAMAGE_TRACKER_HPP
+
+#include <cstdint>
+#include <functional>
+#include <X11/Xlib.h>
+#include <X11/extensions/Xdamage.h>
+
+
+namespace spice {
+namespace streaming_agent {
+
+class DamageTracker
+{
+public:
+    /*! Start tracking changes of a window.
+     * Throws std::runtime_error if XDamage is not available.
+     */
+    DamageTracker(Display *display, Window window);
+    DamageTracker(const DamageTracker &) = delete;
+    DamageTracker &operator=(const DamageTracker &) = delete;
+    ~DamageTracker();
+
+    /*! Wait till the window content changes or the timeout (in milliseconds)
+     * expires.
+     * The tracked damage is cleared when this returns true, so changes made
+     * while the caller captures the window are reported by the next call.
+     * If interrupted is set, the wait also ends as soon as it returns true,
+     * it is checked every interrupt_poll_ms.
+     * \return true if the content changed, false on timeout or interruption
+     */
+    bool wait_for_damage(int timeout_ms, const std::function<bool()> &interrupted = nullptr);
+
+    static const int interrupt_poll_ms = 20;
+
+    /*! After wait_for_damage reported a change, wait till the content
+     * settles: no change for settle_quiet_ms, or max_ms (in milliseconds)
+     * elapsed. A frame is then grabbed once drawn, right after the
+     * compositor flipped it, instead of half way through, see SettleTimer.
+     * The tracked damage is cleared.
+     */
+    void wait_for_settle(int max_ms);
+
+    static const int settle_quiet_ms = 2;
+
+    /*! Report the content as changed on the next wait, e.g. after a reset */
+    void force_damage() { damaged = true; }
+
+    /*! Number of pixels of the area changed since the last call, without
+     * waiting, the tracked damage is cleared */
+    uint64_t take_damaged_area(int x, int y, unsigned width, unsigned height);
+
+private:
+    void process_events();
+
+    Display *display;
+    Damage damage;
+    int damage_event_base;  // event number for the XDamage events
+    bool damaged = true;
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_DAMAGE_TRACKER_HPP
@@ -0,0 +1,108 @@
+/* Tracking of the changed areas between consecutive frames.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "dirty-map.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+
+namespace spice {
+namespace streaming_agent {
+
+static const unsigned bytes_per_pixel = 4;
+
+const unsigned DirtyMap::tile_width;
+const unsigned DirtyMap::tile_height;
+
+void DirtyMap::reset()
+{
+    width = height = 0;
+}
+
+bool DirtyMap::tile_changed(const uint8_t *data, size_t stride, unsigned x, unsigned y,
+                            unsigned w, unsigned h) const
+{
+    const size_t prev_stride = width * bytes_per_pixel;
+    const uint8_t *cur = data + y * stride + x * bytes_per_pixel;
+    const uint8_t *prev = &previous[y * prev_stride + x * bytes_per_pixel];
+
+    // memcmp is vectorized by the C library, and stops at the first difference
+    for (unsigned line = 0; line < h; ++line) {
+        if (memcmp(cur, prev, w * bytes_per_pixel) != 0) {
+            return true;
+        }
+        cur += stride;
+        prev += prev_stride;
+    }
+    return false;
+}
+
+void DirtyMap::copy_tile(const uint8_t *data, size_t stride, unsigned x, unsigned y,
+                         unsigned w, unsigned h)
+{
+    const size_t prev_stride = width * bytes_per_pixel;
+    const uint8_t *cur = data + y * stride + x * bytes_per_pixel;
+    uint8_t *prev = &previous[y * prev_stride + x * bytes_per_pixel];
+
+    for (unsigned line = 0; line < h; ++line) {
+        memcpy(prev, cur, w * bytes_per_pixel);
+        cur += stride;
+        prev += prev_stride;
+    }
+}
+
+unsigned DirtyMap::update(const uint8_t *data, unsigned width, unsigned height, size_t stride)
+{
+    const bool all_dirty = width != this->width || height != this->height;
+
+    if (all_dirty) {
+        this->width = width;
+        this->height = height;
+        cols = (width + tile_width - 1) / tile_width;
+        tile_rows = (height + tile_height - 1) / tile_height;
+        previous.resize((size_t) width * height * bytes_per_pixel);
+        tiles.assign(cols * tile_rows, true);
+    }
+
+    dirty_count = 0;
+    for (unsigned row = 0; row < tile_rows; ++row) {
+        const unsigned y = row * tile_height;
+        const unsigned h = std::min(tile_height, height - y);
+        for (unsigned col = 0; col < cols; ++col) {
+            const unsigned x = col * tile_width;
+            const unsigned w = std::min(tile_width, width - x);
+            const bool dirty = all_dirty || tile_changed(data, stride, x, y, w, h);
+            if (dirty) {
+                copy_tile(data, stride, x, y, w, h);
+                ++dirty_count;
+            }
+            tiles[row * cols + col] = dirty;
+        }
+    }
+
+    return dirty_count;
+}
+
+bool DirtyMap::rows_dirty(unsigned y, unsigned height) const
+{
+    if (height == 0 || y >= this->height) {
+        return false;
+    }
+
+    const unsigned first = y / tile_height;
+    const unsigned last = std::min(tile_rows, (y + height + tile_height - 1) / tile_height);
+    for (unsigned row = first; row < last; ++row) {
+        for (unsigned col = 0; col < cols; ++col) {
+            if (tiles[row * cols + col]) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+}} // namespace spice::streaming_agent
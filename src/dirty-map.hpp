@@ -0,0 +1,64 @@
+/* Tracking of the changed areas between consecutive frames.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_DIRTY_MAP_HPP
+#define SPICE_STREAMING_AGENT_DIRTY_MAP_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Splits 32 bits per pixel frames in fixed size tiles and tracks which
+ * tiles changed since the previous frame.
+ *
+ * A copy of the previous frame is kept, only the changed tiles are
+ * copied on each update.
+ */
+class DirtyMap
+{
+public:
+    static const unsigned tile_width = 64;
+    static const unsigned tile_height = 16;
+
+    /*! Compare a frame with the previous one and remember it.
+     * All the tiles are dirty if the frame size changed.
+     * \return the number of dirty tiles
+     */
+    unsigned update(const uint8_t *data, unsigned width, unsigned height, size_t stride);
+
+    /*! Make all tiles dirty on the next update */
+    void reset();
+
+    unsigned columns() const { return cols; }
+    unsigned rows() const { return tile_rows; }
+    unsigned dirty_tiles() const { return dirty_count; }
+
+    bool is_dirty(unsigned col, unsigned row) const { return tiles[row * cols + col]; }
+
+    /*! Check if any tile covering the pixel rows [y, y + height) is dirty */
+    bool rows_dirty(unsigned y, unsigned height) const;
+
+private:
+    bool tile_changed(const uint8_t *data, size_t stride, unsigned x, unsigned y,
+                      unsigned w, unsigned h) const;
+    void copy_tile(const uint8_t *data, size_t stride, unsigned x, unsigned y,
+                   unsigned w, unsigned h);
+
+    std::vector<uint8_t> previous;
+    std::vector<bool> tiles;
+    unsigned width = 0, height = 0;
+    unsigned cols = 0, tile_rows = 0;
+    unsigned dirty_count = 0;
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_DIRTY_MAP_HPP
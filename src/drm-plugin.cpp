@@ -0,0 +1,686 @@
+/* Plugin capturing the scanout buffer through DRM/KMS, the buffer is
+ * passed as a DMA-BUF to a VA-API encoder without being copied.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include <config.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#include <gst/gst.h>
+#include <gst/allocators/gstdmabuf.h>
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/video/video.h>
+
+#include <spice-streaming-agent/plugin.hpp>
+#include <spice-streaming-agent/frame-capture.hpp>
+
+#include "gst-utils.hpp"
+
+#define drm_syslog(priority, str, ...) syslog(priority, "DRM plugin: " str, ## __VA_ARGS__);
+
+namespace spice {
+namespace streaming_agent {
+namespace drm_plugin {
+
+struct DrmSettings
+{
+    int fps = 25;
+    SpiceVideoCodecType codec = SPICE_VIDEO_CODEC_TYPE_H264;
+    std::string device = "/dev/dri/card0";
+    // frames between two keyframes at most, 0 for the encoder's default
+    int keyframe_interval = 0;
+    // capture right after the vertical blank, when the flips complete
+    bool sync = false;
+};
+
+/* Elements able to import DMA-BUFs, the post-processor converts the
+ * frames in the GPU memory for the encoder */
+struct VaFamily
+{
+    const char *postproc;
+    const char *encoders[4];
+};
+
+const VaFamily *va_families(SpiceVideoCodecType codec)
+{
+    static const VaFamily h264[] = {
+        { "vapostproc", { "vah264lpenc", "vah264enc", nullptr } },
+        { "vaapipostproc", { "vaapih264enc", nullptr } },
+        { nullptr, { nullptr } },
+    };
+    static const VaFamily h265[] = {
+        { "vapostproc", { "vah265lpenc", "vah265enc", nullptr } },
+        { "vaapipostproc", { "vaapih265enc", nullptr } },
+        { nullptr, { nullptr } },
+    };
+    static const VaFamily vp8[] = {
+        { "vapostproc", { "vavp8enc", nullptr } },
+        { "vaapipostproc", { "vaapivp8enc", nullptr } },
+        { nullptr, { nullptr } },
+    };
+    static const VaFamily vp9[] = {
+        { "vapostproc", { "vavp9lpenc", "vavp9enc", nullptr } },
+        { "vaapipostproc", { "vaapivp9enc", nullptr } },
+        { nullptr, { nullptr } },
+    };
+    static const VaFamily none[] = {
+        { nullptr, { nullptr } },
+    };
+
+    switch (codec) {
+    case SPICE_VIDEO_CODEC_TYPE_H264:
+        return h264;
+    case SPICE_VIDEO_CODEC_TYPE_H265:
+        return h265;
+    case SPICE_VIDEO_CODEC_TYPE_VP8:
+        return vp8;
+    case SPICE_VIDEO_CODEC_TYPE_VP9:
+        return vp9;
+    default:
+        return none;
+    }
+}
+
+const char *codec_caps(SpiceVideoCodecType codec)
+{
+    switch (codec) {
+    case SPICE_VIDEO_CODEC_TYPE_H264:
+        return "video/x-h264,stream-format=(string)byte-stream";
+    case SPICE_VIDEO_CODEC_TYPE_H265:
+        return "video/x-h265,stream-format=(string)byte-stream";
+    case SPICE_VIDEO_CODEC_TYPE_VP8:
+        return "video/x-vp8";
+    case SPICE_VIDEO_CODEC_TYPE_VP9:
+        return "video/x-vp9";
+    default:
+        throw std::logic_error("Unknown codec");
+    }
+}
+
+GstVideoFormat video_format(uint32_t drm_format)
+{
+    switch (drm_format) {
+    case DRM_FORMAT_XRGB8888:
+        return GST_VIDEO_FORMAT_BGRx;
+    case DRM_FORMAT_ARGB8888:
+        return GST_VIDEO_FORMAT_BGRA;
+    case DRM_FORMAT_XBGR8888:
+        return GST_VIDEO_FORMAT_RGBx;
+    case DRM_FORMAT_ABGR8888:
+        return GST_VIDEO_FORMAT_RGBA;
+    default:
+        return GST_VIDEO_FORMAT_UNKNOWN;
+    }
+}
+
+/* Close the GEM handles drmModeGetFB2 opened on the device for fb */
+void close_handles(int fd, const drmModeFB2 &fb)
+{
+    for (unsigned i = 0; i < 4 && fb.handles[i]; ++i) {
+        // the planes can share buffers, each handle is closed once
+        if (std::find(fb.handles, fb.handles + i, fb.handles[i]) == fb.handles + i) {
+            struct drm_gem_close gem_close = {};
+            gem_close.handle = fb.handles[i];
+            drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+        }
+    }
+}
+
+/* The handles are closed with the framebuffer, they would leak on the
+ * long lived device otherwise */
+struct Fb2Deleter {
+    explicit Fb2Deleter(int fd = -1) : fd(fd) {}
+    void operator()(drmModeFB2 *fb)
+    {
+        if (fd >= 0) {
+            close_handles(fd, *fb);
+        }
+        drmModeFreeFB2(fb);
+    }
+    int fd;
+};
+
+using Fb2UPtr = std::unique_ptr<drmModeFB2, Fb2Deleter>;
+
+/* The framebuffer scanned out by the first active CRTC */
+class Scanout
+{
+public:
+    Scanout(const std::string &device);
+    ~Scanout();
+
+    /*! \return the current framebuffer, nullptr if the screen is off
+     * \throw std::runtime_error if the framebuffer cannot be accessed */
+    Fb2UPtr framebuffer();
+
+    /*! Export the buffer of fb as a DMA-BUF, the caller owns the file descriptor */
+    int export_buffer(const drmModeFB2 &fb);
+
+    /*! Wait for the next vertical blank of the CRTC of the last framebuffer
+     * \return false if the driver does not report vertical blanks */
+    bool wait_vblank();
+
+private:
+    int fd;
+    // index of the CRTC scanning out the last framebuffer
+    int pipe = 0;
+};
+
+Scanout::Scanout(const std::string &device)
+{
+    fd = open(device.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open DRM device '" + device + "': " + strerror(errno));
+    }
+    // the cursor and overlay planes are not captured, only the primary one
+    drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+}
+
+Scanout::~Scanout()
+{
+    close(fd);
+}
+
+Fb2UPtr Scanout::framebuffer()
+{
+    drmModeRes *resources = drmModeGetResources(fd);
+    if (!resources) {
+        throw std::runtime_error(std::string("drmModeGetResources failed: ") + strerror(errno));
+    }
+
+    uint32_t fb_id = 0;
+    for (int i = 0; !fb_id && i < resources->count_crtcs; ++i) {
+        drmModeCrtc *crtc = drmModeGetCrtc(fd, resources->crtcs[i]);
+        if (crtc) {
+            if (crtc->mode_valid) {
+                fb_id = crtc->buffer_id;
+                pipe = i;
+            }
+            drmModeFreeCrtc(crtc);
+        }
+    }
+    drmModeFreeResources(resources);
+    if (!fb_id) {
+        return Fb2UPtr();
+    }
+
+    Fb2UPtr fb(drmModeGetFB2(fd, fb_id), Fb2Deleter(fd));
+    if (!fb) {
+        throw std::runtime_error(std::string("drmModeGetFB2 failed: ") + strerror(errno));
+    }
+    // the handles are only given to the DRM master or with CAP_SYS_ADMIN
+    if (!fb->handles[0]) {
+        throw std::runtime_error("No access to the framebuffer, CAP_SYS_ADMIN is needed");
+    }
+    return fb;
+}
+
+int Scanout::export_buffer(const drmModeFB2 &fb)
+{
+    int prime_fd = -1;
+    int ret = drmPrimeHandleToFD(fd, fb.handles[0], DRM_CLOEXEC | DRM_RDWR, &prime_fd);
+    if (ret < 0) {
+        throw std::runtime_error(std::string("Cannot export the framebuffer: ") + strerror(errno));
+    }
+    return prime_fd;
+}
+
+bool Scanout::wait_vblank()
+{
+    drmVBlank vblank = {};
+    unsigned type = DRM_VBLANK_RELATIVE;
+    if (pipe == 1) {
+        type |= DRM_VBLANK_SECONDARY;
+    } else if (pipe > 1) {
+        type |= (pipe << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK;
+    }
+    vblank.request.type = (drmVBlankSeqType) type;
+    vblank.request.sequence = 1;
+    return drmWaitVBlank(fd, &vblank) == 0;
+}
+
+class DrmFrameCapture final : public FrameCapture
+{
+public:
+    DrmFrameCapture(const DrmSettings &settings, Agent *agent);
+    ~DrmFrameCapture();
+    FrameInfo CaptureFrame() override;
+    void Reset() override;
+    SpiceVideoCodecType VideoCodecType() const override {
+        return settings.codec;
+    }
+private:
+    void pipeline_init();
+    GstBuffer *wrap_framebuffer(const drmModeFB2 &fb);
+    void set_caps(const drmModeFB2 &fb);
+    void free_sample();
+    void force_keyframe();
+
+    const DrmSettings settings;
+    Agent *const agent;
+    Scanout scanout;
+    GstObjectUPtr<GstAllocator> allocator;
+    GstObjectUPtr<GstElement> pipeline, capture, sink;
+    GstSampleUPtr sample;
+    GstMapInfo map = {};
+    // the last frame, pushed again while the screen is off
+    GstBuffer *last_buffer = nullptr;
+    uint32_t cur_width = 0, cur_height = 0, cur_format = 0;
+    uint64_t cur_modifier = DRM_FORMAT_MOD_INVALID;
+    bool is_first = true;
+    // Agent::KeyframeRequests() handled
+    unsigned keyframe_requests = 0;
+    // waiting for the vertical blanks, till the driver fails to report them
+    bool sync;
+};
+
+/* Find the post-processor and encoder importing DMA-BUFs for the codec */
+bool find_elements(SpiceVideoCodecType codec, GstObjectUPtr<GstElementFactory> &postproc,
+                   GstObjectUPtr<GstElementFactory> &encoder)
+{
+    GstCapsUPtr dmabuf_caps(gst_caps_from_string("video/x-raw(memory:DMABuf)"));
+    for (const VaFamily *family = va_families(codec); family->postproc; ++family) {
+        postproc.reset(gst_element_factory_find(family->postproc));
+        if (!postproc ||
+            !gst_element_factory_can_sink_any_caps(postproc.get(), dmabuf_caps.get())) {
+            continue;
+        }
+        for (const char *const *name = family->encoders; *name; ++name) {
+            encoder.reset(gst_element_factory_find(*name));
+            if (encoder) {
+                return true;
+            }
+        }
+    }
+    postproc.reset();
+    encoder.reset();
+    return false;
+}
+
+DrmFrameCapture::DrmFrameCapture(const DrmSettings &settings, Agent *agent) :
+    settings(settings),
+    agent(agent),
+    scanout(settings.device),
+    allocator(gst_dmabuf_allocator_new()),
+    sync(settings.sync)
+{
+    keyframe_requests = agent->KeyframeRequests();
+    pipeline_init();
+}
+
+DrmFrameCapture::~DrmFrameCapture()
+{
+    free_sample();
+    gst_element_set_state(pipeline.get(), GST_STATE_NULL);
+    if (last_buffer) {
+        gst_buffer_unref(last_buffer);
+    }
+}
+
+void DrmFrameCapture::pipeline_init()
+{
+    GstObjectUPtr<GstElementFactory> postproc_factory, encoder_factory;
+    if (!find_elements(settings.codec, postproc_factory, encoder_factory)) {
+        throw std::runtime_error("No VA-API encoder importing DMA-BUFs was found");
+    }
+    drm_syslog(LOG_NOTICE, "'%s' encoder plugin is used", GST_OBJECT_NAME(encoder_factory.get()));
+
+    GstObjectUPtr<GstElement> pipeline(gst_pipeline_new("pipeline"));
+    GstObjectUPtr<GstElement> capture(gst_element_factory_make("appsrc", "capture"));
+    GstObjectUPtr<GstElement> postproc(gst_element_factory_create(postproc_factory.get(), nullptr));
+    GstObjectUPtr<GstElement> encoder(gst_element_factory_create(encoder_factory.get(), "encoder"));
+    GstObjectUPtr<GstElement> sink(gst_element_factory_make("appsink", "sink"));
+    if (!pipeline || !capture || !postproc || !encoder || !sink) {
+        throw std::runtime_error("Gstreamer's elements cannot be created");
+    }
+    if (settings.keyframe_interval > 0 &&
+        !gst_set_keyframe_interval(encoder.get(), settings.keyframe_interval)) {
+        drm_syslog(LOG_WARNING, "The interval between keyframes cannot be limited");
+    }
+
+    g_object_set(capture.get(),
+                 "is-live", TRUE,
+                 "format", GST_FORMAT_TIME,
+                 "do-timestamp", TRUE,
+                 nullptr);
+    g_object_set(sink.get(),
+                 "sync", FALSE,
+                 "drop", TRUE,
+                 "max-buffers", 1,
+                 nullptr);
+
+    GstBin *bin = GST_BIN(pipeline.get());
+    gst_bin_add(bin, capture);
+    gst_bin_add(bin, postproc);
+    gst_bin_add(bin, encoder);
+    gst_bin_add(bin, sink);
+
+    GstCapsUPtr sink_caps(gst_caps_from_string(codec_caps(settings.codec)));
+    if (!gst_element_link_many(capture.get(), postproc.get(), encoder.get(), nullptr) ||
+        !gst_element_link_filtered(encoder.get(), sink.get(), sink_caps.get())) {
+        throw std::runtime_error("Linking gstreamer's elements failed");
+    }
+
+    if (gst_element_set_state(pipeline.get(), GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+        throw std::runtime_error("The DMA-BUF pipeline cannot be started");
+    }
+
+    this->sink.swap(sink);
+    this->capture.swap(capture);
+    this->pipeline.swap(pipeline);
+}
+
+// the caps are only set when the framebuffer changes, frames are then pushed without caps
+void DrmFrameCapture::set_caps(const drmModeFB2 &fb)
+{
+    GstCapsUPtr caps;
+    const bool linear = fb.modifier == DRM_FORMAT_MOD_LINEAR ||
+        fb.modifier == DRM_FORMAT_MOD_INVALID || !(fb.flags & DRM_MODE_FB_MODIFIERS);
+#if GST_CHECK_VERSION(1, 24, 0)
+    // DMA-BUFs are described by their DRM format, linear ones included
+    gchar *drm_format =
+        gst_video_dma_drm_fourcc_to_string(fb.pixel_format,
+                                           linear ? DRM_FORMAT_MOD_LINEAR : fb.modifier);
+    if (!drm_format) {
+        throw std::runtime_error("Unsupported framebuffer format " +
+                                 std::to_string(fb.pixel_format));
+    }
+    caps.reset(gst_caps_new_simple("video/x-raw",
+                                   "format", G_TYPE_STRING, "DMA_DRM",
+                                   "drm-format", G_TYPE_STRING, drm_format,
+                                   "width", G_TYPE_INT, fb.width,
+                                   "height", G_TYPE_INT, fb.height,
+                                   "framerate", GST_TYPE_FRACTION, settings.fps, 1,
+                                   nullptr));
+    g_free(drm_format);
+#else
+    if (!linear) {
+        throw std::runtime_error("Framebuffer modifiers need GStreamer 1.24");
+    }
+    const GstVideoFormat format = video_format(fb.pixel_format);
+    if (format == GST_VIDEO_FORMAT_UNKNOWN) {
+        throw std::runtime_error("Unsupported framebuffer format " +
+                                 std::to_string(fb.pixel_format));
+    }
+    caps.reset(gst_caps_new_simple("video/x-raw",
+                                   "format", G_TYPE_STRING, gst_video_format_to_string(format),
+                                   "width", G_TYPE_INT, fb.width,
+                                   "height", G_TYPE_INT, fb.height,
+                                   "framerate", GST_TYPE_FRACTION, settings.fps, 1,
+                                   nullptr));
+#endif
+    gst_caps_set_features(caps.get(), 0, gst_caps_features_new(GST_CAPS_FEATURE_MEMORY_DMABUF,
+                                                               nullptr));
+    gst_app_src_set_caps(GST_APP_SRC(capture.get()), caps.get());
+
+    cur_width = fb.width;
+    cur_height = fb.height;
+    cur_format = fb.pixel_format;
+    cur_modifier = fb.modifier;
+}
+
+GstBuffer *DrmFrameCapture::wrap_framebuffer(const drmModeFB2 &fb)
+{
+    for (unsigned i = 1; i < 4; ++i) {
+        if (fb.handles[i] && fb.handles[i] != fb.handles[0]) {
+            throw std::runtime_error("Framebuffers made of several buffers are not supported");
+        }
+    }
+
+    int prime_fd = scanout.export_buffer(fb);
+    off_t size = lseek(prime_fd, 0, SEEK_END);
+    if (size <= 0) {
+        close(prime_fd);
+        throw std::runtime_error("Cannot get the size of the framebuffer");
+    }
+
+    // the memory owns the file descriptor
+    GstMemory *memory = gst_dmabuf_allocator_alloc(allocator.get(), prime_fd, size);
+    GstBuffer *buffer = gst_buffer_new();
+    gst_buffer_append_memory(buffer, memory);
+
+    gsize offset[GST_VIDEO_MAX_PLANES] = {};
+    gint stride[GST_VIDEO_MAX_PLANES] = {};
+    guint n_planes = 0;
+    for (; n_planes < 4 && fb.handles[n_planes]; ++n_planes) {
+        offset[n_planes] = fb.offsets[n_planes];
+        stride[n_planes] = fb.pitches[n_planes];
+    }
+    const GstVideoFormat format = video_format(fb.pixel_format);
+    if (format != GST_VIDEO_FORMAT_UNKNOWN) {
+        gst_buffer_add_video_meta_full(buffer, GST_VIDEO_FRAME_FLAG_NONE, format,
+                                       fb.width, fb.height, n_planes, offset, stride);
+    }
+    return buffer;
+}
+
+void DrmFrameCapture::free_sample()
+{
+    if (sample) {
+        gst_buffer_unmap(gst_sample_get_buffer(sample.get()), &map);
+        sample.reset();
+    }
+}
+
+void DrmFrameCapture::force_keyframe()
+{
+    // travels upstream from the sink to the encoder
+    gst_element_send_event(sink.get(),
+                           gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE,
+                                                                       TRUE, 0));
+}
+
+void DrmFrameCapture::Reset()
+{
+    free_sample();
+    is_first = true;
+    force_keyframe();
+}
+
+FrameInfo DrmFrameCapture::CaptureFrame()
+{
+    FrameInfo info;
+
+    free_sample();
+    agent->WaitNextFrame(settings.fps);
+    // the rate still caps the frames, at most a refresh period is waited
+    if (sync && !scanout.wait_vblank()) {
+        drm_syslog(LOG_NOTICE, "No vertical blank reported, capturing on the frame rate only");
+        sync = false;
+    }
+    if (agent->KeyframeRequests() != keyframe_requests) {
+        keyframe_requests = agent->KeyframeRequests();
+        force_keyframe();
+    }
+
+    // compositors flip between buffers, the current one is looked up for each frame
+    Fb2UPtr fb(scanout.framebuffer());
+    if (fb) {
+        if (fb->width != cur_width || fb->height != cur_height ||
+            fb->pixel_format != cur_format || fb->modifier != cur_modifier) {
+            if (cur_width) {
+                force_keyframe();
+            }
+            set_caps(*fb);
+            is_first = true;
+        }
+        if (last_buffer) {
+            gst_buffer_unref(last_buffer);
+        }
+        last_buffer = wrap_framebuffer(*fb);
+    } else if (!last_buffer) {
+        throw std::runtime_error("No framebuffer is scanned out");
+    }
+
+    // appsrc takes ownership of the buffer
+    if (gst_app_src_push_buffer(GST_APP_SRC(capture.get()), gst_buffer_ref(last_buffer)) != GST_FLOW_OK) {
+        throw std::runtime_error("gstramer appsrc element cannot push buffer");
+    }
+
+    sample.reset(gst_app_sink_pull_sample(GST_APP_SINK(sink.get())));
+    if (!sample) {
+        throw std::runtime_error("No sample- EOS or state change");
+    }
+    if (!gst_buffer_map(gst_sample_get_buffer(sample.get()), &map, GST_MAP_READ)) {
+        free_sample();
+        throw std::runtime_error("Buffer mapping failed");
+    }
+
+    info.size.width = cur_width;
+    info.size.height = cur_height;
+    info.stream_start = is_first;
+    is_first = false;
+    info.buffer = map.data;
+    info.buffer_size = map.size;
+    return info;
+}
+
+class DrmPlugin final: public Plugin
+{
+public:
+    DrmPlugin() : cache(gst_capability_cache("drm-plugin", (const void *) va_families)) {}
+    FrameCapture *CreateCapture() override;
+    unsigned Rank() override;
+    void ParseOptions(const ConfigureOption *options);
+    SpiceVideoCodecType VideoCodecType() const override {
+        return settings.codec;
+    }
+    void SetAgent(Agent *agent) { this->agent = agent; }
+private:
+    DrmSettings settings;
+    Agent *agent = nullptr;
+    // probing the device and the encoders is done once
+    bool probed = false;
+    // the encoder was found by a previous run
+    bool encoder_cached = false;
+    std::unique_ptr<CapabilityCache> cache;
+    unsigned rank = DontUse;
+};
+
+FrameCapture *DrmPlugin::CreateCapture()
+{
+    // GStreamer is only initialised once the plugin is used
+    gst_init(nullptr, nullptr);
+    try {
+        return new DrmFrameCapture(settings, agent);
+    } catch (const std::exception &e) {
+        if (encoder_cached) {
+            // look for the encoders again for the next stream
+            cache->remove("encoder:" + std::to_string(settings.codec));
+            encoder_cached = false;
+            probed = false;
+        }
+        throw;
+    }
+}
+
+unsigned DrmPlugin::Rank()
+{
+    if (probed) {
+        return rank;
+    }
+    probed = true;
+    rank = DontUse;
+
+    const std::string key = "encoder:" + std::to_string(settings.codec);
+    std::string encoder_name;
+    encoder_cached = cache->lookup(key, encoder_name);
+    if (!encoder_cached) {
+        gst_init(nullptr, nullptr);
+        GstObjectUPtr<GstElementFactory> postproc, encoder;
+        if (find_elements(settings.codec, postproc, encoder)) {
+            encoder_name = GST_OBJECT_NAME(encoder.get());
+        }
+        cache->store(key, encoder_name);
+    }
+    if (encoder_name.empty()) {
+        drm_syslog(LOG_NOTICE, "No VA-API encoder importing DMA-BUFs is available");
+        return rank;
+    }
+    try {
+        Scanout scanout(settings.device);
+        scanout.framebuffer();
+    } catch (const std::exception &e) {
+        drm_syslog(LOG_NOTICE, "The framebuffer cannot be captured: %s", e.what());
+        return rank;
+    }
+
+    rank = SpecificHardwareMin;
+    return rank;
+}
+
+void DrmPlugin::ParseOptions(const ConfigureOption *options)
+{
+    for (; options->name; ++options) {
+        const std::string name = options->name;
+        const std::string value = options->value;
+
+        if (name == "framerate") {
+            try {
+                settings.fps = std::stoi(value);
+            } catch (const std::exception &e) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'framerate'.");
+            }
+        } else if (name == "keyframe.max-interval") {
+            try {
+                settings.keyframe_interval = std::stoi(value);
+            } catch (const std::exception &e) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'keyframe.max-interval'.");
+            }
+            if (settings.keyframe_interval < 0) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'keyframe.max-interval'.");
+            }
+        } else if (name == "capture.sync") {
+            if (value == "on") {
+                settings.sync = true;
+            } else if (value == "off") {
+                settings.sync = false;
+            } else {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'capture.sync'.");
+            }
+        } else if (name == "drm.device") {
+            settings.device = value;
+        } else if (name == "drm.codec") {
+            if (value == "h264") {
+                settings.codec = SPICE_VIDEO_CODEC_TYPE_H264;
+            } else if (value == "h265") {
+                settings.codec = SPICE_VIDEO_CODEC_TYPE_H265;
+            } else if (value == "vp8") {
+                settings.codec = SPICE_VIDEO_CODEC_TYPE_VP8;
+            } else if (value == "vp9") {
+                settings.codec = SPICE_VIDEO_CODEC_TYPE_VP9;
+            } else {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'drm.codec'.");
+            }
+        }
+    }
+}
+
+}}} //namespace spice::streaming_agent::drm_plugin
+
+using namespace spice::streaming_agent::drm_plugin;
+
+SPICE_STREAMING_AGENT_PLUGIN(agent)
+{
+    std::unique_ptr<DrmPlugin> plugin(new DrmPlugin());
+
+    plugin->ParseOptions(agent->Options());
+    plugin->SetAgent(agent);
+
+    agent->Register(*plugin.release());
+
+    return true;
+}
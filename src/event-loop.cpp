@@ -0,0 +1,256 @@
+/* A loop dispatching the events of file descriptors.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "event-loop.hpp"
+#include "error.hpp"
+
+#include <algorithm>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+
+namespace spice {
+namespace streaming_agent {
+
+namespace {
+
+// a hung up socket stays readable, only to read the end of file
+bool has_data(int fd)
+{
+    int available = 0;
+    return ioctl(fd, FIONREAD, &available) == 0 && available > 0;
+}
+
+} // namespace
+
+const unsigned EventLoop::min_hangup_retry_ms;
+const unsigned EventLoop::max_hangup_retry_ms;
+
+EventLoop::EventLoop()
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        throw IOError("epoll_create1 failed", errno);
+    }
+
+    wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wakeup_fd < 0) {
+        int err = errno;
+        close(epoll_fd);
+        throw IOError("eventfd failed", err);
+    }
+
+    try {
+        add(wakeup_fd, [this] {
+            uint64_t count;
+            if (read(wakeup_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                throw IOError("reading the eventfd failed", errno);
+            }
+        });
+    } catch (...) {
+        close(wakeup_fd);
+        close(epoll_fd);
+        throw;
+    }
+}
+
+EventLoop::~EventLoop()
+{
+    for (int timer_fd: timer_fds) {
+        close(timer_fd);
+    }
+    if (signal_fd >= 0) {
+        close(signal_fd);
+    }
+    close(wakeup_fd);
+    close(epoll_fd);
+}
+
+void EventLoop::add(int fd, std::function<void()> handler)
+{
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        throw IOError("epoll_ctl failed to add a file descriptor", errno);
+    }
+    handlers[fd] = std::move(handler);
+}
+
+void EventLoop::remove(int fd)
+{
+    // a parked descriptor is not in the epoll set
+    if (!parked.erase(fd) && epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr) < 0) {
+        throw IOError("epoll_ctl failed to remove a file descriptor", errno);
+    }
+    hung_up.erase(fd);
+    handlers.erase(fd);
+}
+
+void EventLoop::hang_up(int fd)
+{
+    // level triggered, a hung up descriptor would wake the loop up at once
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr) < 0) {
+        throw IOError("epoll_ctl failed to remove a file descriptor", errno);
+    }
+    parked.insert(fd);
+    hung_up.insert(fd);
+
+    if (hangup_timer_fd < 0) {
+        hangup_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (hangup_timer_fd < 0) {
+            throw IOError("timerfd_create failed", errno);
+        }
+        timer_fds.push_back(hangup_timer_fd);
+        add(hangup_timer_fd, [this] {
+            uint64_t expirations;
+            if (read(hangup_timer_fd, &expirations, sizeof(expirations)) < 0) {
+                if (errno == EAGAIN) {
+                    return;
+                }
+                throw IOError("reading the timerfd failed", errno);
+            }
+            retry_hung_up();
+        });
+    }
+    if (hangup_timer_armed) {
+        return;
+    }
+
+    struct itimerspec spec = {};
+    spec.it_value.tv_sec = hangup_retry_ms / 1000;
+    spec.it_value.tv_nsec = (hangup_retry_ms % 1000) * 1000000;
+    if (timerfd_settime(hangup_timer_fd, 0, &spec, nullptr) < 0) {
+        throw IOError("timerfd_settime failed", errno);
+    }
+    hangup_timer_armed = true;
+    hangup_retry_ms = std::min(hangup_retry_ms * 2, max_hangup_retry_ms);
+}
+
+void EventLoop::retry_hung_up()
+{
+    hangup_timer_armed = false;
+    for (int fd: parked) {
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            throw IOError("epoll_ctl failed to add a file descriptor", errno);
+        }
+    }
+    parked.clear();
+}
+
+void EventLoop::add_timer(unsigned interval_ms, std::function<void()> handler)
+{
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (timer_fd < 0) {
+        throw IOError("timerfd_create failed", errno);
+    }
+    timer_fds.push_back(timer_fd);
+
+    struct itimerspec spec = {};
+    spec.it_interval.tv_sec = interval_ms / 1000;
+    spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+    spec.it_value = spec.it_interval;
+    if (timerfd_settime(timer_fd, 0, &spec, nullptr) < 0) {
+        throw IOError("timerfd_settime failed", errno);
+    }
+
+    add(timer_fd, [timer_fd, handler] {
+        uint64_t expirations;
+        if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+            if (errno == EAGAIN) {
+                return;
+            }
+            throw IOError("reading the timerfd failed", errno);
+        }
+        handler();
+    });
+}
+
+void EventLoop::watch_signals(const std::vector<int> &signals, std::function<void(int)> handler)
+{
+    if (signal_fd >= 0) {
+        throw Error("signals are already watched");
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    for (int signal: signals) {
+        sigaddset(&mask, signal);
+    }
+
+    // the signals must not be delivered to a handler, from any thread
+    int err = pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+    if (err != 0) {
+        throw IOError("pthread_sigmask failed", err);
+    }
+
+    signal_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (signal_fd < 0) {
+        throw IOError("signalfd failed", errno);
+    }
+
+    add(signal_fd, [this, handler] {
+        struct signalfd_siginfo info;
+        while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+            handler(info.ssi_signo);
+        }
+    });
+}
+
+void EventLoop::run()
+{
+    while (!stopped) {
+        struct epoll_event events[8];
+        int count = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw IOError("epoll_wait failed", errno);
+        }
+
+        for (int i = 0; i < count && !stopped; ++i) {
+            auto handler = handlers.find(events[i].data.fd);
+            // a previous handler may have removed it
+            if (handler == handlers.end()) {
+                continue;
+            }
+            const int fd = events[i].data.fd;
+            const uint32_t flags = events[i].events;
+            if ((flags & (EPOLLHUP | EPOLLERR)) && (!(flags & EPOLLIN) || !has_data(fd))) {
+                hang_up(fd);
+                continue;
+            }
+            if (hung_up.erase(fd) && hung_up.empty()) {
+                hangup_retry_ms = min_hangup_retry_ms;
+            }
+            // the handler may remove itself
+            auto callback = handler->second;
+            callback();
+        }
+    }
+}
+
+void EventLoop::stop()
+{
+    stopped = true;
+    uint64_t count = 1;
+    if (write(wakeup_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        throw IOError("writing the eventfd failed", errno);
+    }
+}
+
+}} // namespace spice::streaming_agent
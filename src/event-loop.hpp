@@ -0,0 +1,76 @@
+/* A loop dispatching the events of file descriptors.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_EVENT_LOOP_HPP
+#define SPICE_STREAMING_AGENT_EVENT_LOOP_HPP
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <set>
+#include <vector>
+
+
+namespace spice {
+namespace streaming_agent {
+
+class EventLoop
+{
+public:
+    EventLoop();
+    ~EventLoop();
+
+    /*! Call handler from run() each time fd becomes readable.
+     * While fd is hung up with nothing to read, e.g. a virtio port whose
+     * host side is not connected, handler is not called and fd is only
+     * checked again after a delay, doubling from min_hangup_retry_ms to
+     * max_hangup_retry_ms.
+     */
+    void add(int fd, std::function<void()> handler);
+    void remove(int fd);
+
+    /*! Call handler from run() every interval_ms milliseconds */
+    void add_timer(unsigned interval_ms, std::function<void()> handler);
+
+    /*! Call handler from run() when one of signals is received.
+     * The signals are blocked in the calling thread and in the threads it
+     * creates afterwards, so this should be called before creating any thread.
+     */
+    void watch_signals(const std::vector<int> &signals, std::function<void(int)> handler);
+
+    /*! Dispatch the events until stop() is called.
+     * Nothing is done, and the thread is not woken up, while no event occurs.
+     */
+    void run();
+
+    /*! Make run() return, can be called from any thread */
+    void stop();
+
+    static const unsigned min_hangup_retry_ms = 100;
+    static const unsigned max_hangup_retry_ms = 1000;
+
+private:
+    void hang_up(int fd);
+    void retry_hung_up();
+
+    int epoll_fd;
+    // an eventfd written by stop()
+    int wakeup_fd;
+    int signal_fd = -1;
+    std::vector<int> timer_fds;
+    std::map<int, std::function<void()>> handlers;
+    // hung up descriptors, not watched till hangup_timer_fd expires, and
+    // the ones hung up since they were last readable
+    std::set<int> parked, hung_up;
+    int hangup_timer_fd = -1;
+    bool hangup_timer_armed = false;
+    unsigned hangup_retry_ms = min_hangup_retry_ms;
+    std::atomic<bool> stopped{false};
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_EVENT_LOOP_HPP
@@ -0,0 +1,93 @@
+/* Pool of frame buffers lent to the plugins.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "frame-buffer-pool.hpp"
+
+#include <atomic>
+
+
+namespace spice {
+namespace streaming_agent {
+
+class FrameBufferPool::PoolBuffer final : public FrameBuffer
+{
+public:
+    uint8_t *Data() override { return data.get(); }
+    size_t Capacity() const override { return capacity; }
+    void Ref() override { ++refs; }
+    // a buffer without references is free, see FrameBufferPool::Acquire
+    void Unref() override { --refs; }
+
+    bool contains(const void *data) const
+    {
+        const uint8_t *p = static_cast<const uint8_t *>(data);
+        return p >= this->data.get() && p < this->data.get() + capacity;
+    }
+
+    void reserve(size_t size)
+    {
+        if (size > capacity) {
+            // leave some room as frame sizes vary
+            capacity = size + size / 4;
+            data.reset(new uint8_t[capacity]);
+        }
+    }
+
+    std::unique_ptr<uint8_t[]> data;
+    size_t capacity = 0;
+    std::atomic<unsigned> refs{0};
+};
+
+FrameBufferPool::FrameBufferPool(unsigned max_buffers) : max_buffers(max_buffers)
+{
+}
+
+FrameBufferPool::~FrameBufferPool()
+{
+}
+
+FrameBuffer *FrameBufferPool::Acquire(size_t size)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+
+    // prefer a free buffer already large enough
+    PoolBuffer *found = nullptr;
+    for (auto &buffer: buffers) {
+        if (buffer->refs == 0) {
+            found = buffer.get();
+            if (buffer->capacity >= size) {
+                break;
+            }
+        }
+    }
+
+    if (!found) {
+        if (buffers.size() >= max_buffers) {
+            return nullptr;
+        }
+        buffers.emplace_back(new PoolBuffer);
+        found = buffers.back().get();
+    }
+
+    found->reserve(size);
+    found->refs = 1;
+    return found;
+}
+
+FrameBuffer *FrameBufferPool::Ref(const void *data)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+
+    for (auto &buffer: buffers) {
+        if (buffer->refs > 0 && buffer->contains(data)) {
+            buffer->Ref();
+            return buffer.get();
+        }
+    }
+    return nullptr;
+}
+
+}} // namespace spice::streaming_agent
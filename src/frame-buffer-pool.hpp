@@ -0,0 +1,54 @@
+/* Pool of frame buffers lent to the plugins.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_FRAME_BUFFER_POOL_HPP
+#define SPICE_STREAMING_AGENT_FRAME_BUFFER_POOL_HPP
+
+#include <spice-streaming-agent/frame-capture.hpp>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Fixed number of reference counted buffers.
+ *
+ * A buffer goes back to the pool when its last reference is released,
+ * its memory is kept and reused for the next frames, growing it only
+ * when a larger frame is requested. Buffers can be released from any
+ * thread.
+ */
+class FrameBufferPool
+{
+public:
+    FrameBufferPool(unsigned max_buffers);
+    ~FrameBufferPool();
+
+    /*! Lend a buffer able to hold size bytes.
+     * \return a buffer with a single reference, nullptr if they are all in use
+     */
+    FrameBuffer *Acquire(size_t size);
+
+    /*! Find the lent buffer containing data and take a reference to it.
+     * \return nullptr if data does not come from this pool
+     */
+    FrameBuffer *Ref(const void *data);
+
+private:
+    class PoolBuffer;
+
+    std::mutex mutex;
+    const unsigned max_buffers;
+    std::vector<std::unique_ptr<PoolBuffer>> buffers;
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_FRAME_BUFFER_POOL_HPP
@@ -13,12 +13,20 @@
 #include <cstdarg>
 #include <string.h>
 #include <errno.h>
+#include <syslog.h>
 
 
 namespace spice {
 namespace streaming_agent {
 
-FrameLog::FrameLog(const char *log_name, bool log_binary, bool log_frames) :
+const size_t FrameLog::default_max_records;
+constexpr const char *FrameLog::index_suffix;
+constexpr const char *FrameLog::index_frame;
+
+// frames are dropped rather than using more memory
+static const size_t max_pending_frame_bytes = 64 * 1024 * 1024;
+
+FrameLog::FrameLog(const char *log_name, bool log_binary, bool log_frames, size_t max_records) :
     log_binary(log_binary),
     log_frames(log_frames)
 {
@@ -27,48 +35,163 @@ FrameLog::FrameLog(const char *log_name, bool log_binary, bool log_frames) :
         if (!log_file) {
             throw Error(std::string("Failed to open log file '") + log_name + "': " + strerror(errno));
         }
-        if (!log_binary) {
-            setlinebuf(log_file);
+        text_file = log_file;
+        if (log_binary) {
+            const std::string index_name = std::string(log_name) + index_suffix;
+            text_file = fopen(index_name.c_str(), "w");
+            if (!text_file) {
+                const int err = errno;
+                fclose(log_file);
+                throw Error("Failed to open log file '" + index_name + "': " + strerror(err));
+            }
         }
+        records.resize(max_records);
+        writer = std::thread(&FrameLog::run, this);
     }
 }
 
 FrameLog::~FrameLog()
 {
     if (log_file) {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+            cond.notify_all();
+        }
+        writer.join();
+        if (dropped_records) {
+            ::syslog(LOG_WARNING, "%u records of the frame log were dropped", dropped_records);
+        }
+        if (text_file != log_file) {
+            fclose(text_file);
+        }
         fclose(log_file);
     }
 }
 
+FrameLog::Record *FrameLog::reserve_record(size_t frame_size)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    if (count == records.size() ||
+        (frame_size && pending_frame_bytes + frame_size > max_pending_frame_bytes)) {
+        ++dropped_records;
+        return nullptr;
+    }
+
+    Record *record = &records[(first + count) % records.size()];
+    ++count;
+    pending_frame_bytes += frame_size;
+    record->ready = false;
+    return record;
+}
+
+void FrameLog::commit_record(Record *record)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    record->ready = true;
+    cond.notify_all();
+}
+
 void FrameLog::log_stat(const char* format, ...)
 {
-    if (log_file && !log_binary) {
-        fprintf(log_file, "%" PRIu64 ": ", get_time());
+    if (log_file) {
+        const uint64_t time = get_time();
+        Record *record = reserve_record();
+        if (!record) {
+            return;
+        }
+
+        // longer messages are truncated
+        record->time = time;
+        record->is_frame = false;
         va_list ap;
         va_start(ap, format);
-        vfprintf(log_file, format, ap);
+        vsnprintf(record->text, sizeof(record->text), format, ap);
         va_end(ap);
-        fputc('\n', log_file);
+        commit_record(record);
     }
 }
 
 void FrameLog::log_frame(const void* buffer, size_t buffer_size)
 {
-    if (log_file) {
-        if (log_binary) {
-            fwrite(buffer, buffer_size, 1, log_file);
-        } else if (log_frames) {
-            hexdump(buffer, buffer_size, log_file);
+    if (log_file && (log_binary || log_frames)) {
+        const uint64_t time = get_time();
+        Record *record = reserve_record(buffer_size);
+        if (!record) {
+            return;
+        }
+
+        const uint8_t *data = static_cast<const uint8_t *>(buffer);
+        record->time = time;
+        record->is_frame = true;
+        record->frame.assign(data, data + buffer_size);
+        commit_record(record);
+    }
+}
+
+unsigned FrameLog::dropped() const
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    return dropped_records;
+}
+
+void FrameLog::write_record(const Record &record)
+{
+    if (!record.is_frame) {
+        fprintf(text_file, "%" PRIu64 ": %s\n", record.time, record.text);
+    } else if (log_binary) {
+        fwrite(record.frame.data(), record.frame.size(), 1, log_file);
+        fprintf(text_file, "%" PRIu64 ": %s%zu\n", record.time, index_frame, record.frame.size());
+    } else {
+        hexdump(record.frame.data(), record.frame.size(), log_file);
+    }
+}
+
+void FrameLog::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cond.wait(lock, [this]{ return stopping || (count && records[first].ready); });
+        if (!count || !records[first].ready) {
+            // stopping, nothing more can be pending
+            break;
+        }
+
+        if (reported_drops != dropped_records) {
+            const unsigned drops = dropped_records - reported_drops;
+            reported_drops = dropped_records;
+            lock.unlock();
+            fprintf(text_file, "%" PRIu64 ": %u records dropped, the log is too slow\n",
+                    get_time(), drops);
+            lock.lock();
+        }
+
+        // the producers only use the other records
+        Record &record = records[first];
+        lock.unlock();
+        write_record(record);
+        const size_t frame_size = record.is_frame ? record.frame.size() : 0;
+        // do not keep a frame allocated in every record
+        std::vector<uint8_t>().swap(record.frame);
+        lock.lock();
+
+        pending_frame_bytes -= frame_size;
+        first = (first + 1) % records.size();
+        --count;
+
+        // the file is flushed when the log is idle, not after every line
+        if (!count) {
+            lock.unlock();
+            fflush(log_file);
+            fflush(text_file);
+            lock.lock();
         }
     }
 }
 
-/**
- * Returns current time in microseconds.
- */
 uint64_t FrameLog::get_time()
 {
-    auto now = std::chrono::system_clock::now().time_since_epoch();
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
     return std::chrono::duration_cast<std::chrono::microseconds>(now).count();
 }
 
@@ -8,6 +8,10 @@
 #define SPICE_STREAMING_AGENT_FRAME_LOG_HPP
 
 #include <cinttypes>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <stddef.h>
 #include <stdio.h>
 
@@ -15,23 +19,75 @@
 namespace spice {
 namespace streaming_agent {
 
+/*! The records are written to the file by a separate thread, so a slow disk
+ * does not slow down the capture. When the thread cannot keep up the new
+ * records are dropped, and their number is logged once there is room again.
+ *
+ * A binary log only holds the frames, one after the other. The stats and
+ * the size of each frame go to an index next to it, named after the log
+ * with index_suffix, which allows to split the frames again.
+ */
 class FrameLog {
 public:
-    FrameLog(const char *log_name, bool log_binary, bool log_frames);
+    FrameLog(const char *log_name, bool log_binary, bool log_frames,
+             size_t max_records = default_max_records);
     FrameLog(const FrameLog &) = delete;
     FrameLog &operator=(const FrameLog &) = delete;
+    /*! Write the pending records */
     ~FrameLog();
 
     __attribute__ ((format (printf, 2, 3)))
     void log_stat(const char* format, ...);
     void log_frame(const void* buffer, size_t buffer_size);
 
+    /*! Records dropped since the log was opened */
+    unsigned dropped() const;
+
+    /*! Current time in microseconds, from a monotonic clock */
     static uint64_t get_time();
 
+    static const size_t default_max_records = 1024;
+    static constexpr const char *index_suffix = ".index";
+    /*! Line of the index for each frame, followed by its size */
+    static constexpr const char *index_frame = "frame ";
+
 private:
+    struct Record
+    {
+        uint64_t time;
+        // the text of a stat, or a frame
+        char text[120];
+        std::vector<uint8_t> frame;
+        bool is_frame;
+        // filled by the producer, can be written
+        bool ready;
+    };
+
+    /*! Take the next free record, the caller fills it without holding the
+     * lock then passes it to commit_record().
+     * \return nullptr if the record has to be dropped
+     */
+    Record *reserve_record(size_t frame_size = 0);
+    void commit_record(Record *record);
+    void write_record(const Record &record);
+    void run();
+
     FILE *log_file = nullptr;
+    // where the stats are written, the index of a binary log
+    FILE *text_file = nullptr;
     bool log_binary = false;
     bool log_frames = false;
+
+    mutable std::mutex mutex;
+    std::condition_variable cond;
+    // ring of records, the first "count" ones after "first" are pending
+    std::vector<Record> records;
+    size_t first = 0, count = 0;
+    // size of the frames in the pending records, it is bounded too
+    size_t pending_frame_bytes = 0;
+    unsigned dropped_records = 0, reported_drops = 0;
+    bool stopping = false;
+    std::thread writer;
 };
 
 }} // namespace spice::streaming_agent
@@ -0,0 +1,126 @@
+/* A bounded queue of encoded frames, connecting the capture and the
+ * sending stages of the pipelined mode.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "frame-queue.hpp"
+#include "frame-buffer-pool.hpp"
+
+#include <cstring>
+
+
+namespace spice {
+namespace streaming_agent {
+
+FrameQueue::FrameQueue(size_t capacity, FrameBufferPool *pool) :
+    pool(pool),
+    capacity(capacity)
+{
+}
+
+FrameQueue::~FrameQueue()
+{
+    for (auto &frame: frames) {
+        release_locked(frame);
+    }
+}
+
+bool FrameQueue::push(const FrameInfo &frame, SpiceVideoCodecType codec, uint64_t capture_time,
+                      bool may_drop)
+{
+    QueuedFrame queued;
+    const uint8_t *buffer = static_cast<const uint8_t *>(frame.buffer);
+    queued.buffer = pool ? pool->Ref(buffer) : nullptr;
+    if (queued.buffer) {
+        queued.data = buffer;
+    } else {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            if (!free_buffers.empty()) {
+                queued.storage.swap(free_buffers.back());
+                free_buffers.pop_back();
+            }
+        }
+
+        // copy outside of the lock, the consumer may be waiting for the next frame
+        queued.storage.assign(buffer, buffer + frame.buffer_size);
+        queued.data = queued.storage.data();
+    }
+    queued.data_size = frame.buffer_size;
+    queued.size = frame.size;
+    queued.codec = codec;
+    queued.stream_start = frame.stream_start;
+    queued.capture_time = capture_time;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!may_drop) {
+        cond.wait(lock, [this]{ return closed || frames.size() < capacity; });
+    }
+    if (closed) {
+        release_locked(queued);
+        return false;
+    }
+
+    while (frames.size() >= capacity) {
+        // the format must still be sent before the next frame
+        queued.stream_start = queued.stream_start || frames.front().stream_start;
+        release_locked(frames.front());
+        frames.pop_front();
+        ++dropped_frames;
+    }
+    frames.push_back(std::move(queued));
+    cond.notify_all();
+
+    return true;
+}
+
+bool FrameQueue::pop(QueuedFrame &frame)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this]{ return closed || !frames.empty(); });
+    if (closed) {
+        return false;
+    }
+
+    frame = std::move(frames.front());
+    frames.pop_front();
+    cond.notify_all();
+
+    return true;
+}
+
+void FrameQueue::release(QueuedFrame &frame)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    release_locked(frame);
+}
+
+void FrameQueue::release_locked(QueuedFrame &frame)
+{
+    if (frame.buffer) {
+        frame.buffer->Unref();
+        frame.buffer = nullptr;
+    } else if (frame.storage.capacity()) {
+        free_buffers.push_back(std::move(frame.storage));
+        frame.storage.clear();
+    }
+    frame.data = nullptr;
+    frame.data_size = 0;
+}
+
+void FrameQueue::close()
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    closed = true;
+    cond.notify_all();
+}
+
+unsigned FrameQueue::dropped() const
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    return dropped_frames;
+}
+
+}} // namespace spice::streaming_agent
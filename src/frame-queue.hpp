@@ -0,0 +1,84 @@
+/* A bounded queue of encoded frames, connecting the capture and the
+ * sending stages of the pipelined mode.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_FRAME_QUEUE_HPP
+#define SPICE_STREAMING_AGENT_FRAME_QUEUE_HPP
+
+#include <spice-streaming-agent/frame-capture.hpp>
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+
+namespace spice {
+namespace streaming_agent {
+
+class FrameBufferPool;
+
+struct QueuedFrame
+{
+    // either points to storage or inside a buffer borrowed from the pool
+    const uint8_t *data = nullptr;
+    size_t data_size = 0;
+    std::vector<uint8_t> storage;
+    // reference held on the pool buffer, if any
+    FrameBuffer *buffer = nullptr;
+    FrameSize size;
+    SpiceVideoCodecType codec;
+    bool stream_start;
+    // time the frame was captured, see FrameLog::get_time()
+    uint64_t capture_time;
+};
+
+class FrameQueue
+{
+public:
+    /*! Frames stored in buffers of pool are queued without copying them */
+    FrameQueue(size_t capacity, FrameBufferPool *pool = nullptr);
+    ~FrameQueue();
+
+    /*! Add a frame to the queue, copying it unless it comes from the pool.
+     * If the queue is full the oldest frame is dropped when may_drop is
+     * true, otherwise this waits for the consumer to make room.
+     * \return false if the queue was closed
+     */
+    bool push(const FrameInfo &frame, SpiceVideoCodecType codec, uint64_t capture_time,
+              bool may_drop);
+
+    /*! Wait for the next frame.
+     * The frame should be given back with release() once sent.
+     * \return false if the queue was closed
+     */
+    bool pop(QueuedFrame &frame);
+
+    /*! Give back the storage or the buffer of a frame returned by pop() */
+    void release(QueuedFrame &frame);
+
+    /*! Wake up and refuse any further push() and pop() */
+    void close();
+
+    unsigned dropped() const;
+
+private:
+    void release_locked(QueuedFrame &frame);
+
+    FrameBufferPool *const pool;
+    mutable std::mutex mutex;
+    std::condition_variable cond;
+    const size_t capacity;
+    std::deque<QueuedFrame> frames;
+    std::vector<std::vector<uint8_t>> free_buffers;
+    unsigned dropped_frames = 0;
+    bool closed = false;
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_FRAME_QUEUE_HPP
@@ -0,0 +1,267 @@
+/* Downscaling of the captured frames, to stream a smaller size than the
+ * screen.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "frame-scaler.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <stdio.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+
+namespace spice {
+namespace streaming_agent {
+
+bool parse_scale_option(ScaleSettings &settings, const std::string &name, const std::string &value)
+{
+    if (name == "scale.max-size") {
+        unsigned width, height;
+        char end;
+        if (value == "off") {
+            settings.max_width = settings.max_height = 0;
+        } else if (sscanf(value.c_str(), "%ux%u%c", &width, &height, &end) == 2 &&
+                   width >= 16 && height >= 16) {
+            settings.max_width = width;
+            settings.max_height = height;
+        } else {
+            throw std::runtime_error("Invalid value '" + value + "' for option 'scale.max-size'.");
+        }
+    } else if (name == "scale.adaptive") {
+        if (value == "on") {
+            settings.adaptive = true;
+        } else if (value == "off") {
+            settings.adaptive = false;
+        } else {
+            throw std::runtime_error("Invalid value '" + value + "' for option 'scale.adaptive'.");
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
+
+constexpr double ScaleSelector::steps[];
+constexpr double ScaleSelector::lower_rate;
+constexpr double ScaleSelector::raise_rate;
+const uint64_t ScaleSelector::hold_time;
+const uint64_t ScaleSelector::raise_time;
+const uint64_t ScaleSelector::max_raise_time;
+
+ScaleSelector::ScaleSelector(const ScaleSettings &settings) :
+    settings(settings)
+{
+}
+
+void ScaleSelector::adapt(double rate, uint64_t time)
+{
+    if (rate < raise_rate) {
+        raise_since = 0;
+    } else if (!raise_since) {
+        raise_since = time;
+    }
+    if (last_change && time - last_change < hold_time) {
+        return;
+    }
+
+    const unsigned step_count = sizeof(steps) / sizeof(steps[0]);
+    if (rate < lower_rate && current_step + 1 < step_count) {
+        if (raised && time - last_change < current_raise_time) {
+            // the larger size was still too large, try it again later
+            current_raise_time = std::min(current_raise_time * 2, max_raise_time);
+        } else {
+            current_raise_time = raise_time;
+        }
+        ++current_step;
+        last_change = time;
+        raised = false;
+        raise_since = 0;
+    } else if (current_step > 0 && raise_since && time - raise_since >= current_raise_time) {
+        --current_step;
+        last_change = time;
+        raised = true;
+        raise_since = 0;
+    }
+}
+
+FrameSize ScaleSelector::size(unsigned width, unsigned height, double rate, uint64_t time)
+{
+    if (settings.adaptive) {
+        adapt(rate, time);
+    }
+
+    double factor = 1.0;
+    if (settings.max_width && width > settings.max_width) {
+        factor = (double) settings.max_width / width;
+    }
+    if (settings.max_height && height > settings.max_height) {
+        factor = std::min(factor, (double) settings.max_height / height);
+    }
+    factor *= steps[current_step];
+    if (factor >= 1.0 || width < 16 || height < 16) {
+        return FrameSize{width, height};
+    }
+
+    // the nearest even sizes, still fitting in the maximum
+    const unsigned scaled_width = std::max(16u, (unsigned) (width * factor + 0.5) & ~1u);
+    const unsigned scaled_height = std::max(16u, (unsigned) (height * factor + 0.5) & ~1u);
+    return FrameSize{std::min(width, scaled_width), std::min(height, scaled_height)};
+}
+
+namespace {
+
+#if defined(__SSE2__)
+unsigned half_sse2(const uint8_t *row0, const uint8_t *row1, unsigned dst_width, uint8_t *dst)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+
+    unsigned x = 0;
+    for (; x + 4 <= dst_width; x += 4) {
+        __m128i pixels[2];
+        for (unsigned n = 0; n < 2; ++n) {
+            const __m128i p0 = _mm_loadu_si128((const __m128i *) (row0 + 8 * x) + n);
+            const __m128i p1 = _mm_loadu_si128((const __m128i *) (row1 + 8 * x) + n);
+            // both rows summed in 16 bits lanes, two pixels per register
+            const __m128i low = _mm_add_epi16(_mm_unpacklo_epi8(p0, zero),
+                                              _mm_unpacklo_epi8(p1, zero));
+            const __m128i high = _mm_add_epi16(_mm_unpackhi_epi8(p0, zero),
+                                               _mm_unpackhi_epi8(p1, zero));
+            // then the pixel pairs, in the low 64 bits
+            const __m128i sum0 = _mm_add_epi16(low, _mm_srli_si128(low, 8));
+            const __m128i sum1 = _mm_add_epi16(high, _mm_srli_si128(high, 8));
+            pixels[n] = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(sum0, sum1), two), 2);
+        }
+        _mm_storeu_si128((__m128i *) (dst + 4 * x), _mm_packus_epi16(pixels[0], pixels[1]));
+    }
+    return x;
+}
+#endif
+
+#if defined(__ARM_NEON)
+unsigned half_neon(const uint8_t *row0, const uint8_t *row1, unsigned dst_width, uint8_t *dst)
+{
+    unsigned x = 0;
+    for (; x + 8 <= dst_width; x += 8) {
+        // 16 pixels of each row, split by channel
+        const uint8x16x4_t p0 = vld4q_u8(row0 + 8 * x);
+        const uint8x16x4_t p1 = vld4q_u8(row1 + 8 * x);
+        uint8x8x4_t pixels;
+        for (unsigned c = 0; c < 4; ++c) {
+            const uint16x8_t sum = vpadalq_u8(vpaddlq_u8(p0.val[c]), p1.val[c]);
+            pixels.val[c] = vrshrn_n_u16(sum, 2);
+        }
+        vst4_u8(dst + 4 * x, pixels);
+    }
+    return x;
+}
+#endif
+
+} // namespace
+
+FrameScaler::FrameScaler(unsigned threads, bool use_simd) :
+    workers(std::max(threads, 1u))
+{
+    if (!use_simd) {
+        return;
+    }
+#if defined(__SSE2__)
+    name = "SSE2";
+    kernel_half = half_sse2;
+#endif
+#if defined(__ARM_NEON)
+    name = "NEON";
+    kernel_half = half_neon;
+#endif
+}
+
+const char *FrameScaler::kernel_name() const
+{
+    return name;
+}
+
+void FrameScaler::scale_rows(const uint8_t *src, size_t src_stride, unsigned src_height,
+                             uint8_t *dst, size_t dst_stride, unsigned dst_width,
+                             unsigned dst_height, unsigned row, unsigned end)
+{
+    const bool half = columns[dst_width] == 2 * dst_width && src_height == 2 * dst_height;
+
+    for (; row < end; ++row) {
+        const unsigned y0 = (uint64_t) row * src_height / dst_height;
+        const unsigned y1 = (uint64_t) (row + 1) * src_height / dst_height;
+        const uint8_t *src_row = src + y0 * src_stride;
+        uint8_t *dst_row = dst + row * dst_stride;
+
+        unsigned x = half && kernel_half ?
+            kernel_half(src_row, src_row + src_stride, dst_width, dst_row) : 0;
+        for (; x < dst_width; ++x) {
+            const unsigned x0 = columns[x], x1 = columns[x + 1];
+            uint32_t sum[4] = {};
+            for (unsigned y = y0; y < y1; ++y) {
+                const uint8_t *pixel = src + y * src_stride + x0 * 4;
+                for (unsigned n = x0; n < x1; ++n, pixel += 4) {
+                    sum[0] += pixel[0];
+                    sum[1] += pixel[1];
+                    sum[2] += pixel[2];
+                    sum[3] += pixel[3];
+                }
+            }
+            const uint32_t count = (x1 - x0) * (y1 - y0);
+            for (unsigned c = 0; c < 4; ++c) {
+                dst_row[x * 4 + c] = (sum[c] + count / 2) / count;
+            }
+        }
+    }
+}
+
+void FrameScaler::scale(const uint8_t *src, size_t src_stride, unsigned src_width,
+                        unsigned src_height, uint8_t *dst, size_t dst_stride,
+                        unsigned dst_width, unsigned dst_height)
+{
+    if (dst_width > src_width || dst_height > src_height || !dst_width || !dst_height) {
+        throw std::logic_error("Invalid size of the scaled frame");
+    }
+    if (dst_width == src_width && dst_height == src_height) {
+        for (unsigned row = 0; row < src_height; ++row) {
+            memcpy(dst + row * dst_stride, src + row * src_stride, (size_t) src_width * 4);
+        }
+        return;
+    }
+
+    if (columns.size() != dst_width + 1 || columns_src_width != src_width) {
+        columns.resize(dst_width + 1);
+        for (unsigned x = 0; x <= dst_width; ++x) {
+            columns[x] = (uint64_t) x * src_width / dst_width;
+        }
+        columns_src_width = src_width;
+    }
+
+    const unsigned bands = std::min(workers.size(), std::max(1u, dst_height / min_band_height));
+    if (bands <= 1) {
+        scale_rows(src, src_stride, src_height, dst, dst_stride, dst_width, dst_height,
+                   0, dst_height);
+        return;
+    }
+
+    const unsigned band_height = (dst_height + bands - 1) / bands;
+    workers.run(bands, [&](unsigned band) {
+        const unsigned row = band * band_height;
+        const unsigned end = std::min(dst_height, row + band_height);
+        if (row < end) {
+            scale_rows(src, src_stride, src_height, dst, dst_stride, dst_width, dst_height,
+                       row, end);
+        }
+    });
+}
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,129 @@
+/* Downscaling of the captured frames, to stream a smaller size than the
+ * screen.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_FRAME_SCALER_HPP
+#define SPICE_STREAMING_AGENT_FRAME_SCALER_HPP
+
+#include "worker-pool.hpp"
+
+#include <spice-streaming-agent/frame-capture.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*! Settings of the size of the stream, shared by the plugins */
+struct ScaleSettings
+{
+    /*! Largest size of the stream, 0 for no limit */
+    unsigned max_width = 0, max_height = 0;
+    /*! Also lower the size when the rate factor is low */
+    bool adaptive = false;
+
+    bool enabled() const { return max_width || max_height || adaptive; }
+};
+
+/*!
+ * Parse a "scale.*" option.
+ * Throws std::runtime_error for an invalid value.
+ * \return false if the option is not a scale option
+ */
+bool parse_scale_option(ScaleSettings &settings, const std::string &name, const std::string &value);
+
+/*!
+ * Chooses the size of the stream for the size of the captured area.
+ *
+ * The size fits in the maximum size and keeps the aspect ratio. When
+ * adaptive, it is lowered by steps while Agent::RateFactor() is low and
+ * raised back once the rate recovered for raise_time. A size change
+ * starts a new stream, so a size is kept at least hold_time, and
+ * raise_time doubles, up to max_raise_time, every time the larger size
+ * proves to be too large again. Scaled sizes are even, as the encoders
+ * need.
+ */
+class ScaleSelector
+{
+public:
+    explicit ScaleSelector(const ScaleSettings &settings);
+
+    /*! \param rate the current Agent::RateFactor()
+     * \param time in microseconds, see FrameLog::get_time()
+     */
+    FrameSize size(unsigned width, unsigned height, double rate, uint64_t time);
+
+    /*! Current step, 0 for the full size */
+    unsigned step() const { return current_step; }
+
+    /*! Size of each step, relative to the full size */
+    static constexpr double steps[] = { 1.0, 0.75, 0.5 };
+    static constexpr double lower_rate = 0.5, raise_rate = 0.9;
+    static const uint64_t hold_time = 5000000;
+    static const uint64_t raise_time = 10000000;
+    static const uint64_t max_raise_time = 160000000;
+
+private:
+    void adapt(double rate, uint64_t time);
+
+    const ScaleSettings settings;
+    unsigned current_step = 0;
+    uint64_t last_change = 0;
+    // the rate is at least raise_rate since, 0 if it is not
+    uint64_t raise_since = 0;
+    uint64_t current_raise_time = raise_time;
+    bool raised = false;
+};
+
+/*!
+ * Scales BGRx images down with a box filter: each pixel is the rounded
+ * average of the pixels it covers, rounded to whole source pixels.
+ *
+ * Halving both dimensions, like from 4K to 1080p, has SIMD kernels (SSE2
+ * on x86, NEON on ARM) giving the same result as the plain C code. With
+ * more than one thread the image is split in bands of rows scaled in
+ * parallel.
+ */
+class FrameScaler
+{
+public:
+    /*! Without use_simd the plain C code is used, mostly for testing */
+    FrameScaler(unsigned threads, bool use_simd = true);
+
+    /*! The destination cannot be larger than the source */
+    void scale(const uint8_t *src, size_t src_stride, unsigned src_width, unsigned src_height,
+               uint8_t *dst, size_t dst_stride, unsigned dst_width, unsigned dst_height);
+
+    /*! Name of the instructions used, for the logs */
+    const char *kernel_name() const;
+
+    /*! Bands are not made smaller than this */
+    static const unsigned min_band_height = 32;
+
+    // halve the leading pixels of two rows, return how many were written
+    typedef unsigned Kernel(const uint8_t *row0, const uint8_t *row1, unsigned dst_width,
+                            uint8_t *dst);
+
+private:
+    void scale_rows(const uint8_t *src, size_t src_stride, unsigned src_height,
+                    uint8_t *dst, size_t dst_stride, unsigned dst_width, unsigned dst_height,
+                    unsigned row, unsigned end);
+
+    WorkerPool workers;
+    const char *name = "C";
+    Kernel *kernel_half = nullptr;
+    // first source column of each destination column, and the end
+    std::vector<unsigned> columns;
+    unsigned columns_src_width = 0;
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_FRAME_SCALER_HPP
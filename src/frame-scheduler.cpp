@@ -0,0 +1,85 @@
+/* Pacing of the captured frames.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "frame-scheduler.hpp"
+
+#include <algorithm>
+#include <errno.h>
+#include <time.h>
+
+
+namespace spice {
+namespace streaming_agent {
+
+static uint64_t get_time()
+{
+    timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+void FrameScheduler::wait(unsigned fps)
+{
+    const uint64_t deadline = next_deadline(get_time(), fps);
+
+    timespec ts;
+    ts.tv_sec = deadline / 1000000000u;
+    ts.tv_nsec = deadline % 1000000000u;
+    // with an absolute time the sleep can be restarted after a signal
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+    }
+
+    woke_up(get_time());
+}
+
+uint64_t FrameScheduler::next_deadline(uint64_t now, unsigned fps)
+{
+    fps = std::max(fps, 1u);
+    const uint64_t period = 1000000000u / fps;
+
+    resynced = false;
+    if (fps != this->fps || deadline == 0) {
+        this->fps = fps;
+        deadline = now;
+    } else {
+        deadline += period;
+        if (deadline + period <= now) {
+            resynced = true;
+            deadline = now;
+        }
+    }
+
+    return deadline;
+}
+
+void FrameScheduler::restart(uint64_t now)
+{
+    if (fps && deadline && now >= deadline + 1000000000u / fps) {
+        deadline = now;
+    }
+}
+
+void FrameScheduler::restart()
+{
+    restart(get_time());
+}
+
+void FrameScheduler::woke_up(uint64_t now)
+{
+    ++frame_stats.frames;
+    if (resynced) {
+        ++frame_stats.missed;
+        return;
+    }
+
+    const uint64_t jitter = now > deadline ? now - deadline : 0;
+    frame_stats.total_jitter += jitter;
+    frame_stats.max_jitter = std::max(frame_stats.max_jitter, jitter);
+}
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,106 @@
+/* Pacing of the captured frames.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_FRAME_SCHEDULER_HPP
+#define SPICE_STREAMING_AGENT_FRAME_SCHEDULER_HPP
+
+#include <algorithm>
+#include <cstdint>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Computes absolute deadlines on CLOCK_MONOTONIC for the frames.
+ *
+ * Deadlines follow each other by exactly one period, so the time spent
+ * capturing and encoding a frame does not delay the next one and the
+ * cadence does not drift. When a whole period was missed the schedule
+ * restarts from the current time instead of catching up with a burst
+ * of frames.
+ */
+class FrameScheduler
+{
+public:
+    struct Stats
+    {
+        unsigned frames = 0;
+        // frames for which a whole period was missed
+        unsigned missed = 0;
+        // delay between the deadlines and the actual wake up, in ns
+        uint64_t total_jitter = 0;
+        uint64_t max_jitter = 0;
+
+        uint64_t mean_jitter() const
+        {
+            return frames > missed ? total_jitter / (frames - missed) : 0;
+        }
+    };
+
+    /*! Sleep till the deadline of the next frame at fps frames per second */
+    void wait(unsigned fps);
+
+    /*! Compute the deadline of the next frame, now being the current time in ns */
+    uint64_t next_deadline(uint64_t now, unsigned fps);
+
+    /*! Account for a wake up at time now for the last deadline */
+    void woke_up(uint64_t now);
+
+    /*! Restart the schedule from now, the current time in ns, if the next
+     * deadline passed since the last wake up, for instance while waiting
+     * for the screen to change. The next frame is then due a period after
+     * now instead of right away, and it is not counted as missed.
+     */
+    void restart(uint64_t now);
+    void restart();
+
+    const Stats &stats() const { return frame_stats; }
+    void reset_stats() { frame_stats = Stats(); }
+
+private:
+    unsigned fps = 0;
+    uint64_t deadline = 0;
+    bool resynced = false;
+    Stats frame_stats;
+};
+
+/*!
+ * Decides when the screen content stopped changing, to capture a frame
+ * once it is drawn rather than while it is.
+ *
+ * A compositor flipping a frame, or a client drawing one, changes the
+ * screen through a burst of requests. The content is deemed settled once
+ * no change was seen for quiet_time, or after max_time if it keeps
+ * changing, e.g. for a video playing faster than the capture. Times are
+ * in ns.
+ */
+class SettleTimer
+{
+public:
+    SettleTimer(uint64_t quiet_time, uint64_t max_time) :
+        quiet_time(quiet_time), max_time(max_time) {}
+
+    /*! Start waiting at time now, right after a change */
+    void start(uint64_t now) { started = last_change = now; }
+
+    /*! Account for a change at time now */
+    void changed(uint64_t now) { last_change = std::max(last_change, now); }
+
+    /*! Time the content is deemed settled at */
+    uint64_t deadline() const
+    {
+        return std::min(last_change + quiet_time, started + std::max(max_time, quiet_time));
+    }
+
+private:
+    const uint64_t quiet_time, max_time;
+    uint64_t started = 0, last_change = 0;
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_FRAME_SCHEDULER_HPP
@@ -5,25 +5,35 @@
  */
 
 #include <config.h>
+#include <algorithm>
+#include <chrono>
 #include <cstring>
 #include <exception>
 #include <stdexcept>
 #include <sstream>
 #include <memory>
+#include <mutex>
+#include <vector>
 #include <syslog.h>
 #include <unistd.h>
 #include <gst/gst.h>
 #include <gst/app/gstappsink.h>
+#include <gst/video/video.h>
 
 #define XLIB_CAPTURE 1
 #if XLIB_CAPTURE
 #include <X11/Xlib.h>
 #include <gst/app/gstappsrc.h>
+#include "x11-capture.hpp"
+#include "damage-tracker.hpp"
+#include "color-convert.hpp"
 #endif
 
 #include <spice-streaming-agent/plugin.hpp>
 #include <spice-streaming-agent/frame-capture.hpp>
 
+#include "gst-utils.hpp"
+
 #define gst_syslog(priority, str, ...) syslog(priority, "Gstreamer plugin: " str, ## __VA_ARGS__);
 
 namespace spice {
@@ -35,41 +45,154 @@ struct GstreamerEncoderSettings
     int fps = 25;
     SpiceVideoCodecType codec = SPICE_VIDEO_CODEC_TYPE_H264;
     std::string encoder;
+    // prefer the hardware encoders
+    bool use_hardware = true;
+    // the cursor position is sent by the agent, frames must not include it
+    bool show_pointer = true;
+    // frames between two keyframes at most, 0 for the encoder's default
+    int keyframe_interval = 0;
+#if XLIB_CAPTURE
+    CaptureSettings capture;
+    // convert the frames to the encoder format instead of using videoconvert
+    bool convert = true;
+    int convert_threads = 1;
+#endif
 };
 
-template <typename T>
-struct GstObjectDeleter {
-    void operator()(T* p)
-    {
-        gst_object_unref(p);
-    }
+struct EncoderProperty
+{
+    const char *name, *value;
 };
 
-template <typename T>
-using GstObjectUPtr = std::unique_ptr<T, GstObjectDeleter<T>>;
+/* Elements sharing the upload elements and low latency settings */
+struct EncoderFamily
+{
+    // prefix of the element names
+    const char *prefix;
+    bool hardware;
+    // elements uploading the frames to the encoder memory, replacing
+    // videoconvert, nullptr terminated
+    const char *upload[3];
+    // the last upload element can also scale the frames
+    bool upload_scales;
+    // nullptr terminated
+    EncoderProperty properties[6];
+};
 
-struct GstCapsDeleter {
-    void operator()(GstCaps* p)
-    {
-        gst_caps_unref(p);
-    }
+// in order of preference, "vaapi" must come before "va"
+const EncoderFamily encoder_families[] = {
+    { "nv", true, { "cudaupload", "cudaconvert", nullptr }, false,
+      { {"preset", "low-latency-hq"}, {"zerolatency", "true"}, {"bframes", "0"},
+        {"rc-mode", "cbr"}, {nullptr, nullptr} } },
+    { "vaapi", true, { "vaapipostproc", nullptr }, true,
+      { {"rate-control", "cbr"}, {"max-bframes", "0"}, {nullptr, nullptr} } },
+    { "va", true, { "vapostproc", nullptr }, true,
+      { {"rate-control", "cbr"}, {"b-frames", "0"}, {nullptr, nullptr} } },
+    { "qsv", true, { "vapostproc", nullptr }, true,
+      { {"low-latency", "true"}, {"rate-control", "cbr"}, {"b-frames", "0"}, {nullptr, nullptr} } },
+    { "msdk", true, { "msdkvpp", nullptr }, true,
+      { {"rate-control", "cbr"}, {"b-frames", "0"}, {"async-depth", "1"}, {nullptr, nullptr} } },
+    { "x264", false, { nullptr }, false,
+      { {"tune", "zerolatency"}, {"bframes", "0"}, {"speed-preset", "1"}, {nullptr, nullptr} } },
+    { "vp", false, { nullptr }, false,
+      { {"deadline", "1"}, {"cpu-used", "8"}, {"lag-in-frames", "0"}, {nullptr, nullptr} } },
 };
 
-using GstCapsUPtr = std::unique_ptr<GstCaps, GstCapsDeleter>;
+// other encoders, the x264enc settings are ignored by the others
+const EncoderFamily software_family = { "", false, { nullptr }, false,
+    { {"tune", "zerolatency"}, {"bframes", "0"}, {"speed-preset", "1"}, {nullptr, nullptr} } };
+
+#if XLIB_CAPTURE
+/* Pool of buffers wrapping shared memory images, the screen is grabbed
+ * directly into them */
+struct ShmBufferPool
+{
+    GstBufferPool parent;
+    Display *display;
+    unsigned width, height;
+};
 
-struct GstSampleDeleter {
-    void operator()(GstSample* p)
+struct ShmBufferPoolClass
+{
+    GstBufferPoolClass parent_class;
+};
+
+G_DEFINE_TYPE(ShmBufferPool, shm_buffer_pool, GST_TYPE_BUFFER_POOL)
+
+GQuark shm_image_quark()
+{
+    static GQuark quark = g_quark_from_static_string("spice-streaming-agent-shm-image");
+    return quark;
+}
+
+// buffers can be released by the streaming threads, their images are
+// destroyed later by the capture thread as it owns the display
+std::mutex released_images_mutex;
+std::vector<ShmImage *> released_images;
+
+void destroy_shm_image(gpointer image)
+{
+    std::lock_guard<std::mutex> guard(released_images_mutex);
+    released_images.push_back(static_cast<ShmImage *>(image));
+}
+
+void destroy_released_images()
+{
+    std::vector<ShmImage *> images;
     {
-        gst_sample_unref(p);
+        std::lock_guard<std::mutex> guard(released_images_mutex);
+        images.swap(released_images);
     }
-};
+    for (ShmImage *image: images) {
+        delete image;
+    }
+}
+
+GstFlowReturn shm_buffer_pool_alloc_buffer(GstBufferPool *bpool, GstBuffer **buffer,
+                                           GstBufferPoolAcquireParams *)
+{
+    ShmBufferPool *pool = reinterpret_cast<ShmBufferPool *>(bpool);
 
-using GstSampleUPtr = std::unique_ptr<GstSample, GstSampleDeleter>;
+    ShmImage *image;
+    try {
+        image = new ShmImage(pool->display, pool->width, pool->height);
+    } catch (const std::exception &e) {
+        gst_syslog(LOG_WARNING, "Cannot allocate a shared memory image: %s", e.what());
+        return GST_FLOW_ERROR;
+    }
+
+    XImage *ximage = image->get();
+    const size_t size = (size_t) ximage->bytes_per_line * ximage->height;
+    *buffer = gst_buffer_new_wrapped_full((GstMemoryFlags) 0, ximage->data, size, 0, size,
+                                          image, destroy_shm_image);
+    gst_mini_object_set_qdata(GST_MINI_OBJECT(*buffer), shm_image_quark(), image, nullptr);
+    return GST_FLOW_OK;
+}
+
+void shm_buffer_pool_init(ShmBufferPool *)
+{
+}
+
+void shm_buffer_pool_class_init(ShmBufferPoolClass *klass)
+{
+    GST_BUFFER_POOL_CLASS(klass)->alloc_buffer = shm_buffer_pool_alloc_buffer;
+}
+
+GstBufferPool *shm_buffer_pool_new(Display *display, unsigned width, unsigned height)
+{
+    ShmBufferPool *pool = static_cast<ShmBufferPool *>(g_object_new(shm_buffer_pool_get_type(),
+                                                                    nullptr));
+    pool->display = display;
+    pool->width = width;
+    pool->height = height;
+    return GST_BUFFER_POOL(pool);
+}
+#endif
 
 class GstreamerFrameCapture final : public FrameCapture
 {
 public:
-    GstreamerFrameCapture(const GstreamerEncoderSettings &settings);
+    GstreamerFrameCapture(const GstreamerEncoderSettings &settings, Agent *agent);
     ~GstreamerFrameCapture();
     FrameInfo CaptureFrame() override;
     void Reset() override;
@@ -79,33 +202,96 @@ public:
 private:
     void free_sample();
     GstElement *get_encoder_plugin(const GstreamerEncoderSettings &settings, GstCapsUPtr &sink_caps);
+    std::vector<GstObjectUPtr<GstElement>> get_convert_plugins();
+    void add_scale_plugins(std::vector<GstObjectUPtr<GstElement>> &elements);
     GstElement *get_capture_plugin(const GstreamerEncoderSettings &settings);
     void pipeline_init(const GstreamerEncoderSettings &settings);
+    void find_rate_property();
+    void apply_rate();
+    void force_keyframe();
+    bool keyframe_requested() const;
+    void check_keyframe();
 #if XLIB_CAPTURE
     void xlib_capture();
+    void resize_capture();
+    void resize_convert_pool();
+    void restart_pipeline();
+    GstBuffer *convert_frame(const XImage *image);
+    GstBuffer *grab_frame(Window win);
     Display *dpy;
-    XImage *image = nullptr;
+    std::unique_ptr<X11Capture> x11_capture;
+    std::unique_ptr<OutputSelector> output_selector;
+    std::unique_ptr<DamageTracker> damage_tracker;
+    std::chrono::steady_clock::time_point last_grab_time;
+    // nullptr if MIT-SHM cannot be used, frames are then copied by x11_capture
+    GstObjectUPtr<GstBufferPool> shm_pool;
+    // frames converted by the agent, GST_VIDEO_FORMAT_UNKNOWN if they are
+    // pushed as BGRx
+    GstVideoFormat convert_format = GST_VIDEO_FORMAT_UNKNOWN;
+    std::unique_ptr<ColorConverter> converter;
+    GstObjectUPtr<GstBufferPool> convert_pool;
+    GstVideoInfo convert_info;
+    GstCapsUPtr capture_caps;
+    ScaleSelector scale_selector;
+    // the frames converted by the agent are also scaled by it, before
+    // the conversion, the others by the pipeline through scale_filter
+    std::unique_ptr<FrameScaler> scaler;
+    std::vector<uint8_t> scaled_frame;
+    // owned by the pipeline, nullptr if the pipeline does not scale
+    GstElement *scale_filter = nullptr;
+    // the caps changed, the encoder may fail to reconfigure itself
+    bool renegotiating = false;
+    // origin of the captured area
+    int cur_x = 0, cur_y = 0;
 #endif
-    GstObjectUPtr<GstElement> pipeline, capture, sink;
+    GstObjectUPtr<GstElement> pipeline, capture, encoder, sink;
+    const EncoderFamily *family = nullptr;
+    // frames are converted and uploaded by the GPU
+    bool gpu_upload = false;
+    // encoder property scaled by the agent's rate factor, with its full value
+    GParamSpec *rate_property = nullptr;
+    double rate_base = 0, rate_applied = 1.0;
+    // Agent::KeyframeRequests() handled
+    unsigned keyframe_requests = 0;
+    // the encoder cannot limit the keyframe interval, keyframes are forced
+    // every forced_keyframe_interval frames
+    unsigned forced_keyframe_interval = 0;
+    unsigned frames_since_keyframe = 0;
     GstSampleUPtr sample;
     GstMapInfo map = {};
     uint32_t last_width = ~0u, last_height = ~0u;
     uint32_t cur_width = 0, cur_height = 0;
+    // size of the stream, smaller than the captured size if scaled
+    uint32_t out_width = 0, out_height = 0;
     bool is_first = true;
     GstreamerEncoderSettings settings; // will be set by plugin settings
+    Agent *const agent;
 };
 
 class GstreamerPlugin final: public Plugin
 {
 public:
+    GstreamerPlugin() : cache(gst_capability_cache("gst-plugin", encoder_families)) {}
     FrameCapture *CreateCapture() override;
     unsigned Rank() override;
     void ParseOptions(const ConfigureOption *options);
     SpiceVideoCodecType VideoCodecType() const override {
         return settings.codec;
     }
+    void SetAgent(Agent *agent) { this->agent = agent; }
 private:
+    std::string encoder_cache_key() const;
+    void select_encoder();
     GstreamerEncoderSettings settings;
+    Agent *agent = nullptr;
+    // gst.encoder, settings.encoder is replaced by the chosen encoder
+    std::string requested_encoder;
+    // the encoder is chosen once, probing hardware encoders is slow
+    bool encoder_selected = false;
+    // the encoder was chosen by a previous run, it was not probed
+    bool encoder_cached = false;
+    std::unique_ptr<CapabilityCache> cache;
+    unsigned rank = DontUse;
 };
 
 GstElement *GstreamerFrameCapture::get_capture_plugin(const GstreamerEncoderSettings &settings)
@@ -118,18 +304,24 @@ GstElement *GstreamerFrameCapture::get_capture_plugin(const GstreamerEncoderSett
     capture = gst_element_factory_make("ximagesrc", "capture");
     g_object_set(capture,
                 "use-damage", 0,
+                "show-pointer", settings.show_pointer,
                  nullptr);
 #endif
     return capture;
 }
 
-GstElement *GstreamerFrameCapture::get_encoder_plugin(const GstreamerEncoderSettings &settings,
-                                                      GstCapsUPtr &sink_caps)
+const EncoderFamily *encoder_family(const char *name)
+{
+    for (const EncoderFamily &family: encoder_families) {
+        if (strncmp(name, family.prefix, strlen(family.prefix)) == 0) {
+            return &family;
+        }
+    }
+    return &software_family;
+}
+
+GstCapsUPtr stream_caps(const GstreamerEncoderSettings &settings)
 {
-    GList *encoders;
-    GList *filtered;
-    GstElement *encoder;
-    GstElementFactory *factory = nullptr;
     std::stringstream caps_ss;
 
     switch (settings.codec) {
@@ -153,54 +345,193 @@ GstElement *GstreamerFrameCapture::get_encoder_plugin(const GstreamerEncoderSett
     }
     caps_ss << ",framerate=" << settings.fps << "/1";
 
-    encoders = gst_element_factory_list_get_elements(GST_ELEMENT_FACTORY_TYPE_VIDEO_ENCODER, GST_RANK_NONE);
-    sink_caps.reset(gst_caps_from_string(caps_ss.str().c_str()));
-    filtered = gst_element_factory_list_filter(encoders, sink_caps.get(), GST_PAD_SRC, false);
+    return GstCapsUPtr(gst_caps_from_string(caps_ss.str().c_str()));
+}
+
+// hardware encoders can be installed without a device able to run them
+bool encoder_works(GstElementFactory *factory)
+{
+    GstObjectUPtr<GstElement> encoder(gst_element_factory_create(factory, nullptr));
+    if (!encoder) {
+        return false;
+    }
+    bool works = gst_element_set_state(encoder.get(), GST_STATE_READY) != GST_STATE_CHANGE_FAILURE;
+    gst_element_set_state(encoder.get(), GST_STATE_NULL);
+    return works;
+}
+
+/* Find the encoder to use, the one named in the settings if any, then
+ * the working hardware encoders and finally the software ones by rank.
+ * Returns a new reference or nullptr.
+ */
+GstElementFactory *find_encoder(const GstreamerEncoderSettings &settings, GstCaps *caps)
+{
+    GstElementFactory *factory = nullptr;
+    gchar *caps_str = gst_caps_to_string(caps);
+
+    GList *encoders = gst_element_factory_list_get_elements(GST_ELEMENT_FACTORY_TYPE_VIDEO_ENCODER,
+                                                            GST_RANK_NONE);
+    GList *filtered = gst_element_factory_list_filter(encoders, caps, GST_PAD_SRC, false);
+    filtered = g_list_sort(filtered, gst_plugin_feature_rank_compare_func);
     if (filtered) {
-        gst_syslog(LOG_NOTICE, "Looking for encoder plugins which can produce a '%s' stream", caps_ss.str().c_str());
+        gst_syslog(LOG_NOTICE, "Looking for encoder plugins which can produce a '%s' stream", caps_str);
         for (GList *l = filtered; l != nullptr; l = l->next) {
-            if (!factory && !settings.encoder.compare(GST_ELEMENT_NAME(l->data))) {
+            if (!factory && !settings.encoder.compare(GST_OBJECT_NAME(l->data))) {
                 factory = (GstElementFactory*)l->data;
             }
-            gst_syslog(LOG_NOTICE, "'%s' plugin is available", GST_ELEMENT_NAME(l->data));
+            gst_syslog(LOG_NOTICE, "'%s' plugin is available", GST_OBJECT_NAME(l->data));
         }
         if (!factory && !settings.encoder.empty()) {
             gst_syslog(LOG_WARNING,
                        "Specified encoder named '%s' cannot produce '%s' stream, make sure matching gst.codec is specified and plugin's availability",
-                       settings.encoder.c_str(), caps_ss.str().c_str());
+                       settings.encoder.c_str(), caps_str);
+        }
+        if (!factory && settings.use_hardware) {
+            for (const EncoderFamily &family: encoder_families) {
+                for (GList *l = filtered; !factory && l != nullptr; l = l->next) {
+                    const char *name = GST_OBJECT_NAME(l->data);
+                    if (family.hardware && encoder_family(name) == &family) {
+                        if (encoder_works((GstElementFactory*)l->data)) {
+                            factory = (GstElementFactory*)l->data;
+                        } else {
+                            gst_syslog(LOG_NOTICE, "'%s' hardware encoder cannot be used", name);
+                        }
+                    }
+                }
+            }
+        }
+        for (GList *l = filtered; !factory && l != nullptr; l = l->next) {
+            if (!encoder_family(GST_OBJECT_NAME(l->data))->hardware) {
+                factory = (GstElementFactory*)l->data;
+            }
         }
-        factory = factory ? factory : (GstElementFactory*)filtered->data;
-        gst_syslog(LOG_NOTICE, "'%s' encoder plugin is used", GST_ELEMENT_NAME(factory));
+        if (factory) {
+            gst_object_ref(factory);
+        }
+    }
+    if (!factory) {
+        gst_syslog(LOG_ERR, "No suitable encoder was found for '%s'", caps_str);
+    }
 
-    } else {
-        gst_syslog(LOG_ERR, "No suitable encoder was found for '%s'", caps_ss.str().c_str());
+    gst_plugin_feature_list_free(filtered);
+    gst_plugin_feature_list_free(encoders);
+    g_free(caps_str);
+    return factory;
+}
+
+GstElement *GstreamerFrameCapture::get_encoder_plugin(const GstreamerEncoderSettings &settings,
+                                                      GstCapsUPtr &sink_caps)
+{
+    sink_caps = stream_caps(settings);
+    // the plugin already chose the encoder, only scan the registry if it
+    // cannot be used
+    GstObjectUPtr<GstElementFactory> factory;
+    if (!settings.encoder.empty()) {
+        factory.reset(gst_element_factory_find(settings.encoder.c_str()));
+        if (factory && !gst_element_factory_can_src_any_caps(factory.get(), sink_caps.get())) {
+            factory.reset();
+        }
+    }
+    if (!factory) {
+        factory.reset(find_encoder(settings, sink_caps.get()));
+    }
+    if (!factory) {
+        return nullptr;
     }
+    gst_syslog(LOG_NOTICE, "'%s' encoder plugin is used", GST_OBJECT_NAME(factory.get()));
+    family = encoder_family(GST_OBJECT_NAME(factory.get()));
 
-    encoder = factory ? gst_element_factory_create(factory, "encoder") : nullptr;
+    GstElement *encoder = gst_element_factory_create(factory.get(), "encoder");
     if (encoder) { // Invalid properties will be ignored silently
-        /* x264enc properties */
-        gst_util_set_object_arg(G_OBJECT(encoder), "tune", "zerolatency");// stillimage, fastdecode, zerolatency
-        gst_util_set_object_arg(G_OBJECT(encoder), "bframes", "0");
-        gst_util_set_object_arg(G_OBJECT(encoder), "speed-preset", "1");// 1-ultrafast, 6-med, 9-veryslow
+        for (const EncoderProperty *prop = family->properties; prop->name; ++prop) {
+            gst_util_set_object_arg(G_OBJECT(encoder), prop->name, prop->value);
+        }
+        if (settings.keyframe_interval > 0 &&
+            !gst_set_keyframe_interval(encoder, settings.keyframe_interval)) {
+            gst_syslog(LOG_NOTICE, "Forcing a keyframe every %d frames", settings.keyframe_interval);
+            forced_keyframe_interval = settings.keyframe_interval;
+        }
     }
-    gst_plugin_feature_list_free(filtered);
-    gst_plugin_feature_list_free(encoders);
     return encoder;
 }
 
-// Utility to add an element to a GstBin
-// This checks return value and update reference correctly
-void gst_bin_add(GstBin *bin, const GstObjectUPtr<GstElement> &elem)
+#if XLIB_CAPTURE
+/* Elements scaling the frames to the caps of scale_filter, in the GPU
+ * memory if the upload elements can, with videoscale otherwise */
+void GstreamerFrameCapture::add_scale_plugins(std::vector<GstObjectUPtr<GstElement>> &elements)
 {
-    if (::gst_bin_add(bin, elem.get())) {
-        // ::gst_bin_add take ownership using floating references but
-        // we still hold a reference in elem so update the reference
-        // accordingly
-        g_object_ref(elem.get());
-    } else {
-        throw std::runtime_error("Gstreamer's element cannot be added to pipeline");
+    GstObjectUPtr<GstElement> filter(gst_element_factory_make("capsfilter", "scale"));
+    if (!filter) {
+        throw std::runtime_error("Gstreamer's 'capsfilter' element cannot be created");
+    }
+    scale_filter = filter.get();
+    if (gpu_upload && family->upload_scales) {
+        elements.push_back(std::move(filter));
+        return;
+    }
+
+    GstObjectUPtr<GstElement> scale(gst_element_factory_make("videoscale", nullptr));
+    if (!scale) {
+        throw std::runtime_error("Gstreamer's 'videoscale' element cannot be created");
+    }
+    // ScaleSelector keeps the aspect ratio, up to the rounding
+    g_object_set(scale.get(), "add-borders", FALSE, nullptr);
+    elements.insert(elements.begin(), std::move(filter));
+    elements.insert(elements.begin(), std::move(scale));
+}
+#endif
+
+/* Elements converting the frames for the encoder, uploading them to the
+ * GPU for hardware encoders. Falls back to videoconvert if they are not
+ * all available. */
+std::vector<GstObjectUPtr<GstElement>> GstreamerFrameCapture::get_convert_plugins()
+{
+    std::vector<GstObjectUPtr<GstElement>> elements;
+    for (const char *const *name = family->upload; *name; ++name) {
+        GstObjectUPtr<GstElement> element(gst_element_factory_make(*name, nullptr));
+        if (!element) {
+            gst_syslog(LOG_NOTICE, "'%s' is not available, converting frames with 'videoconvert'",
+                       *name);
+            elements.clear();
+            break;
+        }
+        elements.push_back(std::move(element));
+    }
+
+    gpu_upload = !elements.empty();
+    if (elements.empty()) {
+        GstObjectUPtr<GstElement> convert(gst_element_factory_make("videoconvert", "convert"));
+        if (!convert) {
+            throw std::runtime_error("Gstreamer's 'videoconvert' element cannot be created");
+        }
+        elements.push_back(std::move(convert));
+    }
+    return elements;
+}
+
+#if XLIB_CAPTURE
+/* YUV format taken by the encoder which the agent can convert the frames
+ * to, GST_VIDEO_FORMAT_UNKNOWN if none */
+GstVideoFormat encoder_input_format(GstElement *encoder)
+{
+    GstObjectUPtr<GstPad> pad(gst_element_get_static_pad(encoder, "sink"));
+    if (!pad) {
+        return GST_VIDEO_FORMAT_UNKNOWN;
     }
+    GstCapsUPtr caps(gst_pad_query_caps(pad.get(), nullptr));
+
+    for (GstVideoFormat format: {GST_VIDEO_FORMAT_I420, GST_VIDEO_FORMAT_NV12}) {
+        GstCapsUPtr format_caps(gst_caps_new_simple("video/x-raw",
+                                                    "format", G_TYPE_STRING,
+                                                    gst_video_format_to_string(format),
+                                                    nullptr));
+        if (gst_caps_can_intersect(caps.get(), format_caps.get())) {
+            return format;
+        }
+    }
+    return GST_VIDEO_FORMAT_UNKNOWN;
 }
+#endif
 
 void GstreamerFrameCapture::pipeline_init(const GstreamerEncoderSettings &settings)
 {
@@ -214,15 +545,27 @@ void GstreamerFrameCapture::pipeline_init(const GstreamerEncoderSettings &settin
     if (!capture) {
         throw std::runtime_error("Gstreamer's capture element cannot be created");
     }
-    GstObjectUPtr<GstElement> convert(gst_element_factory_make("videoconvert", "convert"));
-    if (!convert) {
-        throw std::runtime_error("Gstreamer's 'videoconvert' element cannot be created");
-    }
     GstCapsUPtr sink_caps;
     GstObjectUPtr<GstElement> encoder(get_encoder_plugin(settings, sink_caps));
     if (!encoder) {
         throw std::runtime_error("Gstreamer's encoder element cannot be created");
     }
+    std::vector<GstObjectUPtr<GstElement>> convert(get_convert_plugins());
+#if XLIB_CAPTURE
+    // frames uploaded to the GPU are converted there
+    if (settings.convert && !gpu_upload) {
+        convert_format = encoder_input_format(encoder.get());
+    }
+    if (convert_format != GST_VIDEO_FORMAT_UNKNOWN) {
+        converter.reset(new ColorConverter(settings.convert_threads));
+        gst_syslog(LOG_NOTICE, "Converting frames to %s with the %s code",
+                   gst_video_format_to_string(convert_format), converter->kernel_name());
+        convert.clear();
+    }
+    if (settings.capture.scale.enabled() && !converter) {
+        add_scale_plugins(convert);
+    }
+#endif
     GstObjectUPtr<GstElement> sink(gst_element_factory_make("appsink", "sink"));
     if (!sink) {
         throw std::runtime_error("Gstreamer's appsink element cannot be created");
@@ -236,14 +579,24 @@ void GstreamerFrameCapture::pipeline_init(const GstreamerEncoderSettings &settin
 
     GstBin *bin = GST_BIN(pipeline.get());
     gst_bin_add(bin, capture);
-    gst_bin_add(bin, convert);
+    for (const auto &element: convert) {
+        gst_bin_add(bin, element);
+    }
     gst_bin_add(bin, encoder);
     gst_bin_add(bin, sink);
 
+    // frames uploaded to the GPU are not in system memory anymore
     GstCapsUPtr caps(gst_caps_from_string("video/x-raw"));
-    link = gst_element_link(capture.get(), convert.get()) &&
-           gst_element_link_filtered(convert.get(), encoder.get(), caps.get()) &&
-           gst_element_link_filtered(encoder.get(), sink.get(), sink_caps.get());
+    GstElement *upstream = capture.get();
+    link = true;
+    for (const auto &element: convert) {
+        link = link && gst_element_link(upstream, element.get());
+        upstream = element.get();
+    }
+    link = link && (gpu_upload ?
+                    gst_element_link(upstream, encoder.get()) :
+                    gst_element_link_filtered(upstream, encoder.get(), caps.get()));
+    link = link && gst_element_link_filtered(encoder.get(), sink.get(), sink_caps.get());
     if (!link) {
         throw std::runtime_error("Linking gstreamer's elements failed");
     }
@@ -253,6 +606,15 @@ void GstreamerFrameCapture::pipeline_init(const GstreamerEncoderSettings &settin
     if (!dpy) {
         throw std::runtime_error("Unable to initialize X11");
     }
+    x11_capture.reset(new X11Capture(dpy));
+    output_selector.reset(new OutputSelector(dpy, settings.capture.output));
+    if (settings.capture.use_damage) {
+        try {
+            damage_tracker.reset(new DamageTracker(dpy, RootWindow(dpy, XDefaultScreen(dpy))));
+        } catch (const std::exception &e) {
+            gst_syslog(LOG_WARNING, "Cannot track screen changes, capturing every frame: %s", e.what());
+        }
+    }
 #endif
 
     gst_element_set_state(pipeline.get(), GST_STATE_PLAYING);
@@ -267,6 +629,8 @@ void GstreamerFrameCapture::pipeline_init(const GstreamerEncoderSettings &settin
                  nullptr);
     cur_width = ex - sx;
     cur_height = ey - sy;
+    out_width = cur_width;
+    out_height = cur_height;
     if (cur_width < 16 || cur_height < 16) {
          throw std::runtime_error("Invalid screen size");
     }
@@ -282,14 +646,73 @@ void GstreamerFrameCapture::pipeline_init(const GstreamerEncoderSettings &settin
 #endif
 
     this->sink.swap(sink);
+    this->encoder.swap(encoder);
     this->capture.swap(capture);
     this->pipeline.swap(pipeline);
 }
 
-GstreamerFrameCapture::GstreamerFrameCapture(const GstreamerEncoderSettings &settings):
-    settings(settings)
+GstreamerFrameCapture::GstreamerFrameCapture(const GstreamerEncoderSettings &settings,
+                                             Agent *agent):
+#if XLIB_CAPTURE
+    scale_selector(settings.capture.scale),
+#endif
+    settings(settings),
+    agent(agent)
 {
+    keyframe_requests = agent->KeyframeRequests();
     pipeline_init(settings);
+    find_rate_property();
+}
+
+void GstreamerFrameCapture::find_rate_property()
+{
+    // in order of preference, the current value is used as the full rate
+    static const char *const names[] = { "bitrate", "target-bitrate", "quality" };
+
+    GObjectClass *klass = G_OBJECT_GET_CLASS(encoder.get());
+    for (const char *name: names) {
+        GParamSpec *spec = g_object_class_find_property(klass, name);
+        if (!spec || !(spec->flags & G_PARAM_WRITABLE) ||
+            !(spec->flags & GST_PARAM_MUTABLE_PLAYING)) {
+            continue;
+        }
+
+        GValue value = G_VALUE_INIT, base = G_VALUE_INIT;
+        g_value_init(&value, spec->value_type);
+        g_value_init(&base, G_TYPE_DOUBLE);
+        g_object_get_property(G_OBJECT(encoder.get()), name, &value);
+        if (g_value_transform(&value, &base)) {
+            rate_property = spec;
+            rate_base = g_value_get_double(&base);
+        }
+        g_value_unset(&value);
+        g_value_unset(&base);
+        if (rate_property) {
+            return;
+        }
+    }
+    gst_syslog(LOG_NOTICE, "The encoder rate cannot be adapted to the client");
+}
+
+void GstreamerFrameCapture::apply_rate()
+{
+    const double rate = agent->RateFactor();
+    if (!rate_property || rate == rate_applied) {
+        return;
+    }
+
+    GValue value = G_VALUE_INIT, scaled = G_VALUE_INIT;
+    g_value_init(&value, rate_property->value_type);
+    g_value_init(&scaled, G_TYPE_DOUBLE);
+    g_value_set_double(&scaled, std::max(1.0, rate_base * rate));
+    if (g_value_transform(&scaled, &value)) {
+        g_object_set_property(G_OBJECT(encoder.get()), rate_property->name, &value);
+        gst_syslog(LOG_DEBUG, "encoder '%s' set to %.0f", rate_property->name,
+                   g_value_get_double(&scaled));
+    }
+    g_value_unset(&value);
+    g_value_unset(&scaled);
+    rate_applied = rate;
 }
 
 void GstreamerFrameCapture::free_sample()
@@ -298,12 +721,6 @@ void GstreamerFrameCapture::free_sample()
         gst_buffer_unmap(gst_sample_get_buffer(sample.get()), &map);
         sample.reset();
     }
-#if XLIB_CAPTURE
-    if(image) {
-        image->f.destroy_image(image);
-        image = nullptr;
-    }
-#endif
 }
 
 GstreamerFrameCapture::~GstreamerFrameCapture()
@@ -311,60 +728,284 @@ GstreamerFrameCapture::~GstreamerFrameCapture()
     free_sample();
     gst_element_set_state(pipeline.get(), GST_STATE_NULL);
 #if XLIB_CAPTURE
+    // the images must be released before closing the display
+    if (shm_pool) {
+        gst_buffer_pool_set_active(shm_pool.get(), FALSE);
+        shm_pool.reset();
+    }
+    if (convert_pool) {
+        gst_buffer_pool_set_active(convert_pool.get(), FALSE);
+        convert_pool.reset();
+    }
+    destroy_released_images();
+    damage_tracker.reset();
+    output_selector.reset();
+    x11_capture.reset();
     XCloseDisplay(dpy);
 #endif
 }
 
 void GstreamerFrameCapture::Reset()
 {
-    //TODO
+    // the pipeline is kept, a new stream only needs to start with a keyframe
+    free_sample();
+    is_first = true;
+    force_keyframe();
+#if XLIB_CAPTURE
+    if (damage_tracker) {
+        damage_tracker->force_damage();
+    }
+#endif
+}
+
+void GstreamerFrameCapture::force_keyframe()
+{
+    // travels upstream from the sink to the encoder
+    gst_element_send_event(sink.get(),
+                           gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE,
+                                                                       TRUE, 0));
+    frames_since_keyframe = 0;
+}
+
+bool GstreamerFrameCapture::keyframe_requested() const
+{
+    return agent->KeyframeRequests() != keyframe_requests;
+}
+
+// called before each frame is pushed
+void GstreamerFrameCapture::check_keyframe()
+{
+    if (keyframe_requested() ||
+        (forced_keyframe_interval && frames_since_keyframe >= forced_keyframe_interval)) {
+        keyframe_requests = agent->KeyframeRequests();
+        force_keyframe();
+    }
+    ++frames_since_keyframe;
 }
 
 #if XLIB_CAPTURE
 void GstreamerFrameCapture::xlib_capture()
 {
+    agent->WaitNextFrame(settings.fps);
+
+    // while the screen does not change only capture at the minimum rate
+    // to keep the stream alive
+    if (damage_tracker && !is_first) {
+        using namespace std::chrono;
+        auto keepalive = last_grab_time + milliseconds(1000 / settings.capture.min_fps);
+        auto timeout = duration_cast<milliseconds>(keepalive - steady_clock::now()).count();
+        // a requested keyframe is sent right away
+        const bool damaged =
+            damage_tracker->wait_for_damage(std::max<decltype(timeout)>(timeout, 0),
+                                            [this] { return keyframe_requested(); });
+        // the next frame is not due right away after a long wait
+        agent->RestartSchedule();
+        // the rate still caps the frames, at most half a period is waited
+        if (damaged && settings.capture.sync) {
+            damage_tracker->wait_for_settle(500 / std::max(settings.fps, 1));
+        }
+    }
+    last_grab_time = std::chrono::steady_clock::now();
+    destroy_released_images();
+
     int screen = XDefaultScreen(dpy);
 
     Window win = RootWindow(dpy, screen);
-    XWindowAttributes win_info;
-    XGetWindowAttributes(dpy, win, &win_info);
+    const ScreenArea area = output_selector->area();
 
     /* Some encoders cannot handle odd resolution make sure it's even number of pixels */
-    cur_width = win_info.width - win_info.width % 2;
-    cur_height =  win_info.height - win_info.height % 2;
+    cur_x = area.x;
+    cur_y = area.y;
+    cur_width = area.width - area.width % 2;
+    cur_height =  area.height - area.height % 2;
+    const FrameSize size =
+        scale_selector.size(cur_width, cur_height, agent->RateFactor(),
+                            std::chrono::duration_cast<std::chrono::microseconds>(
+                                last_grab_time.time_since_epoch()).count());
 
-    if (cur_width != last_width || cur_height != last_height) {
+    if (cur_width != last_width || cur_height != last_height ||
+        size.width != out_width || size.height != out_height) {
         last_width = cur_width;
         last_height = cur_height;
+        out_width = size.width;
+        out_height = size.height;
         is_first = true;
+        if (out_width != cur_width || out_height != cur_height) {
+            gst_syslog(LOG_NOTICE, "Scaling the frames from %ux%u down to %ux%u",
+                       cur_width, cur_height, out_width, out_height);
+        }
+
+        // the new caps reach the converter and the encoder with the next
+        // buffer, they reconfigure themselves without restarting the pipeline
+        renegotiating = capture_caps != nullptr;
+        resize_capture();
+        if (renegotiating) {
+            force_keyframe();
+        }
+    }
 
-        gst_app_src_end_of_stream(GST_APP_SRC(capture.get()));
-        gst_element_set_state(pipeline.get(), GST_STATE_NULL);//maybe ximagesrc needs eos as well
-        gst_element_set_state(pipeline.get(), GST_STATE_PLAYING);
+    check_keyframe();
+    // appsrc takes ownership of the buffer
+    if (gst_app_src_push_buffer(GST_APP_SRC(capture.get()), grab_frame(win)) != GST_FLOW_OK) {
+        throw std::runtime_error("gstramer appsrc element cannot push buffer");
     }
+}
+
+// slow path, if the encoder cannot change its size while playing
+void GstreamerFrameCapture::restart_pipeline()
+{
+    gst_app_src_end_of_stream(GST_APP_SRC(capture.get()));
+    gst_element_set_state(pipeline.get(), GST_STATE_NULL);
+    gst_element_set_state(pipeline.get(), GST_STATE_PLAYING);
+}
+
+// only done when the size changes, frames are then pushed without caps
+void GstreamerFrameCapture::resize_capture()
+{
+    // the frames converted by the agent are pushed scaled
+    const bool agent_scales = convert_format != GST_VIDEO_FORMAT_UNKNOWN;
+    const uint32_t width = agent_scales ? out_width : cur_width;
+    const uint32_t height = agent_scales ? out_height : cur_height;
+    capture_caps.reset(gst_caps_new_simple("video/x-raw",
+                                           "format", G_TYPE_STRING, "BGRx",
+                                           "width", G_TYPE_INT, width,
+                                           "height", G_TYPE_INT, height,
+                                           "framerate", GST_TYPE_FRACTION, settings.fps, 1,
+                                           nullptr));
+    if (convert_format != GST_VIDEO_FORMAT_UNKNOWN) {
+        // the matrix used by ColorConverter
+        gst_caps_set_simple(capture_caps.get(),
+                            "format", G_TYPE_STRING, gst_video_format_to_string(convert_format),
+                            "colorimetry", G_TYPE_STRING, "bt709",
+                            nullptr);
+    }
+    gst_app_src_set_caps(GST_APP_SRC(capture.get()), capture_caps.get());
+    if (scale_filter) {
+        // any memory, the frames may be scaled after the upload
+        GstCapsUPtr scale_caps(gst_caps_from_string("video/x-raw(ANY)"));
+        gst_caps_set_simple(scale_caps.get(),
+                            "width", G_TYPE_INT, out_width,
+                            "height", G_TYPE_INT, out_height,
+                            "pixel-aspect-ratio", GST_TYPE_FRACTION, 1, 1,
+                            nullptr);
+        g_object_set(scale_filter, "caps", scale_caps.get(), nullptr);
+    }
+
+    if (shm_pool) {
+        gst_buffer_pool_set_active(shm_pool.get(), FALSE);
+        shm_pool.reset();
+    }
+    if (convert_pool) {
+        gst_buffer_pool_set_active(convert_pool.get(), FALSE);
+        convert_pool.reset();
+    }
+    if (convert_format != GST_VIDEO_FORMAT_UNKNOWN) {
+        resize_convert_pool();
+        return;
+    }
+    if (!x11_capture->using_shm()) {
+        return;
+    }
+
+    GstObjectUPtr<GstBufferPool> pool(shm_buffer_pool_new(dpy, cur_width, cur_height));
+    GstStructure *config = gst_buffer_pool_get_config(pool.get());
+    // the size is only used for the statistics, buffers are allocated by the pool
+    gst_buffer_pool_config_set_params(config, capture_caps.get(), cur_width * cur_height * 4, 2, 4);
+    if (!gst_buffer_pool_set_config(pool.get(), config) ||
+        !gst_buffer_pool_set_active(pool.get(), TRUE)) {
+        gst_syslog(LOG_WARNING, "Cannot use a pool of shared memory buffers");
+        return;
+    }
+    shm_pool.swap(pool);
+}
+
+// the encoder may hold on to several frames, the pool is not bounded
+void GstreamerFrameCapture::resize_convert_pool()
+{
+    if (!gst_video_info_from_caps(&convert_info, capture_caps.get())) {
+        throw std::runtime_error("Invalid caps for the converted frames");
+    }
+    GstObjectUPtr<GstBufferPool> pool(gst_video_buffer_pool_new());
+    GstStructure *config = gst_buffer_pool_get_config(pool.get());
+    gst_buffer_pool_config_set_params(config, capture_caps.get(), convert_info.size, 2, 0);
+    if (!gst_buffer_pool_set_config(pool.get(), config) ||
+        !gst_buffer_pool_set_active(pool.get(), TRUE)) {
+        throw std::runtime_error("Cannot allocate the buffers of the converted frames");
+    }
+    convert_pool.swap(pool);
+}
 
-    image = XGetImage(dpy, win, 0, 0,
-                      cur_width, cur_height, AllPlanes, ZPixmap);
+GstBuffer *GstreamerFrameCapture::convert_frame(const XImage *image)
+{
+    GstBuffer *buf = nullptr;
+    if (gst_buffer_pool_acquire_buffer(convert_pool.get(), &buf, nullptr) != GST_FLOW_OK) {
+        throw std::runtime_error("Failed to get a buffer from the pool");
+    }
+
+    GstVideoFrame frame;
+    if (!gst_video_frame_map(&frame, &convert_info, buf, GST_MAP_WRITE)) {
+        gst_buffer_unref(buf);
+        throw std::runtime_error("Buffer mapping failed");
+    }
+    YuvPlanes planes = {};
+    for (unsigned n = 0; n < GST_VIDEO_FRAME_N_PLANES(&frame); ++n) {
+        planes.data[n] = static_cast<uint8_t *>(GST_VIDEO_FRAME_PLANE_DATA(&frame, n));
+        planes.stride[n] = GST_VIDEO_FRAME_PLANE_STRIDE(&frame, n);
+    }
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(image->data);
+    size_t stride = image->bytes_per_line;
+    if (out_width != cur_width || out_height != cur_height) {
+        if (!scaler) {
+            scaler.reset(new FrameScaler(settings.convert_threads));
+        }
+        scaled_frame.resize((size_t) out_width * out_height * 4);
+        scaler->scale(data, stride, cur_width, cur_height,
+                      scaled_frame.data(), out_width * 4, out_width, out_height);
+        data = scaled_frame.data();
+        stride = out_width * 4;
+    }
+    converter->convert(data, stride, out_width, out_height,
+                       convert_format == GST_VIDEO_FORMAT_NV12 ? YuvFormat::NV12 : YuvFormat::I420,
+                       planes);
+    gst_video_frame_unmap(&frame);
+    return buf;
+}
+
+GstBuffer *GstreamerFrameCapture::grab_frame(Window win)
+{
+    if (shm_pool) {
+        GstBuffer *buf = nullptr;
+        if (gst_buffer_pool_acquire_buffer(shm_pool.get(), &buf, nullptr) != GST_FLOW_OK) {
+            throw std::runtime_error("Failed to get a buffer from the pool");
+        }
+        auto image = static_cast<ShmImage *>(gst_mini_object_get_qdata(GST_MINI_OBJECT(buf),
+                                                                       shm_image_quark()));
+        if (!image->grab(win, cur_x, cur_y)) {
+            gst_buffer_unref(buf);
+            throw std::runtime_error("Cannot capture from X");
+        }
+        return buf;
+    }
+
+    XImage *image = x11_capture->grab(win, cur_x, cur_y, cur_width, cur_height);
     if (!image) {
         throw std::runtime_error("Cannot capture from X");
     }
+    if (convert_pool) {
+        return convert_frame(image);
+    }
 
+    // The image is owned by x11_capture and is only overwritten by the next
+    // grab, which happens after the encoded sample for this one was pulled
     GstBuffer *buf;
-    buf = gst_buffer_new_wrapped(image->data, image->height * image->bytes_per_line);
+    buf = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, image->data,
+                                      image->height * image->bytes_per_line, 0,
+                                      image->height * image->bytes_per_line,
+                                      nullptr, nullptr);
     if (!buf) {
         throw std::runtime_error("Failed to wrap image in gstreamer buffer");
     }
-
-    std::stringstream ss;
-
-    ss << "video/x-raw,format=BGRx,width=" << image->width << ",height=" << image->height << ",framerate=" << settings.fps << "/1";
-    GstCapsUPtr caps(gst_caps_from_string(ss.str().c_str()));
-
-    // Push sample
-    GstSampleUPtr appsrc_sample(gst_sample_new(buf, caps.get(), nullptr, nullptr));
-    if (gst_app_src_push_sample(GST_APP_SRC(capture.get()), appsrc_sample.get()) != GST_FLOW_OK) {
-        throw std::runtime_error("gstramer appsrc element cannot push sample");
-    }
+    return buf;
 }
 #endif
 
@@ -373,20 +1014,35 @@ FrameInfo GstreamerFrameCapture::CaptureFrame()
     FrameInfo info;
 
     free_sample(); // free prev if exist
+    apply_rate();
 
 #if XLIB_CAPTURE
     xlib_capture();
+    if (renegotiating) {
+        renegotiating = false;
+        sample.reset(gst_app_sink_try_pull_sample(GST_APP_SINK(sink.get()), GST_SECOND));
+        if (!sample) {
+            gst_syslog(LOG_WARNING, "Encoder did not handle the new frame size, restarting the pipeline");
+            restart_pipeline();
+            xlib_capture();
+        }
+    }
+#else
+    check_keyframe();
 #endif
-    info.size.width = cur_width;
-    info.size.height = cur_height;
+
+    // Pull sample
+    if (!sample) {
+        sample.reset(gst_app_sink_pull_sample(GST_APP_SINK(sink.get()))); // blocking
+    }
+
+    info.size.width = out_width;
+    info.size.height = out_height;
     info.stream_start = is_first;
     if (is_first) {
         is_first = false;
     }
 
-    // Pull sample
-    sample.reset(gst_app_sink_pull_sample(GST_APP_SINK(sink.get()))); // blocking
-
     if (sample) { // map after pipeline
         if (!gst_buffer_map(gst_sample_get_buffer(sample.get()), &map, GST_MAP_READ)) {
             free_sample();
@@ -404,12 +1060,63 @@ FrameInfo GstreamerFrameCapture::CaptureFrame()
 
 FrameCapture *GstreamerPlugin::CreateCapture()
 {
-    return new GstreamerFrameCapture(settings);
+    // GStreamer is only initialised once the plugin is used
+    gst_init(nullptr, nullptr);
+    try {
+        return new GstreamerFrameCapture(settings, agent);
+    } catch (const std::exception &e) {
+        if (encoder_cached) {
+            // the encoder may not work anymore, probe them again for the
+            // next stream
+            gst_syslog(LOG_NOTICE, "The '%s' encoder found previously failed, forgetting it",
+                       settings.encoder.c_str());
+            cache->remove(encoder_cache_key());
+            encoder_selected = false;
+        }
+        throw;
+    }
+}
+
+std::string GstreamerPlugin::encoder_cache_key() const
+{
+    return "encoder:" + std::to_string(settings.codec) + ":" +
+        (settings.use_hardware ? "hardware" : "software") + ":" + requested_encoder;
+}
+
+void GstreamerPlugin::select_encoder()
+{
+    const std::string key = encoder_cache_key();
+    std::string encoder;
+    encoder_cached = cache->lookup(key, encoder);
+    if (!encoder_cached) {
+        gst_init(nullptr, nullptr);
+        GstreamerEncoderSettings requested = settings;
+        requested.encoder = requested_encoder;
+        GstCapsUPtr caps(stream_caps(requested));
+        GstObjectUPtr<GstElementFactory> factory(find_encoder(requested, caps.get()));
+        if (factory) {
+            encoder = GST_OBJECT_NAME(factory.get());
+        }
+        // no encoder is remembered too, until GStreamer is updated
+        cache->store(key, encoder);
+    } else if (!encoder.empty()) {
+        gst_syslog(LOG_NOTICE, "Using the '%s' encoder found previously", encoder.c_str());
+    }
+
+    rank = DontUse;
+    if (!encoder.empty()) {
+        settings.encoder = encoder;
+        rank = encoder_family(encoder.c_str())->hardware ? HardwareMin : SoftwareMin;
+    }
 }
 
 unsigned GstreamerPlugin::Rank()
 {
-    return SoftwareMin;
+    if (!encoder_selected) {
+        encoder_selected = true;
+        select_encoder();
+    }
+    return rank;
 }
 
 void GstreamerPlugin::ParseOptions(const ConfigureOption *options)
@@ -438,8 +1145,55 @@ void GstreamerPlugin::ParseOptions(const ConfigureOption *options)
             } else {
                 throw std::runtime_error("Invalid value '" + value + "' for option 'gst.codec'.");
             }
+        } else if (name == "keyframe.max-interval") {
+            try {
+                settings.keyframe_interval = std::stoi(value);
+            } catch (const std::exception &e) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'keyframe.max-interval'.");
+            }
+            if (settings.keyframe_interval < 0) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'keyframe.max-interval'.");
+            }
         } else if (name == "gst.encoder") {
             settings.encoder = value;
+            requested_encoder = value;
+        } else if (name == "gst.hardware") {
+            if (value == "on") {
+                settings.use_hardware = true;
+            } else if (value == "off") {
+                settings.use_hardware = false;
+            } else {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'gst.hardware'.");
+            }
+        } else if (name == "cursor.position") {
+            if (value == "on") {
+                settings.show_pointer = false;
+            } else if (value == "off") {
+                settings.show_pointer = true;
+            } else {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'cursor.position'.");
+            }
+#if XLIB_CAPTURE
+        } else if (name == "gst.convert") {
+            if (value == "on") {
+                settings.convert = true;
+            } else if (value == "off") {
+                settings.convert = false;
+            } else {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'gst.convert'.");
+            }
+        } else if (name == "gst.convert-threads") {
+            try {
+                settings.convert_threads = std::stoi(value);
+            } catch (const std::exception &e) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'gst.convert-threads'.");
+            }
+            if (settings.convert_threads < 1) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'gst.convert-threads'.");
+            }
+        } else {
+            parse_capture_option(settings.capture, name, value);
+#endif
         }
     }
 }
@@ -450,11 +1204,10 @@ using namespace spice::streaming_agent::gstreamer_plugin;
 
 SPICE_STREAMING_AGENT_PLUGIN(agent)
 {
-    gst_init(nullptr, nullptr);
-
     std::unique_ptr<GstreamerPlugin> plugin(new GstreamerPlugin());
 
     plugin->ParseOptions(agent->Options());
+    plugin->SetAgent(agent);
 
     agent->Register(*plugin.release());
 
@@ -0,0 +1,156 @@
+/* Helpers shared by the GStreamer based plugins.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_GST_UTILS_HPP
+#define SPICE_STREAMING_AGENT_GST_UTILS_HPP
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <glob.h>
+#include <stdlib.h>
+#include <gst/gst.h>
+
+#include "capability-cache.hpp"
+
+
+namespace spice {
+namespace streaming_agent {
+
+template <typename T>
+struct GstObjectDeleter {
+    void operator()(T* p)
+    {
+        gst_object_unref(p);
+    }
+};
+
+template <typename T>
+using GstObjectUPtr = std::unique_ptr<T, GstObjectDeleter<T>>;
+
+struct GstCapsDeleter {
+    void operator()(GstCaps* p)
+    {
+        gst_caps_unref(p);
+    }
+};
+
+using GstCapsUPtr = std::unique_ptr<GstCaps, GstCapsDeleter>;
+
+struct GstSampleDeleter {
+    void operator()(GstSample* p)
+    {
+        gst_sample_unref(p);
+    }
+};
+
+using GstSampleUPtr = std::unique_ptr<GstSample, GstSampleDeleter>;
+
+// Utility to add an element to a GstBin
+// This checks return value and update reference correctly
+inline void gst_bin_add(GstBin *bin, const GstObjectUPtr<GstElement> &elem)
+{
+    if (::gst_bin_add(bin, elem.get())) {
+        // ::gst_bin_add take ownership using floating references but
+        // we still hold a reference in elem so update the reference
+        // accordingly
+        g_object_ref(elem.get());
+    } else {
+        throw std::runtime_error("Gstreamer's element cannot be added to pipeline");
+    }
+}
+
+/* Limit the number of frames between two keyframes with the encoder's
+ * property, return false if it has none */
+inline bool gst_set_keyframe_interval(GstElement *encoder, unsigned frames)
+{
+    static const char *const names[] = {
+        "key-int-max", "gop-size", "keyframe-period", "keyframe-max-dist"
+    };
+
+    GObjectClass *klass = G_OBJECT_GET_CLASS(encoder);
+    for (const char *name: names) {
+        GParamSpec *spec = g_object_class_find_property(klass, name);
+        if (spec && (spec->flags & G_PARAM_WRITABLE)) {
+            gst_util_set_object_arg(G_OBJECT(encoder), name, std::to_string(frames).c_str());
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void add_search_path(std::vector<std::string> &paths, const char *path)
+{
+    std::string list(path);
+    for (size_t start = 0; start <= list.size();) {
+        size_t end = list.find(':', start);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        if (end > start) {
+            paths.push_back(list.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+}
+
+/* Cache of what the plugin defining symbol found in the GStreamer
+ * registry, the entries are dropped when the plugin, the GStreamer
+ * plugins or the VA drivers are updated, and when the GPU devices change,
+ * e.g. when they were not ready yet for a previous run */
+inline std::unique_ptr<CapabilityCache> gst_capability_cache(const char *name, const void *symbol)
+{
+    std::vector<std::string> dependencies;
+    dependencies.push_back(CapabilityCache::module_path(symbol));
+
+    // the directories GStreamer loads its plugins from
+    const char *path = getenv("GST_PLUGIN_SYSTEM_PATH_1_0");
+    if (!path) {
+        path = getenv("GST_PLUGIN_SYSTEM_PATH");
+    }
+    if (path) {
+        add_search_path(dependencies, path);
+    } else {
+        dependencies.push_back(GST_PLUGINS_DIR);
+        const char *home = getenv("HOME");
+        if (home) {
+            dependencies.push_back(std::string(home) + "/.local/share/gstreamer-1.0/plugins");
+        }
+    }
+    path = getenv("GST_PLUGIN_PATH_1_0");
+    if (!path) {
+        path = getenv("GST_PLUGIN_PATH");
+    }
+    if (path) {
+        add_search_path(dependencies, path);
+    }
+
+    // the hardware encoders depend on the devices and their drivers, the
+    // nodes are created again on each boot
+    dependencies.push_back("/dev/dri");
+    glob_t nodes;
+    if (glob("/dev/dri/renderD*", 0, nullptr, &nodes) == 0) {
+        for (size_t n = 0; n < nodes.gl_pathc; ++n) {
+            dependencies.push_back(nodes.gl_pathv[n]);
+        }
+    }
+    globfree(&nodes);
+    path = getenv("LIBVA_DRIVERS_PATH");
+    if (path) {
+        add_search_path(dependencies, path);
+    } else if (*LIBVA_DRIVERS_DIR) {
+        dependencies.push_back(LIBVA_DRIVERS_DIR);
+    }
+
+    std::string directory = CapabilityCache::default_directory();
+    std::string filename = directory.empty() ? directory : directory + "/" + name + ".cache";
+    return std::unique_ptr<CapabilityCache>(new CapabilityCache(filename, dependencies));
+}
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_GST_UTILS_HPP
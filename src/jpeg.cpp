@@ -7,85 +7,310 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <ctype.h>
+#include <algorithm>
+#include <string.h>
 #include <jpeglib.h>
 #include <setjmp.h>
+#include <stdexcept>
 
 #include "jpeg.hpp"
 
-struct JpegBuffer: public jpeg_destination_mgr
+static unsigned pad(unsigned value, unsigned alignment)
 {
-    JpegBuffer(std::vector<uint8_t>& buffer);
-    ~JpegBuffer();
-
-    std::vector<uint8_t>& buffer;
-};
-
-static boolean buf_empty_output_buffer(j_compress_ptr cinfo)
-{
-    JpegBuffer *buf = (JpegBuffer *) cinfo->dest;
-    size_t size = buf->buffer.size();
-    buf->buffer.resize(buf->buffer.capacity() * 2);
-    buf->next_output_byte = &buf->buffer[0] + size;
-    buf->free_in_buffer = buf->buffer.size() - size;
-    return TRUE;
+    return (value + alignment - 1) / alignment * alignment;
 }
 
-static void dummy_destination(j_compress_ptr cinfo)
+unsigned jpeg_mcu_height(JpegSubsampling subsampling)
 {
+    return subsampling == JpegSubsampling::Yuv420 ? 16 : 8;
 }
 
-JpegBuffer::JpegBuffer(std::vector<uint8_t>& buffer):
-    buffer(buffer)
+size_t jpeg_max_size(unsigned width, unsigned height, JpegSubsampling subsampling)
 {
-    if (buffer.capacity() < 32 * 1024) {
-        buffer.resize(32 * 1024);
-    } else {
-        buffer.resize(buffer.capacity());
-    }
-    next_output_byte = &buffer[0];
-    free_in_buffer = buffer.size();
-    init_destination = dummy_destination;
-    empty_output_buffer = buf_empty_output_buffer;
-    term_destination = dummy_destination;
+    const unsigned mcu_width = subsampling == JpegSubsampling::Yuv444 ? 8 : 16;
+    const unsigned mcu_height = jpeg_mcu_height(subsampling);
+    // 2 bytes for each luma sample and the two chroma planes at their
+    // resolution, with room for the headers
+    const size_t chroma_factor = 4 * 64 / (mcu_width * mcu_height);
+    return (size_t) pad(width, mcu_width) * pad(height, mcu_height) * (2 + chroma_factor) + 2048;
 }
 
-JpegBuffer::~JpegBuffer()
-{
-    buffer.resize(next_output_byte - &buffer[0]);
-}
+// the tallest MCU is with 4:2:0 subsampling
+static_assert(JpegStripEncoder::strip_height % 16 == 0,
+              "strips should contain whole MCU rows");
 
-/* from https://github.com/LuaDist/libjpeg/blob/master/example.c */
-void write_JPEG_file(std::vector<uint8_t>& buffer, int quality, uint8_t *data, unsigned width, unsigned height)
+/* A compressor kept across images, its tables and settings are only set
+ * up once */
+class JpegCompressor
 {
+public:
+    JpegCompressor(const JpegOptions& options);
+    ~JpegCompressor();
+
+    /*! Compress a 32 bits per pixel image into out, restart_rows is the
+     * restart interval in MCU rows, 0 for none */
+    void compress(JpegData& out, int quality, const uint8_t *data,
+                  unsigned width, unsigned height, unsigned restart_rows);
+
+private:
+    struct Destination: public jpeg_destination_mgr
+    {
+        JpegData *out;
+    };
+
+    static void init_destination(j_compress_ptr cinfo);
+    static boolean empty_output_buffer(j_compress_ptr cinfo);
+    static void term_destination(j_compress_ptr cinfo);
+
+    const JpegOptions options;
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
-    JSAMPROW row_pointer[1];
-    int row_stride;
+    Destination dest;
+    int quality = -1;
+    std::vector<JSAMPROW> rows;
+};
 
+JpegCompressor::JpegCompressor(const JpegOptions& options):
+    options(options)
+{
     cinfo.err = jpeg_std_error(&jerr);
     jpeg_create_compress(&cinfo);
 
-    JpegBuffer buf(buffer);
-    cinfo.dest = &buf;
+    dest.init_destination = init_destination;
+    dest.empty_output_buffer = empty_output_buffer;
+    dest.term_destination = term_destination;
+    cinfo.dest = &dest;
 
-    cinfo.image_width = width;
-    cinfo.image_height = height;
     cinfo.input_components = 4;
     cinfo.in_color_space = JCS_EXT_BGRX;
     jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE);
 
-    jpeg_start_compress(&cinfo, TRUE);
+    // chroma components keep a 1x1 sampling
+    cinfo.comp_info[0].h_samp_factor = options.subsampling == JpegSubsampling::Yuv444 ? 1 : 2;
+    cinfo.comp_info[0].v_samp_factor = options.subsampling == JpegSubsampling::Yuv420 ? 2 : 1;
+    cinfo.dct_method = options.fast_dct ? JDCT_IFAST : JDCT_ISLOW;
+}
 
-    row_stride = width * 4;
+JpegCompressor::~JpegCompressor()
+{
+    jpeg_destroy_compress(&cinfo);
+}
 
+void JpegCompressor::init_destination(j_compress_ptr cinfo)
+{
+    Destination *dest = static_cast<Destination *>(cinfo->dest);
+    dest->next_output_byte = dest->out->data.get();
+    dest->free_in_buffer = dest->out->capacity;
+}
+
+// only when the worst case estimation is wrong
+boolean JpegCompressor::empty_output_buffer(j_compress_ptr cinfo)
+{
+    Destination *dest = static_cast<Destination *>(cinfo->dest);
+    JpegData& out = *dest->out;
+    std::unique_ptr<uint8_t[]> data(new uint8_t[out.capacity * 2]);
+    memcpy(data.get(), out.data.get(), out.capacity);
+    out.data.swap(data);
+    dest->next_output_byte = out.data.get() + out.capacity;
+    dest->free_in_buffer = out.capacity;
+    out.capacity *= 2;
+    return TRUE;
+}
+
+void JpegCompressor::term_destination(j_compress_ptr cinfo)
+{
+    Destination *dest = static_cast<Destination *>(cinfo->dest);
+    dest->out->size = dest->out->capacity - dest->free_in_buffer;
+}
+
+void JpegCompressor::compress(JpegData& out, int quality, const uint8_t *data,
+                              unsigned width, unsigned height, unsigned restart_rows)
+{
+    const size_t max_size = jpeg_max_size(width, height, options.subsampling);
+    if (out.capacity < max_size) {
+        out.data.reset(new uint8_t[max_size]);
+        out.capacity = max_size;
+    }
+    out.size = 0;
+    dest.out = &out;
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.restart_in_rows = restart_rows;
+    if (quality != this->quality) {
+        jpeg_set_quality(&cinfo, quality, TRUE);
+        this->quality = quality;
+    }
+
+    jpeg_start_compress(&cinfo, TRUE);
+
+    // all the rows are given at once, libjpeg takes as many as it can
+    rows.resize(height);
+    for (unsigned y = 0; y < height; ++y) {
+        rows[y] = const_cast<uint8_t *>(data) + (size_t) y * width * 4;
+    }
     while (cinfo.next_scanline < cinfo.image_height) {
-        row_pointer[0] = &data[cinfo.next_scanline * row_stride];
-        // TODO check error
-        (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
+        jpeg_write_scanlines(&cinfo, &rows[cinfo.next_scanline],
+                             cinfo.image_height - cinfo.next_scanline);
     }
 
     jpeg_finish_compress(&cinfo);
+}
 
-    jpeg_destroy_compress(&cinfo);
+void write_JPEG_file(std::vector<uint8_t>& buffer, int quality, uint8_t *data, unsigned width, unsigned height,
+                     const JpegOptions& options)
+{
+    JpegCompressor compressor(options);
+    JpegData jpeg;
+    compressor.compress(jpeg, quality, data, width, height, 0);
+    buffer.assign(jpeg.data.get(), jpeg.data.get() + jpeg.size);
+}
+
+/* Find the start of the entropy coded data (after the SOS segment) and
+ * the offset of the image height in the SOF segment */
+static void parse_header(const JpegData& data, size_t& height_offset, size_t& scan_start)
+{
+    const uint8_t *jpeg = data.data.get();
+    size_t pos = 2; // skip SOI
+    height_offset = 0;
+    while (pos + 4 <= data.size) {
+        if (jpeg[pos] != 0xff) {
+            break;
+        }
+        const uint8_t marker = jpeg[pos + 1];
+        const size_t len = (jpeg[pos + 2] << 8) | jpeg[pos + 3];
+        if (marker == 0xc0) { // SOF0: length, precision, height, width...
+            height_offset = pos + 5;
+        }
+        pos += 2 + len;
+        if (marker == 0xda) { // SOS
+            if (height_offset == 0 || pos > data.size) {
+                break;
+            }
+            scan_start = pos;
+            return;
+        }
+    }
+    throw std::runtime_error("Unexpected JPEG header produced by libjpeg");
+}
+
+const unsigned JpegStripEncoder::strip_height;
+
+JpegStripEncoder::JpegStripEncoder(unsigned threads, const JpegOptions& options):
+    options(options)
+{
+    if (threads > 1) {
+        pool.reset(new spice::streaming_agent::WorkerPool(threads));
+    }
+}
+
+JpegStripEncoder::~JpegStripEncoder()
+{
+}
+
+void JpegStripEncoder::reset()
+{
+    strips.clear();
+    width = height = 0;
+    quality = -1;
+}
+
+void JpegStripEncoder::encode_strip(Strip& strip, uint8_t *data, unsigned strip_rows)
+{
+    size_t height_offset;
+
+    std::unique_ptr<JpegCompressor> compressor;
+    {
+        std::lock_guard<std::mutex> guard(compressors_mutex);
+        if (!compressors.empty()) {
+            compressor = std::move(compressors.back());
+            compressors.pop_back();
+        }
+    }
+    if (!compressor) {
+        compressor.reset(new JpegCompressor(options));
+    }
+
+    // a restart interval covers the whole strip so no restart marker is
+    // emitted inside it, DC predictions are reset at its beginning
+    compressor->compress(strip.jpeg, quality, data, width, strip_rows,
+                         strip_height / jpeg_mcu_height(options.subsampling));
+    parse_header(strip.jpeg, height_offset, strip.scan_start);
+    if (&strip == &strips[0]) {
+        this->height_offset = height_offset;
+    }
+
+    std::lock_guard<std::mutex> guard(compressors_mutex);
+    compressors.push_back(std::move(compressor));
+}
+
+size_t JpegStripEncoder::compress_strips(int quality, uint8_t *data, unsigned width, unsigned height,
+                                         const std::vector<bool>& dirty_strips)
+{
+    const unsigned count = strip_count(height);
+    bool all_dirty = false;
+
+    if (width != this->width || height != this->height || quality != this->quality) {
+        this->width = width;
+        this->height = height;
+        this->quality = quality;
+        strips.resize(count);
+        all_dirty = true;
+    }
+
+    dirty.clear();
+    for (unsigned n = 0; n < count; ++n) {
+        if (all_dirty || n >= dirty_strips.size() || dirty_strips[n]) {
+            dirty.push_back(n);
+        }
+    }
+
+    auto encode_dirty = [&](unsigned i) {
+        const unsigned n = dirty[i];
+        const unsigned y = n * strip_height;
+        const unsigned rows = std::min(strip_height, height - y);
+        encode_strip(strips[n], data + (size_t) y * width * 4, rows);
+    };
+    if (pool) {
+        pool->run(dirty.size(), encode_dirty);
+    } else {
+        for (unsigned i = 0; i < dirty.size(); ++i) {
+            encode_dirty(i);
+        }
+    }
+
+    // the header of the first strip is used for the whole frame
+    size_t size = strips[0].scan_start;
+    for (const Strip& strip: strips) {
+        // entropy coded data followed by a restart marker or EOI
+        size += strip.jpeg.size - strip.scan_start;
+    }
+    return size;
+}
+
+void JpegStripEncoder::write(uint8_t *out) const
+{
+    const unsigned count = strips.size();
+    const Strip& first = strips[0];
+    memcpy(out, first.jpeg.data.get(), first.scan_start);
+    out[height_offset] = height >> 8;
+    out[height_offset + 1] = height & 0xff;
+    out += first.scan_start;
+
+    for (unsigned n = 0; n < count; ++n) {
+        const Strip& strip = strips[n];
+        // skip the EOI of the strip
+        const size_t scan_size = strip.jpeg.size - strip.scan_start - 2;
+        memcpy(out, strip.jpeg.data.get() + strip.scan_start, scan_size);
+        out += scan_size;
+        *out++ = 0xff;
+        *out++ = n + 1 < count ? 0xd0 + n % 8 : 0xd9; // RSTn or EOI
+    }
+}
+
+void JpegStripEncoder::encode(std::vector<uint8_t>& buffer, int quality, uint8_t *data,
+                              unsigned width, unsigned height, const std::vector<bool>& dirty_strips)
+{
+    buffer.resize(compress_strips(quality, data, width, height, dirty_strips));
+    write(&buffer[0]);
 }
@@ -7,8 +7,115 @@
 #define SPICE_STREAMING_AGENT_JPEG_HPP
 
 #include <stdio.h>
+#include <stdint.h>
+#include <memory>
+#include <mutex>
 #include <vector>
 
-void write_JPEG_file(std::vector<uint8_t>& buffer, int quality, uint8_t *data, unsigned width, unsigned height);
+#include "worker-pool.hpp"
+
+enum class JpegSubsampling
+{
+    Yuv420,
+    Yuv422,
+    Yuv444,
+};
+
+/*! Settings of the compression, fixed for the lifetime of an encoder */
+struct JpegOptions
+{
+    JpegSubsampling subsampling = JpegSubsampling::Yuv420;
+    /*! Use the faster and less accurate integer DCT */
+    bool fast_dct = false;
+};
+
+/*!
+ * Compressed data, allocated to the worst case size before compressing
+ * so the buffer is never grown during a compression nor zero filled.
+ */
+struct JpegData
+{
+    std::unique_ptr<uint8_t[]> data;
+    size_t capacity = 0;
+    size_t size = 0;
+};
+
+/*! Worst case size of a compressed image, like tjBufSize() */
+size_t jpeg_max_size(unsigned width, unsigned height, JpegSubsampling subsampling);
+
+/*! Height of a MCU, restart intervals are counted in MCU rows */
+unsigned jpeg_mcu_height(JpegSubsampling subsampling);
+
+class JpegCompressor;
+
+void write_JPEG_file(std::vector<uint8_t>& buffer, int quality, uint8_t *data, unsigned width, unsigned height,
+                     const JpegOptions& options = JpegOptions());
+
+/*!
+ * Encoder splitting the frame in horizontal strips.
+ *
+ * Each strip is compressed as an independent restart interval, the strips
+ * are then joined with restart markers into a single baseline JPEG.
+ * The compressed data of a strip is kept so it can be reused as long as
+ * its content does not change.
+ * Strips can be compressed concurrently by a pool of threads.
+ */
+class JpegStripEncoder
+{
+public:
+    JpegStripEncoder(unsigned threads = 1, const JpegOptions& options = JpegOptions());
+    ~JpegStripEncoder();
+
+    /*! Height of a strip, multiple of the MCU heights */
+    static const unsigned strip_height = 32;
+
+    /*! Encode a 32 bits per pixel frame.
+     * Only the strips for which dirty_strips is true are compressed again,
+     * the others reuse the data of the previous frame. All the strips are
+     * compressed if the size or quality changed.
+     */
+    void encode(std::vector<uint8_t>& buffer, int quality, uint8_t *data,
+                unsigned width, unsigned height, const std::vector<bool>& dirty_strips);
+
+    /*! Compress the strips like encode() without joining them.
+     * \return the size of the frame, to be written with write()
+     */
+    size_t compress_strips(int quality, uint8_t *data, unsigned width, unsigned height,
+                           const std::vector<bool>& dirty_strips);
+
+    /*! Join the strips of the last compressed frame into out */
+    void write(uint8_t *out) const;
+
+    /*! Forget the data of the previous frame */
+    void reset();
+
+    static unsigned strip_count(unsigned height)
+    {
+        return (height + strip_height - 1) / strip_height;
+    }
+
+private:
+    struct Strip
+    {
+        JpegData jpeg;
+        // offset of the entropy coded data in jpeg
+        size_t scan_start;
+    };
+
+    void encode_strip(Strip& strip, uint8_t *data, unsigned strip_rows);
+
+    const JpegOptions options;
+    std::unique_ptr<spice::streaming_agent::WorkerPool> pool;
+    // the compressors are kept across frames, one per thread compressing
+    std::mutex compressors_mutex;
+    std::vector<std::unique_ptr<JpegCompressor>> compressors;
+    std::vector<Strip> strips;
+    // strips to compress for the current frame
+    std::vector<unsigned> dirty;
+    // offset of the frame height in the header of the first strip
+    size_t height_offset = 0;
+    unsigned width = 0, height = 0;
+    int quality = -1;
+};
 
 #endif
@@ -0,0 +1,157 @@
+/* Runtime metrics of the agent, exported in the Prometheus text format.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "metrics.hpp"
+#include "error.hpp"
+
+#include <errno.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+
+namespace spice {
+namespace streaming_agent {
+
+const unsigned Histogram::sub_bucket_bits;
+const unsigned Histogram::sub_buckets;
+const unsigned Histogram::buckets;
+
+unsigned Histogram::bucket_of(uint64_t value)
+{
+    if (value < sub_buckets) {
+        return value;
+    }
+    const unsigned msb = 63 - __builtin_clzll(value);
+    const unsigned shift = msb - sub_bucket_bits;
+    return ((shift + 1) << sub_bucket_bits) + ((value >> shift) & (sub_buckets - 1));
+}
+
+uint64_t Histogram::bucket_max(unsigned bucket)
+{
+    if (bucket < sub_buckets) {
+        return bucket;
+    }
+    const unsigned shift = (bucket >> sub_bucket_bits) - 1;
+    const uint64_t low = (uint64_t) (sub_buckets + (bucket & (sub_buckets - 1))) << shift;
+    return low + (((uint64_t) 1 << shift) - 1);
+}
+
+void Histogram::record(uint64_t value)
+{
+    counts[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+    total_count.fetch_add(1, std::memory_order_relaxed);
+    total_sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::count_below(uint64_t bound) const
+{
+    uint64_t count = 0;
+    for (unsigned bucket = 0; bucket < buckets && bucket_max(bucket) <= bound; ++bucket) {
+        count += counts[bucket].load(std::memory_order_relaxed);
+    }
+    return count;
+}
+
+uint64_t Histogram::percentile(double quantile) const
+{
+    const uint64_t total = total_count;
+    uint64_t count = 0;
+    for (unsigned bucket = 0; bucket < buckets; ++bucket) {
+        count += counts[bucket].load(std::memory_order_relaxed);
+        if (count > 0 && count >= quantile * total) {
+            return bucket_max(bucket);
+        }
+    }
+    return 0;
+}
+
+namespace {
+
+// bounds of the exported buckets, in us
+const uint64_t exported_bounds[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000,
+};
+
+const char prefix[] = "spice_streaming_agent_";
+
+void format_histogram(std::string &out, const char *name, const char *help,
+                      const Histogram &histogram)
+{
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP %s%s_seconds %s\n# TYPE %s%s_seconds histogram\n",
+             prefix, name, help, prefix, name);
+    out += line;
+    for (uint64_t bound: exported_bounds) {
+        snprintf(line, sizeof(line), "%s%s_seconds_bucket{le=\"%g\"} %" PRIu64 "\n",
+                 prefix, name, bound / 1e6, histogram.count_below(bound));
+        out += line;
+    }
+    // read once, the count can change while formatting
+    const uint64_t count = histogram.count();
+    snprintf(line, sizeof(line),
+             "%s%s_seconds_bucket{le=\"+Inf\"} %" PRIu64 "\n"
+             "%s%s_seconds_sum %g\n"
+             "%s%s_seconds_count %" PRIu64 "\n",
+             prefix, name, count, prefix, name, histogram.sum() / 1e6, prefix, name, count);
+    out += line;
+}
+
+void format_counter(std::string &out, const char *name, const char *help, uint64_t value)
+{
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP %s%s_total %s\n# TYPE %s%s_total counter\n"
+             "%s%s_total %" PRIu64 "\n",
+             prefix, name, help, prefix, name, prefix, name, value);
+    out += line;
+}
+
+} // namespace
+
+std::string Metrics::format() const
+{
+    std::string out;
+    format_histogram(out, "capture", "Time to capture and encode a frame.", capture_time);
+    format_histogram(out, "send_blocked", "Time spent waiting for the device to send a frame.",
+                     send_blocked_time);
+    format_histogram(out, "frame_latency", "Time from the capture of a frame to its sending.",
+                     frame_latency);
+    format_counter(out, "frames_sent", "Frames sent.", frames_sent);
+    format_counter(out, "frames_dropped", "Frames dropped because the device was too slow.",
+                   frames_dropped);
+    format_counter(out, "sent_bytes", "Bytes of frame data sent.", bytes_sent);
+    format_counter(out, "streams_started", "Streams started.", streams_started);
+    format_counter(out, "resolution_changes", "Changes of the stream resolution.",
+                   resolution_changes);
+    format_counter(out, "cursor_updates", "Cursor shapes sent.", cursor_updates);
+    format_counter(out, "cursor_moves", "Cursor positions sent.", cursor_moves);
+    return out;
+}
+
+void Metrics::dump(const std::string &filename) const
+{
+    // readers never see a partial file
+    const std::string tmp_filename = filename + ".tmp";
+    FILE *file = fopen(tmp_filename.c_str(), "w");
+    if (!file) {
+        throw IOError("Failed to open the metrics file \"" + tmp_filename + "\"", errno);
+    }
+
+    const std::string content = format();
+    const bool written = fwrite(content.data(), content.size(), 1, file) == 1;
+    if (fclose(file) != 0 || !written) {
+        const int err = errno;
+        remove(tmp_filename.c_str());
+        throw IOError("Failed to write the metrics file \"" + tmp_filename + "\"", err);
+    }
+
+    if (rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+        const int err = errno;
+        remove(tmp_filename.c_str());
+        throw IOError("Failed to rename the metrics file to \"" + filename + "\"", err);
+    }
+}
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,78 @@
+/* Runtime metrics of the agent, exported in the Prometheus text format.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_METRICS_HPP
+#define SPICE_STREAMING_AGENT_METRICS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*! A histogram of durations with a bounded relative error.
+ *
+ * Like HDR histograms the values are counted in buckets of exponentially
+ * growing width, each power of two being split in 8 buckets, so the error
+ * is at most 12.5%. Recording a value is lock free.
+ */
+class Histogram
+{
+public:
+    void record(uint64_t value);
+
+    uint64_t count() const { return total_count; }
+    uint64_t sum() const { return total_sum; }
+    /*! Number of values not greater than bound, at the resolution of the buckets */
+    uint64_t count_below(uint64_t bound) const;
+    /*! Upper bound of the values below the given quantile, between 0 and 1 */
+    uint64_t percentile(double quantile) const;
+
+private:
+    static const unsigned sub_bucket_bits = 3;
+    static const unsigned sub_buckets = 1u << sub_bucket_bits;
+    static const unsigned buckets = (64 - sub_bucket_bits + 1) * sub_buckets;
+
+    static unsigned bucket_of(uint64_t value);
+    static uint64_t bucket_max(unsigned bucket);
+
+    std::atomic<uint64_t> counts[buckets] = {};
+    std::atomic<uint64_t> total_count{0};
+    std::atomic<uint64_t> total_sum{0};
+};
+
+/*! The times are recorded in microseconds, see FrameLog::get_time() */
+struct Metrics
+{
+    // from the frame deadline to the encoded frame, including the wait
+    // for a screen change
+    Histogram capture_time;
+    // waiting for the device while sending a frame
+    Histogram send_blocked_time;
+    // from the end of the capture to the end of the send
+    Histogram frame_latency;
+
+    std::atomic<uint64_t> frames_sent{0};
+    std::atomic<uint64_t> frames_dropped{0};
+    std::atomic<uint64_t> bytes_sent{0};
+    std::atomic<uint64_t> streams_started{0};
+    std::atomic<uint64_t> resolution_changes{0};
+    std::atomic<uint64_t> cursor_updates{0};
+    std::atomic<uint64_t> cursor_moves{0};
+
+    std::string format() const;
+
+    /*! Replace the content of the file with format(), atomically
+     * \throw IOError if the file cannot be written
+     */
+    void dump(const std::string &filename) const;
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_METRICS_HPP
@@ -7,6 +7,7 @@
 #include <config.h>
 #include "mjpeg-fallback.hpp"
 
+#include <algorithm>
 #include <cstring>
 #include <exception>
 #include <stdexcept>
@@ -16,6 +17,9 @@
 #include <X11/Xlib.h>
 
 #include "jpeg.hpp"
+#include "damage-tracker.hpp"
+#include "dirty-map.hpp"
+#include "frame-scaler.hpp"
 
 using namespace spice::streaming_agent;
 
@@ -25,7 +29,7 @@ static inline uint64_t get_time()
 
     clock_gettime(CLOCK_MONOTONIC, &now);
 
-    return (uint64_t)now.tv_sec * 10000000000u + (uint64_t)now.tv_nsec;
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
 }
 
 namespace {
@@ -33,7 +37,7 @@ namespace {
 class MjpegFrameCapture final: public FrameCapture
 {
 public:
-    MjpegFrameCapture(const MjpegSettings &settings);
+    MjpegFrameCapture(const MjpegSettings &settings, Agent *agent);
     ~MjpegFrameCapture();
     FrameInfo CaptureFrame() override;
     void Reset() override;
@@ -41,96 +45,216 @@ public:
         return SPICE_VIDEO_CODEC_TYPE_MJPEG;
     }
 private:
+    void write_frame(size_t size);
+    void release_frame();
+
     MjpegSettings settings;
+    Agent *const agent;
     Display *dpy;
+    std::unique_ptr<X11Capture> x11_capture;
+    std::unique_ptr<OutputSelector> output_selector;
+    std::unique_ptr<DamageTracker> damage_tracker;
 
+    // the last frame is stored in frame_buffer if the agent lent one,
+    // otherwise in frame
+    FrameBuffer *frame_buffer = nullptr;
     std::vector<uint8_t> frame;
+    uint8_t *frame_data = nullptr;
+    size_t frame_size = 0;
+    DirtyMap dirty_map;
+    JpegStripEncoder encoder;
+    std::vector<bool> dirty_strips;
+    ScaleSelector scale_selector;
+    // created when the frames are first scaled
+    std::unique_ptr<FrameScaler> scaler;
+    std::vector<uint8_t> scaled_frame;
 
     // last frame sizes
     int last_width = -1, last_height = -1;
-    // last time before capture
-    uint64_t last_time = 0;
+    // time of the last frame actually grabbed
+    uint64_t last_grab_time = 0;
+    // Agent::KeyframeRequests() handled
+    unsigned keyframe_requests = 0;
 };
 
 }
 
-MjpegFrameCapture::MjpegFrameCapture(const MjpegSettings& settings):
-    settings(settings)
+MjpegFrameCapture::MjpegFrameCapture(const MjpegSettings& settings, Agent *agent):
+    settings(settings),
+    agent(agent),
+    encoder(settings.threads, settings.jpeg),
+    scale_selector(settings.capture.scale),
+    keyframe_requests(agent ? agent->KeyframeRequests() : 0)
 {
     dpy = XOpenDisplay(NULL);
     if (!dpy)
         throw std::runtime_error("Unable to initialize X11");
+
+    x11_capture.reset(new X11Capture(dpy));
+    output_selector.reset(new OutputSelector(dpy, settings.capture.output));
+
+    if (settings.capture.use_damage) {
+        try {
+            damage_tracker.reset(new DamageTracker(dpy, RootWindow(dpy, XDefaultScreen(dpy))));
+        } catch (const std::exception &e) {
+            syslog(LOG_WARNING, "Cannot track screen changes, capturing every frame: %s", e.what());
+        }
+    }
 }
 
 MjpegFrameCapture::~MjpegFrameCapture()
 {
+    release_frame();
+    damage_tracker.reset();
+    output_selector.reset();
+    x11_capture.reset();
     XCloseDisplay(dpy);
 }
 
+void MjpegFrameCapture::release_frame()
+{
+    if (frame_buffer) {
+        frame_buffer->Unref();
+        frame_buffer = nullptr;
+    }
+    frame_data = nullptr;
+    frame_size = 0;
+}
+
+void MjpegFrameCapture::write_frame(size_t size)
+{
+    // the agent may still hold the previous frame, use a new buffer
+    FrameBuffer *buffer = agent ? agent->AcquireFrameBuffer(size) : nullptr;
+    release_frame();
+    if (buffer) {
+        frame_buffer = buffer;
+        frame_data = buffer->Data();
+    } else {
+        frame.resize(size);
+        frame_data = &frame[0];
+    }
+    encoder.write(frame_data);
+    frame_size = size;
+}
+
 void MjpegFrameCapture::Reset()
 {
-    frame.clear();
+    release_frame();
+    dirty_map.reset();
+    encoder.reset();
     last_width = last_height = -1;
+    if (damage_tracker) {
+        damage_tracker->force_damage();
+    }
 }
 
 FrameInfo MjpegFrameCapture::CaptureFrame()
 {
     FrameInfo info;
 
-    // reduce speed considering FPS
-    auto now = get_time();
-    if (last_time == 0) {
-        last_time = now;
-    } else {
-        const uint64_t delta = 1000000000u / settings.fps;
-        if (now >= last_time + delta) {
-            last_time = now;
-        } else {
-            uint64_t wait_time = last_time + delta - now;
-            // mathematically wait_time must be less than a second as
-            // delta would be 1 seconds only for FPS == 1 but in this
-            // side of the if now < last_time + delta
-            // but is also true that now > last_time so
-            // last_time + delta > now > last_time so
-            // 1s >= delta > now - last_time > 0 so
-            // wait_time = delta - (now - last_time) < delta <= 1s
-            timespec delay = { 0, (long) wait_time };
-            nanosleep(&delay, NULL);
-            last_time += delta;
+    // when the client cannot keep up lower the quality first, then the
+    // frame rate
+    const double rate = agent ? agent->RateFactor() : 1.0;
+    const int quality = std::max(1, (int) (settings.quality * rate + 0.5));
+    const int fps = std::max(1, (int) (settings.fps * std::min(1.0, 2 * rate) + 0.5));
+
+    // pace the frames on the agent's schedule
+    if (agent) {
+        agent->WaitNextFrame(fps);
+    }
+
+    // while the screen does not change resend the last frame
+    // at the minimum rate, this is enough to keep the stream alive
+    if (damage_tracker && frame_size > 0) {
+        const uint64_t keepalive = 1000000000u / settings.capture.min_fps;
+        const uint64_t now = get_time();
+        int timeout = 0;
+        if (last_grab_time + keepalive > now) {
+            timeout = (last_grab_time + keepalive - now) / 1000000u;
+        }
+        // all the frames are keyframes, on request the last one is sent
+        // again right away
+        auto keyframe_requested = [this] {
+            return agent->KeyframeRequests() != keyframe_requests;
+        };
+        const bool damaged = agent ? damage_tracker->wait_for_damage(timeout, keyframe_requested) :
+            damage_tracker->wait_for_damage(timeout);
+        if (agent) {
+            keyframe_requests = agent->KeyframeRequests();
+            // the next frame is not due right away after a long wait
+            agent->RestartSchedule();
+        }
+        if (!damaged) {
+            last_grab_time = get_time();
+            info.size.width = last_width;
+            info.size.height = last_height;
+            info.buffer = frame_data;
+            info.buffer_size = frame_size;
+            info.stream_start = false;
+            return info;
+        }
+        // the rate still caps the frames, at most half a period is waited
+        if (settings.capture.sync) {
+            damage_tracker->wait_for_settle(500 / fps);
         }
     }
+    last_grab_time = get_time();
 
     int screen = XDefaultScreen(dpy);
 
     Window win = RootWindow(dpy, screen);
 
-    XWindowAttributes win_info;
-    XGetWindowAttributes(dpy, win, &win_info);
+    const ScreenArea area = output_selector->area();
+    const FrameSize size = scale_selector.size(area.width, area.height, rate,
+                                               last_grab_time / 1000);
 
     bool is_first = false;
-    if (win_info.width != last_width || win_info.height != last_height) {
-        last_width = win_info.width;
-        last_height = win_info.height;
+    if ((int) size.width != last_width || (int) size.height != last_height) {
+        last_width = size.width;
+        last_height = size.height;
         is_first = true;
+        if (size.width != area.width || size.height != area.height) {
+            syslog(LOG_NOTICE, "Scaling the frames from %ux%u down to %ux%u",
+                   area.width, area.height, size.width, size.height);
+        }
     }
 
-    info.size.width = win_info.width;
-    info.size.height = win_info.height;
+    info.size = size;
 
-    int format = ZPixmap;
-    // TODO handle errors
-    XImage *image = XGetImage(dpy, win, win_info.x, win_info.y,
-                              win_info.width, win_info.height, AllPlanes, format);
+    XImage *image = x11_capture->grab(win, area.x, area.y, area.width, area.height);
+    if (!image) {
+        throw std::runtime_error("Cannot capture from X");
+    }
 
-    // TODO handle errors
     // TODO multiple formats (only 32 bit)
-    write_JPEG_file(frame, settings.quality, (uint8_t*) image->data,
-                    image->width, image->height);
-
-    image->f.destroy_image(image);
+    // only compress again the strips which changed, if nothing changed
+    // the previous frame is sent again
+    uint8_t *data = (uint8_t*) image->data;
+    unsigned width = image->width, height = image->height;
+    size_t stride = image->bytes_per_line;
+    if (size.width != area.width || size.height != area.height) {
+        if (!scaler) {
+            scaler.reset(new FrameScaler(settings.threads));
+        }
+        scaled_frame.resize((size_t) size.width * size.height * 4);
+        scaler->scale(data, stride, width, height,
+                      scaled_frame.data(), size.width * 4, size.width, size.height);
+        data = scaled_frame.data();
+        width = size.width;
+        height = size.height;
+        stride = width * 4;
+    }
+    if (dirty_map.update(data, width, height, stride) > 0 || frame_size == 0) {
+        const unsigned strip_height = JpegStripEncoder::strip_height;
+        dirty_strips.resize(JpegStripEncoder::strip_count(height));
+        for (unsigned n = 0; n < dirty_strips.size(); ++n) {
+            dirty_strips[n] = dirty_map.rows_dirty(n * strip_height, strip_height);
+        }
+        write_frame(encoder.compress_strips(quality, data, width, height, dirty_strips));
+    }
 
-    info.buffer = &frame[0];
-    info.buffer_size = frame.size();
+    info.buffer = frame_data;
+    info.buffer_size = frame_size;
 
     info.stream_start = is_first;
 
@@ -139,7 +263,7 @@ FrameInfo MjpegFrameCapture::CaptureFrame()
 
 FrameCapture *MjpegPlugin::CreateCapture()
 {
-    return new MjpegFrameCapture(settings);
+    return new MjpegFrameCapture(settings, agent);
 }
 
 unsigned MjpegPlugin::Rank()
@@ -165,6 +289,35 @@ void MjpegPlugin::ParseOptions(const ConfigureOption *options)
             } catch (const std::exception &e) {
                 throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.quality'.");
             }
+        } else if (name == "mjpeg.threads") {
+            try {
+                settings.threads = stoi(value);
+            } catch (const std::exception &e) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.threads'.");
+            }
+            if (settings.threads < 1) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.threads'.");
+            }
+        } else if (name == "mjpeg.subsampling") {
+            if (value == "420") {
+                settings.jpeg.subsampling = JpegSubsampling::Yuv420;
+            } else if (value == "422") {
+                settings.jpeg.subsampling = JpegSubsampling::Yuv422;
+            } else if (value == "444") {
+                settings.jpeg.subsampling = JpegSubsampling::Yuv444;
+            } else {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.subsampling'.");
+            }
+        } else if (name == "mjpeg.dct") {
+            if (value == "fast") {
+                settings.jpeg.fast_dct = true;
+            } else if (value == "accurate") {
+                settings.jpeg.fast_dct = false;
+            } else {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.dct'.");
+            }
+        } else {
+            parse_capture_option(settings.capture, name, value);
         }
     }
 }
@@ -188,6 +341,7 @@ bool MjpegPlugin::Register(Agent* agent)
         syslog(LOG_ERR, "Error parsing plugin option: %s", e.what());
     }
 
+    plugin->agent = agent;
     agent->Register(*plugin.release());
 
     return true;
@@ -9,6 +9,8 @@
 #include <spice-streaming-agent/plugin.hpp>
 #include <spice-streaming-agent/frame-capture.hpp>
 
+#include "jpeg.hpp"
+#include "x11-capture.hpp"
 
 namespace spice {
 namespace streaming_agent {
@@ -17,6 +19,9 @@ struct MjpegSettings
 {
     int fps;
     int quality;
+    int threads;
+    CaptureSettings capture;
+    JpegOptions jpeg;
 };
 
 class MjpegPlugin final: public Plugin
@@ -29,7 +34,9 @@ public:
     SpiceVideoCodecType VideoCodecType() const override;
     static bool Register(Agent* agent);
 private:
-    MjpegSettings settings = { 10, 80 };
+    MjpegSettings settings = { 10, 80, 1 };
+    // lends the frame buffers, if registered
+    Agent *agent = nullptr;
 };
 
 }} // namespace spice::streaming_agent
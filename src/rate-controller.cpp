@@ -0,0 +1,55 @@
+/* Adaptation of the stream rate to the speed of the streaming device.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "rate-controller.hpp"
+
+#include <algorithm>
+#include <syslog.h>
+
+
+namespace spice {
+namespace streaming_agent {
+
+const unsigned RateController::min_level;
+
+// weight of the last frame in the smoothed load
+static const double load_weight = 0.2;
+// the rate is lowered above high_load and raised below low_load
+static const double high_load = 0.5;
+static const double low_load = 0.1;
+// minimum time between two changes, in ns
+static const uint64_t decrease_delay = 500000000u;
+static const uint64_t increase_delay = 2000000000u;
+
+void RateController::frame_sent(uint64_t capture_time, uint64_t blocked_time)
+{
+    if (last_capture_time == 0 || capture_time <= last_capture_time) {
+        last_capture_time = last_change_time = capture_time;
+        return;
+    }
+
+    const uint64_t interval = capture_time - last_capture_time;
+    last_capture_time = capture_time;
+
+    const double frame_load = std::min(1.0, (double) blocked_time / interval);
+    load = (1 - load_weight) * load + load_weight * frame_load;
+
+    const uint64_t since_change = capture_time - last_change_time;
+    unsigned level = current_level;
+    if (load > high_load && since_change >= decrease_delay && level > min_level) {
+        level = std::max(min_level, level * 3 / 4);
+    } else if (load < low_load && since_change >= increase_delay && level < 100) {
+        level = std::min(100u, level + 10);
+    } else {
+        return;
+    }
+
+    syslog(LOG_DEBUG, "stream rate changed to %u%% (device load %.2f)", level, load);
+    current_level = level;
+    last_change_time = capture_time;
+}
+
+}} // namespace spice::streaming_agent
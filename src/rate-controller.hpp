@@ -0,0 +1,56 @@
+/* Adaptation of the stream rate to the speed of the streaming device.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_RATE_CONTROLLER_HPP
+#define SPICE_STREAMING_AGENT_RATE_CONTROLLER_HPP
+
+#include <atomic>
+#include <cstdint>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Computes the fraction of the configured quality, bitrate or frame rate
+ * plugins should use.
+ *
+ * The load of the device is the part of the interval between frames
+ * spent waiting for the device to accept data. The rate is quickly
+ * lowered when the device backs up and slowly raised again once it
+ * drains.
+ */
+class RateController
+{
+public:
+    /*! Lowest rate, in percent */
+    static const unsigned min_level = 20;
+
+    /*! Account for a frame which was sent.
+     * \param capture_time time the frame was captured, in ns
+     * \param blocked_time time spent waiting for the device while
+     * sending it, in ns
+     */
+    void frame_sent(uint64_t capture_time, uint64_t blocked_time);
+
+    /*! Current rate, between min_level and 100 percent.
+     * Can be called from any thread.
+     */
+    unsigned level() const { return current_level; }
+
+    double factor() const { return current_level / 100.0; }
+
+private:
+    std::atomic<unsigned> current_level{100};
+    // smoothed load of the device
+    double load = 0;
+    uint64_t last_capture_time = 0;
+    uint64_t last_change_time = 0;
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_RATE_CONTROLLER_HPP
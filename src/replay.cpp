@@ -0,0 +1,437 @@
+/* Load generator replaying recorded streams through the stream port.
+ *
+ * A recording done with --log-binary is sent by several concurrent
+ * instances, each writing to its own socket pair as the agent writes to
+ * the streaming device, while a reader plays the server side. The port
+ * throughput, the time spent blocked on the port and the latency of the
+ * cursor messages are reported for each instance.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include <config.h>
+#include "error.hpp"
+#include "frame-log.hpp"
+#include "metrics.hpp"
+#include "stream-messages.hpp"
+#include "stream-port.hpp"
+#include "stream-writer.hpp"
+
+#include <spice/stream-device.h>
+#include <spice/enums.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace spice::streaming_agent;
+
+namespace {
+
+struct Options
+{
+    unsigned instances = 1;
+    unsigned duration = 10;
+    double speed = 1;
+    unsigned cursor_rate = 60;
+    uint64_t read_rate = 0;
+};
+
+struct Event
+{
+    // in microseconds from the start of the recording
+    uint64_t time;
+    bool format;
+    unsigned width, height, codec;
+    std::vector<uint8_t> data;
+};
+
+struct Recording
+{
+    std::vector<Event> events;
+    // time between the last frame and the first one when looping
+    uint64_t duration;
+};
+
+/* Split the frames of the binary log with the sizes in its index, the
+ * "Started new stream" stats give the format messages */
+Recording read_recording(const char *filename)
+{
+    std::ifstream data(filename, std::ios::binary);
+    if (!data) {
+        throw std::runtime_error(std::string("Cannot open '") + filename + "'");
+    }
+    const std::string index_name = std::string(filename) + FrameLog::index_suffix;
+    std::ifstream index(index_name);
+    if (!index) {
+        throw std::runtime_error("Cannot open '" + index_name + "', was the log written with --log-binary?");
+    }
+
+    Recording recording{{}, 0};
+    const size_t frame_len = strlen(FrameLog::index_frame);
+    uint64_t first_time = 0;
+    unsigned frames = 0;
+    std::string line;
+    while (std::getline(index, line)) {
+        char *end;
+        const uint64_t time = strtoull(line.c_str(), &end, 10);
+        if (end == line.c_str() || strncmp(end, ": ", 2) != 0) {
+            continue;
+        }
+        const std::string text(end + 2);
+        if (recording.events.empty()) {
+            first_time = time;
+        }
+
+        Event event{time - first_time, false, 0, 0, 0, {}};
+        if (text.compare(0, frame_len, FrameLog::index_frame) == 0) {
+            event.data.resize(strtoul(text.c_str() + frame_len, nullptr, 10));
+            if (!data.read(reinterpret_cast<char *>(event.data.data()), event.data.size())) {
+                throw std::runtime_error(std::string("The recording '") + filename + "' is truncated");
+            }
+            ++frames;
+        } else if (sscanf(text.c_str(), "Started new stream wXh %uX%u codec=%u",
+                          &event.width, &event.height, &event.codec) == 3) {
+            event.format = true;
+        } else {
+            continue;
+        }
+        recording.events.push_back(std::move(event));
+    }
+
+    if (!frames) {
+        throw std::runtime_error(std::string("No frame found in '") + filename + "'");
+    }
+    if (!recording.events.front().format) {
+        fprintf(stderr, "The recording does not start a stream, assuming MJPEG 1920x1080\n");
+        recording.events.insert(recording.events.begin(),
+                                Event{0, true, 1920, 1080, SPICE_VIDEO_CODEC_TYPE_MJPEG, {}});
+    }
+    // loop after a mean frame interval
+    const uint64_t last_time = recording.events.back().time;
+    recording.duration = last_time + std::max<uint64_t>(last_time / frames, 1);
+    return recording;
+}
+
+void sleep_until(uint64_t time)
+{
+    const uint64_t now = FrameLog::get_time();
+    if (time > now) {
+        std::this_thread::sleep_for(std::chrono::microseconds(time - now));
+    }
+}
+
+/* An agent sending the recording and the cursor moves to its port, and the
+ * server reading them from the other end of the socket pair */
+class Instance
+{
+public:
+    Instance(const Recording &recording, const Options &options, Histogram &total_latency);
+    ~Instance();
+
+    void start();
+    void join();
+    void print(unsigned id) const;
+
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+    uint64_t blocked_time = 0;
+    uint64_t elapsed = 0;
+    Histogram frame_latency;
+    Histogram cursor_latency;
+    std::string error;
+
+private:
+    static const unsigned cursor_ring = 1024;
+
+    void send_frames();
+    void send_cursor();
+    void read_device();
+
+    const Recording &recording;
+    const Options &options;
+    Histogram &total_latency;
+    std::unique_ptr<StreamPort> port;
+    std::unique_ptr<StreamWriter> writer;
+    int device_fd = -1;
+    std::atomic<bool> sending{true};
+    // post time of the cursor moves, indexed by their x
+    std::atomic<uint64_t> cursor_posted[cursor_ring] = {};
+    std::thread sender, cursor, reader;
+};
+
+Instance::Instance(const Recording &recording, const Options &options, Histogram &total_latency):
+    recording(recording), options(options), total_latency(total_latency)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) != 0) {
+        throw IOError("socketpair failed", errno);
+    }
+    port.reset(new StreamPort(fds[0]));
+    writer.reset(new StreamWriter(*port));
+    device_fd = fds[1];
+}
+
+Instance::~Instance()
+{
+    if (device_fd >= 0) {
+        close(device_fd);
+    }
+}
+
+void Instance::start()
+{
+    reader = std::thread(&Instance::read_device, this);
+    cursor = std::thread(&Instance::send_cursor, this);
+    sender = std::thread(&Instance::send_frames, this);
+}
+
+void Instance::join()
+{
+    sender.join();
+    sending = false;
+    cursor.join();
+    blocked_time = writer->blocked_time();
+    // the reader gets an end of file once the port is closed
+    writer.reset();
+    port.reset();
+    reader.join();
+}
+
+void Instance::send_frames()
+{
+    const uint64_t start = FrameLog::get_time();
+    const uint64_t end = start + options.duration * UINT64_C(1000000);
+    try {
+        for (uint64_t offset = 0; ; offset += recording.duration) {
+            for (const Event &event: recording.events) {
+                const uint64_t due = options.speed > 0 ?
+                    start + (uint64_t) ((offset + event.time) / options.speed) :
+                    FrameLog::get_time();
+                if (due >= end) {
+                    elapsed = FrameLog::get_time() - start;
+                    return;
+                }
+                sleep_until(due);
+
+                if (event.format) {
+                    spice_stream_send_format(*writer, event.width, event.height, event.codec);
+                    continue;
+                }
+                spice_stream_send_frame(*writer, event.data.data(), event.data.size());
+                frame_latency.record(FrameLog::get_time() - due);
+                ++frames;
+                bytes += sizeof(StreamDevHeader) + event.data.size();
+            }
+        }
+    }
+    catch (std::exception &err) {
+        error = err.what();
+    }
+    elapsed = FrameLog::get_time() - start;
+}
+
+void Instance::send_cursor()
+{
+    if (!options.cursor_rate) {
+        return;
+    }
+    const uint64_t interval = 1000000 / options.cursor_rate;
+    uint64_t next = FrameLog::get_time();
+    for (uint32_t serial = 0; sending; ++serial) {
+        struct {
+            StreamDevHeader hdr;
+            StreamMsgCursorMove msg;
+        } move;
+        memset(&move, 0, sizeof(move));
+        move.hdr.protocol_version = STREAM_DEVICE_PROTOCOL;
+        move.hdr.type = STREAM_TYPE_CURSOR_MOVE;
+        move.hdr.size = sizeof(move.msg);
+        move.msg.x = serial;
+
+        cursor_posted[serial % cursor_ring] = FrameLog::get_time();
+        struct iovec iov = { &move, sizeof(move) };
+        // coalesced like the agent does, a late move is replaced
+        writer->post(&iov, 1, STREAM_TYPE_CURSOR_MOVE);
+
+        next += interval;
+        sleep_until(next);
+    }
+}
+
+void Instance::read_device()
+{
+    const uint64_t start = FrameLog::get_time();
+    uint64_t received = 0;
+    std::vector<uint8_t> body;
+    try {
+        while (true) {
+            StreamDevHeader hdr;
+            read_all(device_fd, &hdr, sizeof(hdr));
+            body.resize(hdr.size);
+            read_all(device_fd, body.data(), body.size());
+
+            if (hdr.type == STREAM_TYPE_CURSOR_MOVE && body.size() >= sizeof(StreamMsgCursorMove)) {
+                StreamMsgCursorMove move;
+                memcpy(&move, body.data(), sizeof(move));
+                const uint64_t latency = FrameLog::get_time() -
+                    cursor_posted[(uint32_t) move.x % cursor_ring];
+                cursor_latency.record(latency);
+                total_latency.record(latency);
+            }
+
+            // a server, or a network, slower than the port
+            received += sizeof(hdr) + hdr.size;
+            if (options.read_rate) {
+                sleep_until(start + received * 1000000 / options.read_rate);
+            }
+        }
+    }
+    catch (ReadError &) {
+        // the port was closed
+    }
+}
+
+void print_stats(const char *name, uint64_t frames, uint64_t bytes, uint64_t elapsed,
+                 uint64_t blocked_time, const Histogram *frame_latency,
+                 const Histogram &cursor_latency)
+{
+    const double seconds = std::max<uint64_t>(elapsed, 1) / 1000000.0;
+    printf("%-8s %8.1f %8.2f %8.1f %6.1f%%", name, frames / seconds,
+           bytes / seconds / 1000000, blocked_time / 1000.0,
+           blocked_time * 100.0 / std::max<uint64_t>(elapsed, 1));
+    if (frame_latency) {
+        printf(" %8.2f %8.2f", frame_latency->percentile(0.5) / 1000.0,
+               frame_latency->percentile(0.99) / 1000.0);
+    } else {
+        printf(" %8s %8s", "", "");
+    }
+    printf(" %8.2f %8.2f %8" PRIu64 "\n", cursor_latency.percentile(0.5) / 1000.0,
+           cursor_latency.percentile(0.99) / 1000.0, cursor_latency.count());
+}
+
+void Instance::print(unsigned id) const
+{
+    const std::string name = std::to_string(id);
+    // the blocked time is in nanoseconds, see StreamPort::blocked_time
+    print_stats(name.c_str(), frames, bytes, elapsed, blocked_time / 1000,
+                &frame_latency, cursor_latency);
+    if (!error.empty()) {
+        printf("         stopped: %s\n", error.c_str());
+    }
+}
+
+void usage(const char *progname)
+{
+    printf("usage: %s <options> recording\n", progname);
+    printf("Replays a recording done with --log-binary, and its index\n");
+    printf("options are:\n");
+    printf("\t-n count -- number of concurrent instances (default 1)\n");
+    printf("\t-t seconds -- duration, the recording is looped (default 10)\n");
+    printf("\t-s speed -- replay speed, 0 sends as fast as possible (default 1)\n");
+    printf("\t-c rate -- cursor moves per second of each instance (default 60)\n");
+    printf("\t-r bytes -- bytes read per second by each server, 0 for no limit (default 0)\n");
+    printf("\n");
+    printf("\t-h or --help     -- print this help message\n");
+
+    exit(1);
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    int opt;
+    static const struct option long_options[] = {
+        { "help", no_argument, NULL, 'h'},
+        { 0, 0, 0, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "hn:t:s:c:r:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'n':
+            options.instances = atoi(optarg);
+            break;
+        case 't':
+            options.duration = atoi(optarg);
+            break;
+        case 's':
+            options.speed = atof(optarg);
+            break;
+        case 'c':
+            options.cursor_rate = atoi(optarg);
+            break;
+        case 'r':
+            options.read_rate = strtoull(optarg, nullptr, 10);
+            break;
+        default:
+            usage(argv[0]);
+            break;
+        }
+    }
+
+    if (optind != argc - 1 || options.instances < 1 || options.duration < 1 ||
+        options.speed < 0) {
+        usage(argv[0]);
+    }
+
+    // a closed socket is reported by the writes
+    signal(SIGPIPE, SIG_IGN);
+
+    try {
+        const Recording recording = read_recording(argv[optind]);
+
+        Histogram total_latency;
+        std::vector<std::unique_ptr<Instance>> instances;
+        for (unsigned i = 0; i < options.instances; ++i) {
+            instances.emplace_back(new Instance(recording, options, total_latency));
+        }
+        for (auto &instance: instances) {
+            instance->start();
+        }
+        for (auto &instance: instances) {
+            instance->join();
+        }
+
+        printf("%-8s %8s %8s %8s %7s %8s %8s %8s %8s %8s\n", "instance", "frames/s", "MB/s",
+               "stall ms", "stall", "send p50", "send p99", "cur p50", "cur p99", "cursors");
+        uint64_t frames = 0, bytes = 0, blocked_time = 0, elapsed = 0;
+        for (unsigned i = 0; i < instances.size(); ++i) {
+            const Instance &instance = *instances[i];
+            instance.print(i);
+            frames += instance.frames;
+            bytes += instance.bytes;
+            blocked_time += instance.blocked_time / 1000;
+            elapsed = std::max(elapsed, instance.elapsed);
+        }
+        // the stall is relative to the time of all the instances
+        print_stats("total", frames, bytes, elapsed, blocked_time / instances.size(),
+                    nullptr, total_latency);
+        printf("latencies in ms, the total stall is the mean of the instances\n");
+    }
+    catch (std::exception &err) {
+        fprintf(stderr, "%s\n", err.what());
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,69 @@
+/* Classification of the screen content from its changes.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "scene-classifier.hpp"
+
+
+namespace spice {
+namespace streaming_agent {
+
+const uint64_t SceneClassifier::window;
+const uint64_t SceneClassifier::stable_time;
+constexpr double SceneClassifier::motion_changes;
+constexpr double SceneClassifier::static_changes;
+constexpr double SceneClassifier::motion_area;
+constexpr double SceneClassifier::static_area;
+
+bool SceneClassifier::update(uint64_t time, double changed)
+{
+    samples.push_back({time, changed});
+    while (time - samples.front().time > window) {
+        samples.pop_front();
+    }
+
+    if (classify() == current) {
+        candidate = false;
+        return false;
+    }
+    if (!candidate) {
+        candidate = true;
+        candidate_since = time;
+    }
+    if (time - candidate_since < stable_time) {
+        return false;
+    }
+    current = current == Scene::Static ? Scene::Motion : Scene::Static;
+    candidate = false;
+    return true;
+}
+
+Scene SceneClassifier::classify() const
+{
+    // too early to tell
+    if (samples.back().time - samples.front().time < window / 2) {
+        return current;
+    }
+
+    unsigned changes = 0;
+    double area = 0;
+    for (const Sample &sample: samples) {
+        if (sample.changed > 0) {
+            ++changes;
+            area += sample.changed;
+        }
+    }
+    const double changes_fraction = double(changes) / samples.size();
+    const double mean_area = changes ? area / changes : 0;
+
+    if (current == Scene::Static) {
+        return changes_fraction >= motion_changes && mean_area >= motion_area ?
+            Scene::Motion : Scene::Static;
+    }
+    return changes_fraction < static_changes || mean_area < static_area ?
+        Scene::Static : Scene::Motion;
+}
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,74 @@
+/* Classification of the screen content from its changes.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_SCENE_CLASSIFIER_HPP
+#define SPICE_STREAMING_AGENT_SCENE_CLASSIFIER_HPP
+
+#include <cstdint>
+#include <deque>
+
+
+namespace spice {
+namespace streaming_agent {
+
+enum class Scene
+{
+    // text, documents: few small changes, better sent as MJPEG
+    Static,
+    // video, games: large parts of the screen change continuously
+    Motion,
+};
+
+/*!
+ * Classifies the screen content from the part of the screen which changed
+ * between regular samples.
+ *
+ * The last samples, over window, give how often the screen changes and how
+ * much of it. The scene becomes Motion when both are high and Static again
+ * when either is low, with thresholds far enough apart that the content
+ * does not flip between the two. A new classification must also hold for
+ * stable_time before it is reported, so scrolling a document or opening a
+ * window does not count as motion.
+ */
+class SceneClassifier
+{
+public:
+    /*! Add a sample
+     * \param time in microseconds, see FrameLog::get_time()
+     * \param changed fraction of the screen changed since the previous
+     * sample, from 0 to 1
+     * \return true if scene() changed
+     */
+    bool update(uint64_t time, double changed);
+
+    Scene scene() const { return current; }
+
+    static const uint64_t window = 2000000;
+    static const uint64_t stable_time = 3000000;
+    // the fraction of the samples with changes and the mean fraction of
+    // the screen they changed, to enter and leave Motion
+    static constexpr double motion_changes = 0.8, static_changes = 0.5;
+    static constexpr double motion_area = 0.05, static_area = 0.02;
+
+private:
+    struct Sample
+    {
+        uint64_t time;
+        double changed;
+    };
+
+    Scene classify() const;
+
+    std::deque<Sample> samples;
+    Scene current = Scene::Static;
+    // the samples show another scene since candidate_since
+    bool candidate = false;
+    uint64_t candidate_since = 0;
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_SCENE_CLASSIFIER_HPP
@@ -0,0 +1,54 @@
+/* Sampling of the screen changes to classify its content.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "scene-monitor.hpp"
+#include "frame-log.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+
+namespace spice {
+namespace streaming_agent {
+
+SceneMonitor::SceneMonitor(const std::string &output)
+{
+    display = XOpenDisplay(nullptr);
+    if (!display) {
+        throw std::runtime_error("Unable to initialize X11");
+    }
+    try {
+        output_selector.reset(new OutputSelector(display, output));
+        damage_tracker.reset(new DamageTracker(display, RootWindow(display, XDefaultScreen(display))));
+    } catch (...) {
+        output_selector.reset();
+        XCloseDisplay(display);
+        throw;
+    }
+    // the changes before the first sample are not known
+    damage_tracker->take_damaged_area(0, 0, 0, 0);
+}
+
+SceneMonitor::~SceneMonitor()
+{
+    damage_tracker.reset();
+    output_selector.reset();
+    XCloseDisplay(display);
+}
+
+bool SceneMonitor::sample()
+{
+    const ScreenArea area = output_selector->area();
+    const uint64_t pixels = (uint64_t) area.width * area.height;
+    if (pixels == 0) {
+        return false;
+    }
+    const uint64_t changed = damage_tracker->take_damaged_area(area.x, area.y,
+                                                               area.width, area.height);
+    return classifier.update(FrameLog::get_time(), std::min(1.0, double(changed) / pixels));
+}
+
+}} // namespace spice::streaming_agent
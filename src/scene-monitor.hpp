@@ -0,0 +1,53 @@
+/* Sampling of the screen changes to classify its content.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_SCENE_MONITOR_HPP
+#define SPICE_STREAMING_AGENT_SCENE_MONITOR_HPP
+
+#include "damage-tracker.hpp"
+#include "scene-classifier.hpp"
+#include "x11-capture.hpp"
+
+#include <memory>
+#include <string>
+#include <X11/Xlib.h>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Tracks the changes of the captured area through its own X connection,
+ * independently of the plugin capturing the frames, and feeds them to a
+ * SceneClassifier.
+ */
+class SceneMonitor
+{
+public:
+    /*! Throws std::runtime_error if X or XDamage cannot be used */
+    explicit SceneMonitor(const std::string &output);
+    SceneMonitor(const SceneMonitor &) = delete;
+    SceneMonitor &operator=(const SceneMonitor &) = delete;
+    ~SceneMonitor();
+
+    /*! Take a sample, to be called every sample_interval_ms
+     * \return true if the scene changed
+     */
+    bool sample();
+    Scene scene() const { return classifier.scene(); }
+
+    static const unsigned sample_interval_ms = 100;
+
+private:
+    Display *display;
+    std::unique_ptr<OutputSelector> output_selector;
+    std::unique_ptr<DamageTracker> damage_tracker;
+    SceneClassifier classifier;
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_SCENE_MONITOR_HPP
@@ -7,8 +7,13 @@
 #include "concrete-agent.hpp"
 #include "mjpeg-fallback.hpp"
 #include "cursor-updater.hpp"
+#include "event-loop.hpp"
 #include "frame-log.hpp"
+#include "frame-queue.hpp"
+#include "scene-monitor.hpp"
 #include "stream-port.hpp"
+#include "stream-messages.hpp"
+#include "stream-writer.hpp"
 #include "error.hpp"
 
 #include <spice/stream-device.h>
@@ -27,12 +32,15 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/time.h>
-#include <poll.h>
 #include <syslog.h>
 #include <signal.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <exception>
 #include <stdexcept>
 #include <memory>
+#include <mutex>
 #include <thread>
 #include <vector>
 #include <string>
@@ -41,40 +49,24 @@ using namespace spice::streaming_agent;
 
 static ConcreteAgent agent;
 
-struct SpiceStreamFormatMessage
-{
-    StreamDevHeader hdr;
-    StreamMsgFormat msg;
-};
-
-struct SpiceStreamDataMessage
-{
-    StreamDevHeader hdr;
-    StreamMsgData msg;
-};
-
-static bool streaming_requested = false;
-static bool quit_requested = false;
+// the commands are read by the event thread, the capture waits for them
+static std::mutex command_mutex;
+static std::condition_variable command_changed;
+static std::atomic<bool> streaming_requested(false);
+static std::atomic<bool> quit_requested(false);
+// incremented by each START_STOP message, the stream restarts with the new codecs
+static std::atomic<unsigned> start_stop_count(0);
 static std::set<SpiceVideoCodecType> client_codecs;
+// with scene switching static content is streamed as MJPEG and motion with
+// the other codecs of the client, the scene is updated by the event thread
+static bool scene_switching = false;
+static std::atomic<Scene> current_scene(Scene::Static);
 
-static bool have_something_to_read(StreamPort &stream_port, bool blocking)
+static void request_quit()
 {
-    struct pollfd pollfd = {stream_port.fd, POLLIN, 0};
-
-    if (poll(&pollfd, 1, blocking ? -1 : 0) < 0) {
-        if (errno == EINTR) {
-            // report nothing to read, next iteration of the enclosing loop will retry
-            return false;
-        }
-
-        throw IOError("poll failed on the device", errno);
-    }
-
-    if (pollfd.revents & POLLIN) {
-        return true;
-    }
-
-    return false;
+    std::lock_guard<std::mutex> guard(command_mutex);
+    quit_requested = true;
+    command_changed.notify_all();
 }
 
 static void handle_stream_start_stop(StreamPort &stream_port, uint32_t len)
@@ -87,21 +79,28 @@ static void handle_stream_start_stop(StreamPort &stream_port, uint32_t len)
     }
 
     stream_port.read(msg, len);
-    streaming_requested = (msg[0] != 0); /* num_codecs */
+    const bool start = (msg[0] != 0); /* num_codecs */
     syslog(LOG_INFO, "GOT START_STOP message -- request to %s streaming",
-           streaming_requested ? "START" : "STOP");
-    client_codecs.clear();
+           start ? "START" : "STOP");
     const int max_codecs = len - 1; /* see struct StreamMsgStartStop */
     if (msg[0] > max_codecs) {
         throw std::runtime_error("num_codecs=" + std::to_string(msg[0]) +
                                  " > max_codecs=" + std::to_string(max_codecs));
     }
+    std::set<SpiceVideoCodecType> codecs;
     for (int i = 1; i <= msg[0]; ++i) {
-        client_codecs.insert((SpiceVideoCodecType) msg[i]);
+        codecs.insert((SpiceVideoCodecType) msg[i]);
     }
+
+    std::lock_guard<std::mutex> guard(command_mutex);
+    streaming_requested = start;
+    client_codecs.swap(codecs);
+    ++start_stop_count;
+    command_changed.notify_all();
 }
 
-static void handle_stream_capabilities(StreamPort &stream_port, uint32_t len)
+static void handle_stream_capabilities(StreamPort &stream_port, StreamWriter &stream_writer,
+                                       uint32_t len)
 {
     uint8_t caps[STREAM_MSG_CAPABILITIES_MAX_BYTES];
 
@@ -118,7 +117,8 @@ static void handle_stream_capabilities(StreamPort &stream_port, uint32_t len)
         0
     };
 
-    stream_port.write(&hdr, sizeof(hdr));
+    struct iovec iov = { &hdr, sizeof(hdr) };
+    stream_writer.post(&iov, 1);
 }
 
 static void handle_stream_error(StreamPort &stream_port, size_t len)
@@ -140,6 +140,8 @@ static void handle_stream_error(StreamPort &stream_port, size_t len)
 
     syslog(LOG_ERR, "Received NotifyError message from the server: %d - %s",
         msg.error_code, msg.msg);
+    // the client recovers with the next keyframe
+    agent.RequestKeyframe();
 
     if (len_to_read < len) {
         throw std::runtime_error("Received NotifyError message size " + std::to_string(len) +
@@ -147,11 +149,11 @@ static void handle_stream_error(StreamPort &stream_port, size_t len)
     }
 }
 
-static void read_command_from_device(StreamPort &stream_port)
+static void read_command_from_device(StreamPort &stream_port, StreamWriter &stream_writer)
 {
     StreamDevHeader hdr;
 
-    std::lock_guard<std::mutex> guard(stream_port.mutex);
+    // only this thread reads the device, the replies are written by stream_writer
     stream_port.read(&hdr, sizeof(hdr));
 
     if (hdr.protocol_version != STREAM_DEVICE_PROTOCOL) {
@@ -161,7 +163,7 @@ static void read_command_from_device(StreamPort &stream_port)
 
     switch (hdr.type) {
     case STREAM_TYPE_CAPABILITIES:
-        return handle_stream_capabilities(stream_port, hdr.size);
+        return handle_stream_capabilities(stream_port, stream_writer, hdr.size);
     case STREAM_TYPE_NOTIFY_ERROR:
         return handle_stream_error(stream_port, hdr.size);
     case STREAM_TYPE_START_STOP:
@@ -170,124 +172,258 @@ static void read_command_from_device(StreamPort &stream_port)
     throw std::runtime_error("UNKNOWN msg of type " + std::to_string(hdr.type));
 }
 
-static void read_command(StreamPort &stream_port, bool blocking)
+/*! Read the commands of the device and handle the signals until quit is
+ * requested, so a command takes effect even in the middle of a frame */
+static void handle_events(EventLoop &loop, std::exception_ptr &error)
 {
-    while (!quit_requested) {
-        if (have_something_to_read(stream_port, blocking)) {
-            read_command_from_device(stream_port);
-            break;
-        }
+    try {
+        loop.run();
+    } catch (...) {
+        error = std::current_exception();
+    }
+    request_quit();
+}
 
-        if (!blocking) {
-            break;
-        }
+static void usage(const char *progname)
+{
+    printf("usage: %s <options>\n", progname);
+    printf("options are:\n");
+    printf("\t-p portname  -- virtio-serial port to use\n");
+    printf("\t-l file -- log frames to file\n");
+    printf("\t--log-binary -- log binary frames (following -l), their sizes go to file.index\n");
+    printf("\t--log-categories -- log categories, separated by ':' (currently: frames)\n");
+    printf("\t--plugins-dir=path -- change plugins directory\n");
+    printf("\t-d -- enable debug logs\n");
+    printf("\t-c variable=value -- change settings\n");
+    printf("\t\tframerate = 1-100 (check 10,20,30,40,50,60)\n");
+    printf("\t\tcapture.damage = on|off -- only capture when the screen changes (default on)\n");
+    printf("\t\tmjpeg.threads = number of threads compressing MJPEG frames (default 1)\n");
+    printf("\t\tmjpeg.subsampling = 420|422|444 -- chroma subsampling of the MJPEG frames (default 420)\n");
+    printf("\t\tmjpeg.dct = fast|accurate -- DCT used to compress the MJPEG frames (default accurate)\n");
+    printf("\t\tpipeline = on|off -- send frames from a separate thread while capturing the next one (default off)\n");
+    printf("\t\trate-control = on|off -- lower the quality when the client cannot keep up (default on)\n");
+    printf("\t\tcapture.min-framerate = frames per second sent while the screen does not change (default 1)\n");
+    printf("\t\tcapture.output = all|primary|name|index -- XRandR output to capture (default all)\n");
+    printf("\t\tcapture.sync = on|off -- capture once the screen updates settle, at the vertical blank with DRM (default off)\n");
+    printf("\t\tscale.max-size = WIDTHxHEIGHT|off -- scale the frames down to fit in this size (default off)\n");
+    printf("\t\tscale.adaptive = on|off -- also scale the frames down when the client cannot keep up (default off)\n");
+    printf("\t\tmetrics.file = file where the metrics are written in the Prometheus text format\n");
+    printf("\t\tmetrics.interval = seconds between two updates of the metrics file (default 10)\n");
+    printf("\t\tcursor.position = on|off -- send the pointer moves, frames do not include the cursor (default off)\n");
+    printf("\t\tscene.switching = on|off -- stream static content as MJPEG and motion with the other codecs (default off)\n");
+    printf("\t\tkeyframe.max-interval = frames between two keyframes at most, 0 lets the encoder choose (default 0)\n");
+    printf("\n");
+    printf("\t-h or --help     -- print this help message\n");
 
-        sleep(1);
+    exit(1);
+}
+
+/*! Parse the on|off value of option name into flag
+ * \return false, after logging it, for an invalid value */
+static bool parse_switch(const char *name, const char *value, bool &flag)
+{
+    if (strcmp(value, "on") == 0) {
+        flag = true;
+    } else if (strcmp(value, "off") == 0) {
+        flag = false;
+    } else {
+        syslog(LOG_ERR, "Invalid value '%s' for option '%s'", value, name);
+        return false;
     }
+    return true;
 }
 
-static void spice_stream_send_format(StreamPort &stream_port, unsigned w, unsigned h, unsigned c)
+static bool rate_control = true;
+
+// the cursor positions are scaled to it
+static StreamSize stream_size;
+
+static void send_frame(StreamWriter &stream_writer, FrameLog &frame_log,
+                       const void *buffer, size_t buffer_size,
+                       FrameSize size, bool stream_start, unsigned char codec,
+                       uint64_t capture_time)
 {
+    const uint64_t blocked_before = stream_writer.blocked_time();
+
+    if (stream_start) {
+        syslog(LOG_DEBUG, "wXh %uX%u  codec=%u", size.width, size.height, codec);
+        frame_log.log_stat("Started new stream wXh %uX%u codec=%u", size.width, size.height, codec);
 
-    SpiceStreamFormatMessage msg;
-    const size_t msgsize = sizeof(msg);
-    const size_t hdrsize  = sizeof(msg.hdr);
-    memset(&msg, 0, msgsize);
-    msg.hdr.protocol_version = STREAM_DEVICE_PROTOCOL;
-    msg.hdr.type = STREAM_TYPE_FORMAT;
-    msg.hdr.size = msgsize - hdrsize; /* includes only the body? */
-    msg.msg.width = w;
-    msg.msg.height = h;
-    msg.msg.codec = c;
-
-    syslog(LOG_DEBUG, "writing format");
-    std::lock_guard<std::mutex> guard(stream_port.mutex);
-    stream_port.write(&msg, msgsize);
+        spice_stream_send_format(stream_writer, size.width, size.height, codec);
+        stream_size.width = size.width;
+        stream_size.height = size.height;
+    }
+    frame_log.log_stat("Frame of %zu bytes", buffer_size);
+    frame_log.log_frame(buffer, buffer_size);
+
+    spice_stream_send_frame(stream_writer, buffer, buffer_size);
+
+    const uint64_t blocked_time = stream_writer.blocked_time() - blocked_before;
+    if (rate_control) {
+        // capture_time is in us, the controller works in ns
+        agent.RateControl().frame_sent(capture_time * 1000, blocked_time);
+    }
+
+    Metrics &metrics = agent.GetMetrics();
+    metrics.send_blocked_time.record(blocked_time / 1000);
+    metrics.frame_latency.record(FrameLog::get_time() - capture_time);
+    ++metrics.frames_sent;
+    metrics.bytes_sent += buffer_size;
+    if (stream_start) {
+        // frames are sent by a single thread at a time
+        static FrameSize last_size = {0, 0};
+        ++metrics.streams_started;
+        if (last_size.width && (size.width != last_size.width || size.height != last_size.height)) {
+            ++metrics.resolution_changes;
+        }
+        last_size = size;
+    }
 }
 
-static void spice_stream_send_frame(StreamPort &stream_port, const void *buf, const unsigned size)
+/* Sending stage of the pipelined mode, runs till the queue is closed
+ * or writing to the device fails */
+static void send_queued_frames(StreamWriter &stream_writer, FrameLog &frame_log, FrameQueue &queue,
+                               std::atomic<bool> &sending_stopped, std::exception_ptr &error)
 {
-    SpiceStreamDataMessage msg;
-    const size_t msgsize = sizeof(msg);
+    QueuedFrame frame;
 
-    memset(&msg, 0, msgsize);
-    msg.hdr.protocol_version = STREAM_DEVICE_PROTOCOL;
-    msg.hdr.type = STREAM_TYPE_DATA;
-    msg.hdr.size = size; /* includes only the body? */
-
-    std::lock_guard<std::mutex> guard(stream_port.mutex);
-    stream_port.write(&msg, msgsize);
-    stream_port.write(buf, size);
+    try {
+        while (queue.pop(frame)) {
+            uint64_t time_before = FrameLog::get_time();
+            send_frame(stream_writer, frame_log, frame.data, frame.data_size,
+                       frame.size, frame.stream_start, frame.codec, frame.capture_time);
+            uint64_t time_after = FrameLog::get_time();
 
-    syslog(LOG_DEBUG, "Sent a frame of size %u", size);
+            frame_log.log_stat("Sent frame (queued %" PRIu64 " us, sent in %" PRIu64 " us)",
+                               time_before - frame.capture_time, time_after - time_before);
+            queue.release(frame);
+        }
+    } catch (const WriteError& e) {
+        syslog(e);
+    } catch (...) {
+        error = std::current_exception();
+    }
+    queue.release(frame);
+    // do not leave the capture stage waiting for room in the queue
+    queue.close();
+    sending_stopped = true;
 }
 
-static void handle_interrupt(int intr)
+static void log_pacing(FrameLog &frame_log)
 {
-    syslog(LOG_INFO, "Got signal %d, exiting", intr);
-    quit_requested = true;
+    FrameScheduler &scheduler = agent.Scheduler();
+    const FrameScheduler::Stats &stats = scheduler.stats();
+    if (stats.frames == 0) {
+        return;
+    }
+
+    syslog(LOG_DEBUG, "frame pacing: jitter mean %" PRIu64 " us max %" PRIu64 " us, "
+           "%u of %u frames late", stats.mean_jitter() / 1000, stats.max_jitter / 1000,
+           stats.missed, stats.frames);
+    frame_log.log_stat("Pacing jitter mean %" PRIu64 " us max %" PRIu64 " us late %u/%u",
+                       stats.mean_jitter() / 1000, stats.max_jitter / 1000,
+                       stats.missed, stats.frames);
+    scheduler.reset_stats();
 }
 
-static void register_interrupts(void)
+static void dump_metrics(const char *metrics_file)
 {
-    struct sigaction sa = { };
-    sa.sa_handler = handle_interrupt;
-    if ((sigaction(SIGINT, &sa, NULL) != 0) &&
-        (sigaction(SIGTERM, &sa, NULL) != 0)) {
-        syslog(LOG_WARNING, "failed to register signal handler %m");
+    try {
+        agent.GetMetrics().dump(metrics_file);
+    } catch (const Error &e) {
+        // not a reason to stop streaming
+        syslog(e);
     }
 }
 
-static void usage(const char *progname)
+static const char *scene_name(Scene scene)
 {
-    printf("usage: %s <options>\n", progname);
-    printf("options are:\n");
-    printf("\t-p portname  -- virtio-serial port to use\n");
-    printf("\t-l file -- log frames to file\n");
-    printf("\t--log-binary -- log binary frames (following -l)\n");
-    printf("\t--log-categories -- log categories, separated by ':' (currently: frames)\n");
-    printf("\t--plugins-dir=path -- change plugins directory\n");
-    printf("\t-d -- enable debug logs\n");
-    printf("\t-c variable=value -- change settings\n");
-    printf("\t\tframerate = 1-100 (check 10,20,30,40,50,60)\n");
-    printf("\n");
-    printf("\t-h or --help     -- print this help message\n");
+    return scene == Scene::Static ? "static" : "motion";
+}
 
-    exit(1);
+static std::set<SpiceVideoCodecType>
+scene_codecs(const std::set<SpiceVideoCodecType> &codecs, Scene scene)
+{
+    if (!scene_switching) {
+        return codecs;
+    }
+    std::set<SpiceVideoCodecType> scene_codecs;
+    for (SpiceVideoCodecType codec: codecs) {
+        if ((codec == SPICE_VIDEO_CODEC_TYPE_MJPEG) == (scene == Scene::Static)) {
+            scene_codecs.insert(codec);
+        }
+    }
+    // all the client's codecs if none of them can be used for the scene
+    return agent.CanCapture(scene_codecs) ? scene_codecs : codecs;
 }
 
 static void
-do_capture(StreamPort &stream_port, FrameLog &frame_log)
+do_capture(StreamWriter &stream_writer, FrameLog &frame_log, bool pipelined)
 {
     unsigned int frame_count = 0;
     while (!quit_requested) {
-        while (!quit_requested && !streaming_requested) {
-            read_command(stream_port, true);
-        }
-
-        if (quit_requested) {
-            return;
+        std::set<SpiceVideoCodecType> requested_codecs;
+        unsigned start_stop;
+        {
+            std::unique_lock<std::mutex> lock(command_mutex);
+            command_changed.wait(lock, []{ return quit_requested || streaming_requested; });
+            if (quit_requested) {
+                return;
+            }
+            requested_codecs = client_codecs;
+            start_stop = start_stop_count;
         }
+        Scene scene = current_scene;
+        const std::set<SpiceVideoCodecType> codecs = scene_codecs(requested_codecs, scene);
 
         syslog(LOG_INFO, "streaming starts now");
         uint64_t time_last = 0;
 
-        std::unique_ptr<FrameCapture> capture(agent.GetBestFrameCapture(client_codecs));
+        // the capture of the previous stream is reused when possible
+        std::unique_ptr<FrameCapture> capture(agent.GetFrameCapture(codecs));
         if (!capture) {
             throw std::runtime_error("cannot find a suitable capture system");
         }
+        // the client may have dropped the previous stream
+        agent.RequestKeyframe();
+
+        // in pipelined mode frames are sent by a separate thread, a single
+        // frame is kept waiting so latency does not grow if sending is slow,
+        // frames in buffers lent by the agent are not copied
+        FrameQueue queue(1, &agent.BufferPool());
+        std::atomic<bool> sending_stopped(false);
+        std::exception_ptr sending_error;
+        std::thread sender;
+        unsigned reported_drops = 0;
+        if (pipelined) {
+            sender = std::thread(send_queued_frames, std::ref(stream_writer), std::ref(frame_log),
+                                 std::ref(queue), std::ref(sending_stopped),
+                                 std::ref(sending_error));
+        }
 
-        while (!quit_requested && streaming_requested) {
+        while (!quit_requested && start_stop == start_stop_count && !sending_stopped) {
+            if (scene != current_scene) {
+                scene = current_scene;
+                if (scene_codecs(requested_codecs, scene) != codecs) {
+                    syslog(LOG_INFO, "the screen content is now %s, switching codec",
+                           scene_name(scene));
+                    break;
+                }
+            }
             if (++frame_count % 100 == 0) {
                 syslog(LOG_DEBUG, "SENT %d frames", frame_count);
+                log_pacing(frame_log);
             }
             uint64_t time_before = FrameLog::get_time();
 
             frame_log.log_stat("Capturing frame...");
             FrameInfo frame = capture->CaptureFrame();
-            frame_log.log_stat("Captured frame");
 
             uint64_t time_after = FrameLog::get_time();
+            frame_log.log_stat("Captured frame (%" PRIu64 " us)", time_after - time_before);
+            // the wait for the next frame is not part of the capture
+            agent.GetMetrics().capture_time.record(
+                time_after - std::max(time_before, agent.LastWakeTime()));
             syslog(LOG_DEBUG,
                    "got a frame -- size is %zu (%" PRIu64 " ms) "
                    "(%" PRIu64 " ms from last frame)(%" PRIu64 " us)\n",
@@ -296,32 +432,38 @@ do_capture(StreamPort &stream_port, FrameLog &frame_log)
                    (time_before - time_last));
             time_last = time_after;
 
-            if (frame.stream_start) {
-                unsigned width, height;
-                unsigned char codec;
-
-                width = frame.size.width;
-                height = frame.size.height;
-                codec = capture->VideoCodecType();
-
-                syslog(LOG_DEBUG, "wXh %uX%u  codec=%u", width, height, codec);
-                frame_log.log_stat("Started new stream wXh %uX%u codec=%u", width, height, codec);
-
-                spice_stream_send_format(stream_port, width, height, codec);
+            SpiceVideoCodecType codec = capture->VideoCodecType();
+            if (pipelined) {
+                // MJPEG frames do not depend on each other so a stale frame
+                // can be replaced by a newer one
+                queue.push(frame, codec, time_after, codec == SPICE_VIDEO_CODEC_TYPE_MJPEG);
+                const unsigned dropped = queue.dropped();
+                agent.GetMetrics().frames_dropped += dropped - reported_drops;
+                reported_drops = dropped;
+            } else {
+                try {
+                    send_frame(stream_writer, frame_log, frame.buffer, frame.buffer_size,
+                               frame.size, frame.stream_start, codec, time_after);
+                } catch (const WriteError& e) {
+                    syslog(e);
+                    break;
+                }
+                frame_log.log_stat("Sent frame (%" PRIu64 " us)", FrameLog::get_time() - time_after);
             }
-            frame_log.log_stat("Frame of %zu bytes", frame.buffer_size);
-            frame_log.log_frame(frame.buffer, frame.buffer_size);
+        }
 
-            try {
-                spice_stream_send_frame(stream_port, frame.buffer, frame.buffer_size);
-            } catch (const WriteError& e) {
-                syslog(e);
-                break;
+        if (pipelined) {
+            queue.close();
+            sender.join();
+            if (queue.dropped()) {
+                syslog(LOG_DEBUG, "dropped %u stale frames", queue.dropped());
+            }
+            if (sending_error) {
+                std::rethrow_exception(sending_error);
             }
-            frame_log.log_stat("Sent frame");
-
-            read_command(stream_port, false);
         }
+
+        agent.ReleaseFrameCapture(std::move(capture));
     }
 }
 
@@ -332,6 +474,11 @@ int main(int argc, char* argv[])
     const char *log_filename = NULL;
     bool log_binary = false;
     bool log_frames = false;
+    bool pipelined = false;
+    bool cursor_position = false;
+    std::string capture_output;
+    const char *metrics_file = nullptr;
+    unsigned long metrics_interval = 10;
     const char *pluginsdir = PLUGINSDIR;
     enum {
         OPT_first = UCHAR_MAX,
@@ -371,6 +518,35 @@ int main(int argc, char* argv[])
                 usage(argv[0]);
             }
             *p++ = '\0';
+            if (strcmp(optarg, "pipeline") == 0) {
+                if (!parse_switch(optarg, p, pipelined)) {
+                    usage(argv[0]);
+                }
+            } else if (strcmp(optarg, "rate-control") == 0) {
+                if (!parse_switch(optarg, p, rate_control)) {
+                    usage(argv[0]);
+                }
+            } else if (strcmp(optarg, "cursor.position") == 0) {
+                if (!parse_switch(optarg, p, cursor_position)) {
+                    usage(argv[0]);
+                }
+            } else if (strcmp(optarg, "scene.switching") == 0) {
+                if (!parse_switch(optarg, p, scene_switching)) {
+                    usage(argv[0]);
+                }
+            } else if (strcmp(optarg, "capture.output") == 0) {
+                capture_output = strcmp(p, "all") == 0 ? "" : p;
+            } else if (strcmp(optarg, "metrics.file") == 0) {
+                metrics_file = p;
+            } else if (strcmp(optarg, "metrics.interval") == 0) {
+                char *end;
+                metrics_interval = strtoul(p, &end, 10);
+                if (*p == '\0' || *end != '\0' || metrics_interval == 0 ||
+                    metrics_interval > UINT_MAX / 1000) {
+                    syslog(LOG_ERR, "Invalid value '%s' for option 'metrics.interval'", p);
+                    usage(argv[0]);
+                }
+            }
             agent.AddOption(optarg, p);
             break;
         }
@@ -398,14 +574,22 @@ int main(int argc, char* argv[])
         }
     }
 
-    register_interrupts();
-
     try {
+        // before any thread is created, so the signals are only received by the loop
+        EventLoop loop;
+        loop.watch_signals({SIGINT, SIGTERM}, [&loop](int signal) {
+            syslog(LOG_INFO, "Got signal %d, exiting", signal);
+            loop.stop();
+        });
+
         // register built-in plugins
         MjpegPlugin::Register(&agent);
 
         agent.LoadPlugins(pluginsdir);
 
+        // get the capture ready while waiting for the client
+        agent.PrepareFrameCapture(agent.SupportedCodecs());
+
         FrameLog frame_log(log_filename, log_binary, log_frames);
 
         for (const std::string& arg: old_args) {
@@ -415,10 +599,55 @@ int main(int argc, char* argv[])
 
         StreamPort stream_port(stream_port_name);
 
-        std::thread cursor_updater{CursorUpdater(&stream_port)};
+        StreamWriter stream_writer(stream_port);
+
+        std::thread cursor_updater{CursorUpdater(&stream_writer, cursor_position, capture_output,
+                                                  &stream_size, &agent.GetMetrics())};
         cursor_updater.detach();
 
-        do_capture(stream_port, frame_log);
+        loop.add(stream_port.fd, [&stream_port, &stream_writer] {
+            read_command_from_device(stream_port, stream_writer);
+        });
+        if (metrics_file) {
+            loop.add_timer(metrics_interval * 1000, [metrics_file] { dump_metrics(metrics_file); });
+        }
+        std::unique_ptr<SceneMonitor> scene_monitor;
+        if (scene_switching) {
+            try {
+                scene_monitor.reset(new SceneMonitor(capture_output));
+            } catch (const std::exception &e) {
+                syslog(LOG_WARNING, "Cannot track screen changes, scene switching disabled: %s",
+                       e.what());
+                scene_switching = false;
+            }
+        }
+        if (scene_monitor) {
+            SceneMonitor *monitor = scene_monitor.get();
+            loop.add_timer(SceneMonitor::sample_interval_ms, [monitor] {
+                if (monitor->sample()) {
+                    current_scene = monitor->scene();
+                }
+            });
+        }
+
+        std::exception_ptr events_error;
+        std::thread event_thread(handle_events, std::ref(loop), std::ref(events_error));
+
+        try {
+            do_capture(stream_writer, frame_log, pipelined);
+        } catch (...) {
+            loop.stop();
+            event_thread.join();
+            throw;
+        }
+        loop.stop();
+        event_thread.join();
+        if (metrics_file) {
+            dump_metrics(metrics_file);
+        }
+        if (events_error) {
+            std::rethrow_exception(events_error);
+        }
     }
     catch (std::exception &err) {
         syslog(LOG_ERR, "%s", err.what());
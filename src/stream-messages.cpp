@@ -0,0 +1,73 @@
+/* The stream messages sent by the agent, shared with the tools replaying
+ * streams.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "stream-messages.hpp"
+
+#include <spice/stream-device.h>
+
+#include <string.h>
+#include <syslog.h>
+#include <sys/uio.h>
+
+
+namespace spice {
+namespace streaming_agent {
+
+struct SpiceStreamFormatMessage
+{
+    StreamDevHeader hdr;
+    StreamMsgFormat msg;
+};
+
+struct SpiceStreamDataMessage
+{
+    StreamDevHeader hdr;
+    StreamMsgData msg;
+};
+
+void spice_stream_send_format(StreamWriter &stream_writer, unsigned w, unsigned h, unsigned c)
+{
+
+    SpiceStreamFormatMessage msg;
+    const size_t msgsize = sizeof(msg);
+    const size_t hdrsize  = sizeof(msg.hdr);
+    memset(&msg, 0, msgsize);
+    msg.hdr.protocol_version = STREAM_DEVICE_PROTOCOL;
+    msg.hdr.type = STREAM_TYPE_FORMAT;
+    msg.hdr.size = msgsize - hdrsize; /* includes only the body? */
+    msg.msg.width = w;
+    msg.msg.height = h;
+    msg.msg.codec = c;
+
+    syslog(LOG_DEBUG, "writing format");
+    struct iovec iov = { &msg, msgsize };
+    stream_writer.write(&iov, 1);
+}
+
+void spice_stream_send_frame(StreamWriter &stream_writer, const void *buf, const unsigned size)
+{
+    SpiceStreamDataMessage msg;
+    const size_t msgsize = sizeof(msg);
+
+    memset(&msg, 0, msgsize);
+    msg.hdr.protocol_version = STREAM_DEVICE_PROTOCOL;
+    msg.hdr.type = STREAM_TYPE_DATA;
+    msg.hdr.size = size; /* includes only the body? */
+
+    // send header and data with a single system call when possible
+    struct iovec iov[] = {
+        { &msg, msgsize },
+        { const_cast<void *>(buf), size },
+    };
+
+    stream_writer.write(iov, 2);
+
+    syslog(LOG_DEBUG, "Sent a frame of size %u", size);
+}
+
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,23 @@
+/* The stream messages sent by the agent, shared with the tools replaying
+ * streams.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_STREAM_MESSAGES_HPP
+#define SPICE_STREAMING_AGENT_STREAM_MESSAGES_HPP
+
+#include "stream-writer.hpp"
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*! Start a stream, the following frames have the given size and codec */
+void spice_stream_send_format(StreamWriter &stream_writer, unsigned w, unsigned h, unsigned c);
+void spice_stream_send_frame(StreamWriter &stream_writer, const void *buf, const unsigned size);
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_STREAM_MESSAGES_HPP
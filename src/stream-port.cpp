@@ -12,8 +12,12 @@
 #include <poll.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
+#include <limits.h>
+#include <algorithm>
 #include <stdexcept>
+#include <vector>
 
 
 namespace spice {
@@ -26,6 +30,10 @@ StreamPort::StreamPort(const std::string &port_name) : fd(open(port_name.c_str()
     }
 }
 
+StreamPort::StreamPort(int fd) : fd(fd)
+{
+}
+
 StreamPort::~StreamPort()
 {
     close(fd);
@@ -38,7 +46,13 @@ void StreamPort::read(void *buf, size_t len)
 
 void StreamPort::write(const void *buf, size_t len)
 {
-    write_all(fd, buf, len);
+    struct iovec iov = { const_cast<void *>(buf), len };
+    blocked_time += writev_all(fd, &iov, 1);
+}
+
+void StreamPort::writev(const struct iovec *iov, size_t iovcnt)
+{
+    blocked_time += writev_all(fd, iov, iovcnt);
 }
 
 void read_all(int fd, void *buf, size_t len)
@@ -80,39 +94,88 @@ void read_all(int fd, void *buf, size_t len)
     }
 }
 
-void write_all(int fd, const void *buf, size_t len)
+static uint64_t get_time()
 {
-    while (len > 0) {
-        ssize_t n = write(fd, buf, len);
+    timespec now;
 
-        if (n < 0) {
-            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
-                struct pollfd pollfd = {fd, POLLOUT, 0};
-                if (poll(&pollfd, 1, -1) < 0) {
-                    if (errno == EINTR) {
-                        continue;
-                    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-                    throw WriteError("poll failed while writing message to device", errno);
-                }
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
 
-                if (pollfd.revents & POLLOUT) {
-                    continue;
-                }
+// wait till the device can be written, throws WriteError if it was closed
+static void wait_writable(int fd)
+{
+    struct pollfd pollfd = {fd, POLLOUT, 0};
+    while (poll(&pollfd, 1, -1) < 0) {
+        if (errno != EINTR) {
+            throw WriteError("poll failed while writing message to device", errno);
+        }
+    }
 
-                if (pollfd.revents & POLLHUP) {
-                    throw WriteError("Writing message to device failed: The device is closed.");
-                }
+    if (pollfd.revents & POLLOUT) {
+        return;
+    }
+
+    if (pollfd.revents & POLLHUP) {
+        throw WriteError("Writing message to device failed: The device is closed.");
+    }
+
+    throw WriteError("Writing message to device failed: poll returned " +
+                     std::to_string(pollfd.revents));
+}
+
+void write_all(int fd, const void *buf, size_t len)
+{
+    struct iovec iov = { const_cast<void *>(buf), len };
+    writev_all(fd, &iov, 1);
+}
+
+uint64_t writev_all(int fd, const struct iovec *iov, size_t iovcnt)
+{
+    uint64_t blocked_time = 0;
+
+    // skip empty buffers, the remaining ones are copied as they are
+    // modified to handle partial writes
+    std::vector<struct iovec> vecs;
+    vecs.reserve(iovcnt);
+    for (size_t i = 0; i < iovcnt; ++i) {
+        if (iov[i].iov_len > 0) {
+            vecs.push_back(iov[i]);
+        }
+    }
 
-                throw WriteError("Writing message to device failed: poll returned " +
-                                 std::to_string(pollfd.revents));
+    struct iovec *cur = vecs.data();
+    size_t left = vecs.size();
+    while (left > 0) {
+        ssize_t n = ::writev(fd, cur, std::min<size_t>(left, IOV_MAX));
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                const uint64_t wait_start = get_time();
+                wait_writable(fd);
+                blocked_time += get_time() - wait_start;
+                continue;
             }
             throw WriteError("Writing message to device failed", errno);
         }
 
-        len -= n;
-        buf = (uint8_t *) buf + n;
+        // skip the buffers completely written and advance in the partial one
+        while (left > 0 && (size_t) n >= cur->iov_len) {
+            n -= cur->iov_len;
+            ++cur;
+            --left;
+        }
+        if (left > 0) {
+            cur->iov_base = (uint8_t *) cur->iov_base + n;
+            cur->iov_len -= n;
+        }
     }
+
+    return blocked_time;
 }
 
 }} // namespace spice::streaming_agent
@@ -7,9 +7,11 @@
 #ifndef SPICE_STREAMING_AGENT_STREAM_PORT_HPP
 #define SPICE_STREAMING_AGENT_STREAM_PORT_HPP
 
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
 #include <string>
-#include <mutex>
+#include <sys/uio.h>
 
 
 namespace spice {
@@ -18,17 +20,25 @@ namespace streaming_agent {
 class StreamPort {
 public:
     StreamPort(const std::string &port_name);
+    /*! Use an open non blocking file descriptor, e.g. a socket, it is
+     * closed with the port */
+    explicit StreamPort(int fd);
     ~StreamPort();
 
     void read(void *buf, size_t len);
     void write(const void *buf, size_t len);
+    /*! Write a message made of multiple buffers, using as few system calls as possible */
+    void writev(const struct iovec *iov, size_t iovcnt);
 
     int fd;
-    std::mutex mutex;
+    /*! Total time write() and writev() waited for the device, in ns */
+    std::atomic<uint64_t> blocked_time{0};
 };
 
 void read_all(int fd, void *buf, size_t len);
 void write_all(int fd, const void *buf, size_t len);
+/*! \return the time spent waiting for the device, in ns */
+uint64_t writev_all(int fd, const struct iovec *iov, size_t iovcnt);
 
 }} // namespace spice::streaming_agent
 
@@ -0,0 +1,123 @@
+/* A thread writing the messages to the streaming virtio port.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "stream-writer.hpp"
+#include "error.hpp"
+
+#include <syslog.h>
+
+
+namespace spice {
+namespace streaming_agent {
+
+StreamWriter::StreamWriter(StreamPort &stream_port) :
+    stream_port(stream_port),
+    thread(&StreamWriter::run, this)
+{
+}
+
+StreamWriter::~StreamWriter()
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        stopping = true;
+        cond.notify_all();
+    }
+    thread.join();
+}
+
+void StreamWriter::post(const struct iovec *iov, size_t iovcnt, unsigned coalesce)
+{
+    Message message;
+    for (size_t i = 0; i < iovcnt; ++i) {
+        const uint8_t *base = static_cast<const uint8_t *>(iov[i].iov_base);
+        message.data.insert(message.data.end(), base, base + iov[i].iov_len);
+    }
+    message.coalesce = coalesce;
+
+    std::lock_guard<std::mutex> guard(mutex);
+    if (coalesce) {
+        for (auto &queued: messages) {
+            if (queued.coalesce == coalesce) {
+                queued.data.swap(message.data);
+                return;
+            }
+        }
+    }
+    messages.push_back(std::move(message));
+    cond.notify_all();
+}
+
+void StreamWriter::write(const struct iovec *iov, size_t iovcnt)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    // a single large message at a time
+    cond.wait(lock, [this]{ return !large_iov; });
+    if (error) {
+        std::exception_ptr failure;
+        failure.swap(error);
+        std::rethrow_exception(failure);
+    }
+
+    large_iov = iov;
+    large_iovcnt = iovcnt;
+    cond.notify_all();
+    cond.wait(lock, [this]{ return !large_iov; });
+
+    if (error) {
+        std::exception_ptr failure;
+        failure.swap(error);
+        std::rethrow_exception(failure);
+    }
+}
+
+void StreamWriter::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cond.wait(lock, [this]{ return stopping || !messages.empty() || large_iov; });
+
+        // the messages still queued are dropped, the device may not be read anymore
+        if (stopping) {
+            return;
+        }
+
+        if (!messages.empty()) {
+            Message message(std::move(messages.front()));
+            messages.pop_front();
+
+            // the lock is only held to take the messages, not to write them
+            lock.unlock();
+            try {
+                stream_port.write(message.data.data(), message.data.size());
+            } catch (const WriteError &e) {
+                syslog(e);
+                lock.lock();
+                error = std::current_exception();
+                continue;
+            }
+            lock.lock();
+        } else {
+            const struct iovec *iov = large_iov;
+            const size_t iovcnt = large_iovcnt;
+            lock.unlock();
+            std::exception_ptr failure;
+            try {
+                stream_port.writev(iov, iovcnt);
+            } catch (const WriteError &) {
+                failure = std::current_exception();
+            }
+            lock.lock();
+            if (failure) {
+                error = failure;
+            }
+            large_iov = nullptr;
+            cond.notify_all();
+        }
+    }
+}
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,75 @@
+/* A thread writing the messages to the streaming virtio port.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_STREAM_WRITER_HPP
+#define SPICE_STREAMING_AGENT_STREAM_WRITER_HPP
+
+#include "stream-port.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*! Writes the messages of all the threads to the device from a single thread.
+ *
+ * Small messages, like the cursor and the replies to the server, are posted
+ * without waiting and written before the frames waiting to be written. The
+ * protocol does not allow to interleave them in the middle of a frame, they
+ * wait at most for the frame being written.
+ */
+class StreamWriter
+{
+public:
+    StreamWriter(StreamPort &stream_port);
+    ~StreamWriter();
+
+    /*! Queue a small message, the buffers are copied.
+     * A message still queued with the same non zero coalesce key is replaced,
+     * for instance only the last cursor shape matters.
+     */
+    void post(const struct iovec *iov, size_t iovcnt, unsigned coalesce = 0);
+
+    /*! Write a large message, like a frame, after the posted ones.
+     * The buffers are not copied, this waits until the message is written.
+     * \throw WriteError if this or a previously posted message could not be written
+     */
+    void write(const struct iovec *iov, size_t iovcnt);
+
+    /*! Total time spent waiting for the device, see StreamPort::blocked_time */
+    uint64_t blocked_time() const { return stream_port.blocked_time; }
+
+private:
+    struct Message
+    {
+        std::vector<uint8_t> data;
+        unsigned coalesce;
+    };
+
+    void run();
+
+    StreamPort &stream_port;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<Message> messages;
+    // the message passed to write(), nullptr once written
+    const struct iovec *large_iov = nullptr;
+    size_t large_iovcnt = 0;
+    std::exception_ptr error;
+    bool stopping = false;
+    std::thread thread;
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_STREAM_WRITER_HPP
@@ -0,0 +1,125 @@
+/* The unit test for the cache of the plugins' capabilities.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fstream>
+
+#include "capability-cache.hpp"
+
+
+namespace ssa = spice::streaming_agent;
+
+namespace {
+
+void touch(const std::string &filename, long seconds)
+{
+    std::ofstream(filename.c_str());
+    struct timeval times[2] = { { seconds, 0 }, { seconds, 0 } };
+    utimes(filename.c_str(), times);
+}
+
+}
+
+SCENARIO("test saving the capabilities", "[capability-cache]") {
+    GIVEN("A cache depending on a file") {
+        char dir[] = "/tmp/test-capability-cache-XXXXXX";
+        REQUIRE(mkdtemp(dir));
+        // the directory of the cache is created
+        const std::string filename = std::string(dir) + "/cache/plugin.cache";
+        const std::string dependency = std::string(dir) + "/plugin.so";
+        const std::string missing = std::string(dir) + "/missing";
+        touch(dependency, 1000);
+
+        std::string value;
+        {
+            ssa::CapabilityCache cache(filename, {dependency, missing});
+            CHECK(!cache.lookup("encoder", value));
+            cache.store("encoder", "x264enc");
+            cache.store("none", "");
+            REQUIRE(cache.lookup("encoder", value));
+            CHECK(value == "x264enc");
+        }
+
+        WHEN("the dependencies did not change") {
+            ssa::CapabilityCache cache(filename, {dependency, missing});
+
+            THEN("the entries are read back") {
+                REQUIRE(cache.lookup("encoder", value));
+                CHECK(value == "x264enc");
+                REQUIRE(cache.lookup("none", value));
+                CHECK(value == "");
+            }
+
+            THEN("removed entries are not saved") {
+                cache.remove("encoder");
+                CHECK(!cache.lookup("encoder", value));
+                ssa::CapabilityCache reloaded(filename, {dependency, missing});
+                CHECK(!reloaded.lookup("encoder", value));
+                CHECK(reloaded.lookup("none", value));
+            }
+        }
+
+        WHEN("a dependency was modified") {
+            touch(dependency, 2000);
+            ssa::CapabilityCache cache(filename, {dependency, missing});
+
+            THEN("the entries are dropped") {
+                CHECK(!cache.lookup("encoder", value));
+                CHECK(!cache.lookup("none", value));
+            }
+        }
+
+        WHEN("a missing dependency was created") {
+            touch(missing, 1000);
+            ssa::CapabilityCache cache(filename, {dependency, missing});
+
+            THEN("the entries are dropped") {
+                CHECK(!cache.lookup("encoder", value));
+            }
+            unlink(missing.c_str());
+        }
+
+        WHEN("the list of dependencies changed") {
+            ssa::CapabilityCache cache(filename, {dependency});
+
+            THEN("the entries are dropped") {
+                CHECK(!cache.lookup("encoder", value));
+            }
+        }
+
+        WHEN("the file is not a cache") {
+            std::ofstream(filename.c_str()) << "encoder=x264enc\n";
+            ssa::CapabilityCache cache(filename, {dependency, missing});
+
+            THEN("it is ignored") {
+                CHECK(!cache.lookup("encoder", value));
+            }
+        }
+
+        unlink(filename.c_str());
+        rmdir((std::string(dir) + "/cache").c_str());
+        unlink(dependency.c_str());
+        rmdir(dir);
+    }
+}
+
+SCENARIO("test a cache without file", "[capability-cache]") {
+    GIVEN("A cache with an empty file name") {
+        ssa::CapabilityCache cache("", {});
+
+        THEN("the entries are only kept in memory") {
+            std::string value;
+            cache.store("encoder", "vah264enc");
+            REQUIRE(cache.lookup("encoder", value));
+            CHECK(value == "vah264enc");
+        }
+    }
+}
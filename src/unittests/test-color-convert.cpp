@@ -0,0 +1,121 @@
+/* The unit test for the conversion of the frames to YUV.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+
+#include "color-convert.hpp"
+
+#include <random>
+#include <vector>
+
+
+namespace ssa = spice::streaming_agent;
+
+namespace {
+
+struct Image
+{
+    Image(unsigned width, unsigned height, ssa::YuvFormat format) :
+        luma(width * height), chroma((width + 1) / 2 * ((height + 1) / 2) * 2)
+    {
+        const size_t chroma_width = (width + 1) / 2;
+        planes.data[0] = luma.data();
+        planes.stride[0] = width;
+        planes.data[1] = chroma.data();
+        if (format == ssa::YuvFormat::NV12) {
+            planes.stride[1] = chroma_width * 2;
+            planes.data[2] = nullptr;
+            planes.stride[2] = 0;
+        } else {
+            planes.stride[1] = planes.stride[2] = chroma_width;
+            planes.data[2] = chroma.data() + chroma.size() / 2;
+        }
+    }
+
+    std::vector<uint8_t> luma, chroma;
+    ssa::YuvPlanes planes;
+};
+
+std::vector<uint8_t> random_frame(unsigned width, unsigned height)
+{
+    std::mt19937 generator(width * height);
+    std::uniform_int_distribution<int> distribution(0, 255);
+    std::vector<uint8_t> frame(width * height * 4);
+    for (auto &byte: frame) {
+        byte = distribution(generator);
+    }
+    return frame;
+}
+
+}
+
+SCENARIO("test converting frames to YUV", "[color][yuv]") {
+    GIVEN("converters with and without SIMD") {
+        ssa::ColorConverter simd(1), plain(1, false), threaded(3);
+        const ssa::YuvFormat formats[] = {ssa::YuvFormat::I420, ssa::YuvFormat::NV12};
+
+        WHEN("converting a frame of plain colors") {
+            const unsigned width = 64, height = 2;
+            std::vector<uint8_t> frame(width * height * 4);
+            for (unsigned n = 0; n < width * height; ++n) {
+                // white, black and red pairs of columns
+                static const uint8_t colors[3][4] = {
+                    {255, 255, 255, 0}, {0, 0, 0, 0}, {0, 0, 255, 0}
+                };
+                const uint8_t *color = colors[n % width / 2 % 3];
+                std::copy(color, color + 4, &frame[n * 4]);
+            }
+
+            THEN("the colors are converted with limited range BT.709") {
+                for (auto format: formats) {
+                    Image image(width, height, format);
+                    simd.convert(frame.data(), width * 4, width, height, format, image.planes);
+                    CHECK(image.luma[0] == 235);
+                    CHECK(image.luma[2] == 16);
+                    CHECK(image.luma[4] == 63);
+                    CHECK(image.luma[width + 4] == 63);
+
+                    const bool nv12 = format == ssa::YuvFormat::NV12;
+                    const unsigned step = nv12 ? 2 : 1;
+                    const uint8_t *u = image.planes.data[1];
+                    const uint8_t *v = nv12 ? u + 1 : image.planes.data[2];
+                    CHECK((u[0] == 128 && v[0] == 128));
+                    CHECK((u[step] == 128 && v[step] == 128));
+                    CHECK((u[2 * step] == 102 && v[2 * step] == 240));
+                }
+            }
+        }
+
+        WHEN("converting random frames") {
+            THEN("the SIMD kernels and the threads give the same result as the C code") {
+                const std::pair<unsigned, unsigned> sizes[] = {
+                    {67, 37}, {32, 2}, {1, 1}, {250, 301}
+                };
+                for (auto format: formats) {
+                    for (auto size: sizes) {
+                        const unsigned width = size.first, height = size.second;
+                        const std::vector<uint8_t> frame(random_frame(width, height));
+                        Image expected(width, height, format), image(width, height, format),
+                            threaded_image(width, height, format);
+                        plain.convert(frame.data(), width * 4, width, height, format,
+                                      expected.planes);
+                        simd.convert(frame.data(), width * 4, width, height, format,
+                                     image.planes);
+                        threaded.convert(frame.data(), width * 4, width, height, format,
+                                         threaded_image.planes);
+
+                        INFO("kernel " << simd.kernel_name() << ", size " << width << "x" << height);
+                        CHECK(image.luma == expected.luma);
+                        CHECK(image.chroma == expected.chroma);
+                        CHECK(threaded_image.luma == expected.luma);
+                        CHECK(threaded_image.chroma == expected.chroma);
+                    }
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,72 @@
+/* The unit test for the tracking of the changed areas between frames.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+
+#include "dirty-map.hpp"
+
+
+namespace ssa = spice::streaming_agent;
+
+SCENARIO("test tracking the dirty tiles of frames", "[dirty][tiles]") {
+    GIVEN("A dirty map and a frame") {
+        const unsigned width = 200, height = 50;
+        const size_t stride = width * 4;
+        std::vector<uint8_t> frame(stride * height, 0x55);
+        ssa::DirtyMap dirty_map;
+
+        unsigned dirty = dirty_map.update(frame.data(), width, height, stride);
+        CHECK(dirty == 16);
+        CHECK(dirty_map.columns() == 4);
+        CHECK(dirty_map.rows() == 4);
+
+        WHEN("the frame does not change") {
+            THEN("no tile is dirty") {
+                CHECK(dirty_map.update(frame.data(), width, height, stride) == 0);
+                CHECK(!dirty_map.rows_dirty(0, height));
+            }
+        }
+
+        WHEN("a pixel changes") {
+            frame[20 * stride + 70 * 4] = 0;
+            THEN("only the tile of the pixel is dirty") {
+                CHECK(dirty_map.update(frame.data(), width, height, stride) == 1);
+                CHECK(dirty_map.is_dirty(1, 1));
+                CHECK(!dirty_map.rows_dirty(0, 16));
+                CHECK(dirty_map.rows_dirty(16, 16));
+                CHECK(dirty_map.rows_dirty(0, 32));
+            }
+            THEN("the changed content is remembered") {
+                dirty_map.update(frame.data(), width, height, stride);
+                CHECK(dirty_map.update(frame.data(), width, height, stride) == 0);
+            }
+        }
+
+        WHEN("a pixel in the partial last tile changes") {
+            frame[(height - 1) * stride + (width - 1) * 4 + 3] = 0;
+            THEN("the last tile is dirty") {
+                CHECK(dirty_map.update(frame.data(), width, height, stride) == 1);
+                CHECK(dirty_map.is_dirty(3, 3));
+            }
+        }
+
+        WHEN("the frame size changes") {
+            dirty = dirty_map.update(frame.data(), width / 2, height, stride);
+            THEN("all the tiles are dirty") {
+                CHECK(dirty_map.columns() == 2);
+                CHECK(dirty == dirty_map.columns() * dirty_map.rows());
+            }
+        }
+
+        WHEN("the map is reset") {
+            dirty_map.reset();
+            THEN("all the tiles are dirty") {
+                CHECK(dirty_map.update(frame.data(), width, height, stride) == 16);
+            }
+        }
+    }
+}
@@ -0,0 +1,143 @@
+/* The unit test for the loop dispatching the events of file descriptors.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+#include <signal.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <thread>
+#include <sys/socket.h>
+
+#include "event-loop.hpp"
+
+
+namespace ssa = spice::streaming_agent;
+
+SCENARIO("test dispatching events", "[event-loop]") {
+    GIVEN("A loop watching a pipe") {
+        ssa::EventLoop loop;
+        int fds[2];
+        REQUIRE(pipe(fds) == 0);
+        std::string received;
+        loop.add(fds[0], [&] {
+            char c;
+            REQUIRE(read(fds[0], &c, 1) == 1);
+            received += c;
+            if (c == '.') {
+                loop.stop();
+            }
+        });
+
+        WHEN("data is written to the pipe") {
+            REQUIRE(write(fds[1], "ab.", 3) == 3);
+            loop.run();
+
+            THEN("the handler is called for each byte until it stops the loop") {
+                CHECK(received == "ab.");
+            }
+        }
+
+        WHEN("the loop is stopped by another thread") {
+            std::thread stopper([&loop] { loop.stop(); });
+            loop.run();
+            stopper.join();
+
+            THEN("run returns without any event") {
+                CHECK(received.empty());
+            }
+        }
+
+        WHEN("the pipe is removed from the loop") {
+            loop.remove(fds[0]);
+            REQUIRE(write(fds[1], "a", 1) == 1);
+            std::thread stopper([&loop] { loop.stop(); });
+            loop.run();
+            stopper.join();
+
+            THEN("its handler is not called anymore") {
+                CHECK(received.empty());
+            }
+        }
+
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    GIVEN("A loop with a timer") {
+        ssa::EventLoop loop;
+        unsigned ticks = 0;
+        loop.add_timer(5, [&] {
+            if (++ticks == 3) {
+                loop.stop();
+            }
+        });
+
+        WHEN("the loop runs") {
+            loop.run();
+
+            THEN("the timer fires repeatedly") {
+                CHECK(ticks == 3);
+            }
+        }
+    }
+
+    GIVEN("A loop watching signals") {
+        ssa::EventLoop loop;
+        int received = 0;
+        loop.watch_signals({SIGUSR1}, [&](int signal) {
+            received = signal;
+            loop.stop();
+        });
+
+        WHEN("a signal is raised") {
+            REQUIRE(raise(SIGUSR1) == 0);
+            loop.run();
+
+            THEN("it is handled by the loop instead of killing the process") {
+                CHECK(received == SIGUSR1);
+            }
+        }
+    }
+
+    GIVEN("A loop watching a socket whose peer is closed") {
+        ssa::EventLoop loop;
+        int fds[2];
+        REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        std::string received;
+        // like reading a device command, the end of file is an error
+        loop.add(fds[0], [&] {
+            char c;
+            if (read(fds[0], &c, 1) != 1) {
+                throw std::runtime_error("end of file");
+            }
+            received += c;
+        });
+        // past a couple of checks of the hung up socket
+        loop.add_timer(ssa::EventLoop::min_hangup_retry_ms * 3 + 50, [&] { loop.stop(); });
+
+        WHEN("nothing is left to read") {
+            close(fds[1]);
+
+            THEN("the handler is not called and the loop does not throw") {
+                REQUIRE_NOTHROW(loop.run());
+                CHECK(received.empty());
+            }
+        }
+
+        WHEN("data was written before closing") {
+            REQUIRE(write(fds[1], "ab", 2) == 2);
+            close(fds[1]);
+
+            THEN("the data is read, then the handler is not called anymore") {
+                REQUIRE_NOTHROW(loop.run());
+                CHECK(received == "ab");
+            }
+        }
+
+        close(fds[0]);
+    }
+}
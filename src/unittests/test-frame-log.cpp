@@ -0,0 +1,95 @@
+/* The unit test for the logger of frames and time information.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "frame-log.hpp"
+
+
+namespace ssa = spice::streaming_agent;
+
+namespace {
+
+std::string read_file(const char *name)
+{
+    std::ifstream file(name, std::ios::binary);
+    std::stringstream content;
+    content << file.rdbuf();
+    return content.str();
+}
+
+} // namespace
+
+SCENARIO("test logging frames", "[log]") {
+    char name[] = "/tmp/test-frame-log-XXXXXX";
+    int fd = mkstemp(name);
+    REQUIRE(fd >= 0);
+    close(fd);
+
+    GIVEN("A text log") {
+        {
+            ssa::FrameLog log(name, false, false);
+            for (unsigned i = 0; i < 100; ++i) {
+                log.log_stat("stat %u", i);
+            }
+            log.log_frame("frame", 5);
+            CHECK(log.dropped() == 0);
+        }
+
+        THEN("the stats are written in order with increasing times once the log is closed") {
+            std::istringstream lines(read_file(name));
+            std::string line;
+            uint64_t last_time = 0;
+            for (unsigned i = 0; i < 100; ++i) {
+                REQUIRE(std::getline(lines, line));
+                const size_t separator = line.find(": ");
+                REQUIRE(separator != std::string::npos);
+                const uint64_t time = std::stoull(line.substr(0, separator));
+                CHECK(time >= last_time);
+                last_time = time;
+                CHECK(line.substr(separator + 2) == "stat " + std::to_string(i));
+            }
+            CHECK_FALSE(std::getline(lines, line));
+        }
+    }
+
+    GIVEN("A binary log") {
+        {
+            ssa::FrameLog log(name, true, false);
+            log.log_stat("indexed");
+            log.log_frame("first", 5);
+            log.log_frame("second", 6);
+        }
+        const std::string index_name = std::string(name) + ssa::FrameLog::index_suffix;
+
+        THEN("only the frames are written") {
+            CHECK(read_file(name) == "firstsecond");
+        }
+
+        THEN("the index holds the stats and the size of the frames") {
+            std::istringstream lines(read_file(index_name.c_str()));
+            std::string line;
+            for (const char *expected: {"indexed", "frame 5", "frame 6"}) {
+                REQUIRE(std::getline(lines, line));
+                const size_t separator = line.find(": ");
+                REQUIRE(separator != std::string::npos);
+                CHECK(line.substr(separator + 2) == expected);
+            }
+            CHECK_FALSE(std::getline(lines, line));
+        }
+
+        unlink(index_name.c_str());
+    }
+
+    unlink(name);
+}
@@ -0,0 +1,159 @@
+/* The unit test for the queue of frames used by the pipelined mode.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+#include <thread>
+
+#include "frame-queue.hpp"
+#include "frame-buffer-pool.hpp"
+
+
+namespace ssa = spice::streaming_agent;
+
+namespace {
+
+ssa::FrameInfo make_frame(const char *data, bool stream_start = false)
+{
+    ssa::FrameInfo frame;
+    frame.size = {16, 16};
+    frame.buffer = data;
+    frame.buffer_size = strlen(data);
+    frame.stream_start = stream_start;
+    return frame;
+}
+
+std::string data_of(const ssa::QueuedFrame &frame)
+{
+    return std::string(frame.data, frame.data + frame.data_size);
+}
+
+} // namespace
+
+SCENARIO("test queuing frames", "[queue]") {
+    GIVEN("A queue holding a single frame") {
+        ssa::FrameQueue queue(1);
+        ssa::QueuedFrame frame;
+
+        WHEN("a frame is pushed") {
+            REQUIRE(queue.push(make_frame("first", true), SPICE_VIDEO_CODEC_TYPE_MJPEG, 42, true));
+
+            THEN("the frame is copied in the queue") {
+                REQUIRE(queue.pop(frame));
+                CHECK(data_of(frame) == "first");
+                CHECK(frame.stream_start);
+                CHECK(frame.codec == SPICE_VIDEO_CODEC_TYPE_MJPEG);
+                CHECK(frame.capture_time == 42);
+                CHECK(frame.size.width == 16);
+            }
+        }
+
+        WHEN("frames are pushed faster than popped and can be dropped") {
+            REQUIRE(queue.push(make_frame("first", true), SPICE_VIDEO_CODEC_TYPE_MJPEG, 1, true));
+            REQUIRE(queue.push(make_frame("second"), SPICE_VIDEO_CODEC_TYPE_MJPEG, 2, true));
+
+            THEN("only the newest frame is kept, still starting the stream") {
+                CHECK(queue.dropped() == 1);
+                REQUIRE(queue.pop(frame));
+                CHECK(data_of(frame) == "second");
+                CHECK(frame.stream_start);
+            }
+        }
+
+        WHEN("frames cannot be dropped") {
+            REQUIRE(queue.push(make_frame("first"), SPICE_VIDEO_CODEC_TYPE_H264, 1, false));
+            std::thread consumer([&queue] {
+                ssa::QueuedFrame frame;
+                queue.pop(frame);
+                queue.release(frame);
+            });
+            REQUIRE(queue.push(make_frame("second"), SPICE_VIDEO_CODEC_TYPE_H264, 2, false));
+            consumer.join();
+
+            THEN("push waits for room and no frame is lost") {
+                CHECK(queue.dropped() == 0);
+                REQUIRE(queue.pop(frame));
+                CHECK(data_of(frame) == "second");
+            }
+        }
+
+        WHEN("the queue is closed") {
+            queue.close();
+
+            THEN("no frame can be pushed or popped") {
+                CHECK(!queue.push(make_frame("first"), SPICE_VIDEO_CODEC_TYPE_H264, 1, false));
+                CHECK(!queue.pop(frame));
+            }
+        }
+    }
+}
+
+SCENARIO("test lending frame buffers", "[queue][pool]") {
+    GIVEN("A pool of two buffers") {
+        ssa::FrameBufferPool pool(2);
+
+        WHEN("all the buffers are lent") {
+            ssa::FrameBuffer *first = pool.Acquire(100);
+            ssa::FrameBuffer *second = pool.Acquire(200);
+
+            THEN("they are large enough and no more buffers are available") {
+                REQUIRE(first);
+                REQUIRE(second);
+                CHECK(first != second);
+                CHECK(first->Capacity() >= 100);
+                CHECK(second->Capacity() >= 200);
+                CHECK(!pool.Acquire(10));
+            }
+
+            THEN("a released buffer is reused") {
+                first->Unref();
+                ssa::FrameBuffer *buffer = pool.Acquire(150);
+                CHECK(buffer == first);
+                CHECK(buffer->Capacity() >= 150);
+            }
+
+            THEN("a buffer is only reused after its last reference is released") {
+                first->Ref();
+                first->Unref();
+                CHECK(!pool.Acquire(10));
+                first->Unref();
+                CHECK(pool.Acquire(10) == first);
+            }
+
+            THEN("lent buffers are found from their content") {
+                ssa::FrameBuffer *found = pool.Ref(second->Data() + 10);
+                CHECK(found == second);
+                CHECK(!pool.Ref(&pool));
+            }
+        }
+    }
+
+    GIVEN("A queue using the pool") {
+        ssa::FrameBufferPool pool(2);
+        ssa::FrameQueue queue(1, &pool);
+        ssa::QueuedFrame frame;
+
+        WHEN("a frame stored in a lent buffer is pushed") {
+            ssa::FrameBuffer *buffer = pool.Acquire(16);
+            strcpy(reinterpret_cast<char *>(buffer->Data()), "pooled");
+            REQUIRE(queue.push(make_frame(reinterpret_cast<char *>(buffer->Data())),
+                               SPICE_VIDEO_CODEC_TYPE_MJPEG, 1, true));
+            // the capture is done with the buffer
+            buffer->Unref();
+
+            THEN("the frame is not copied and the buffer is kept till released") {
+                REQUIRE(queue.pop(frame));
+                CHECK(frame.data == buffer->Data());
+                CHECK(data_of(frame) == "pooled");
+                ssa::FrameBuffer *other = pool.Acquire(16);
+                CHECK(other != buffer);
+                queue.release(frame);
+                other->Unref();
+                CHECK(pool.Acquire(16) == buffer);
+            }
+        }
+    }
+}
@@ -0,0 +1,218 @@
+/* The unit test for the downscaling of the frames.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+
+#include "frame-scaler.hpp"
+
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+
+namespace ssa = spice::streaming_agent;
+
+namespace {
+
+std::vector<uint8_t> random_frame(unsigned width, unsigned height)
+{
+    std::mt19937 generator(width * height);
+    std::uniform_int_distribution<int> distribution(0, 255);
+    std::vector<uint8_t> frame(width * height * 4);
+    for (auto &byte: frame) {
+        byte = distribution(generator);
+    }
+    return frame;
+}
+
+std::vector<uint8_t> scale(ssa::FrameScaler &scaler, const std::vector<uint8_t> &frame,
+                           unsigned width, unsigned height,
+                           unsigned scaled_width, unsigned scaled_height)
+{
+    std::vector<uint8_t> scaled(scaled_width * scaled_height * 4);
+    scaler.scale(frame.data(), width * 4, width, height,
+                 scaled.data(), scaled_width * 4, scaled_width, scaled_height);
+    return scaled;
+}
+
+}
+
+SCENARIO("test scaling frames down", "[scale]") {
+    GIVEN("scalers with and without SIMD") {
+        ssa::FrameScaler simd(1), plain(1, false), threaded(3);
+
+        WHEN("halving a frame") {
+            const unsigned width = 8, height = 4;
+            std::vector<uint8_t> frame(width * height * 4);
+            for (unsigned n = 0; n < width * height; ++n) {
+                // the 2x2 blocks average to n / 2 % 4 * 10 + 1
+                const uint8_t value = n % width / 2 % 4 * 10 + (n % 2) * 2;
+                std::fill(&frame[n * 4], &frame[n * 4 + 4], value);
+            }
+
+            THEN("each pixel is the rounded average of the 4 pixels") {
+                const auto scaled = scale(simd, frame, width, height, width / 2, height / 2);
+                for (unsigned n = 0; n < width / 2 * height / 2; ++n) {
+                    CHECK(scaled[n * 4] == n % (width / 2) * 10 + 1);
+                    CHECK(scaled[n * 4 + 3] == n % (width / 2) * 10 + 1);
+                }
+            }
+        }
+
+        WHEN("halving random frames") {
+            THEN("SIMD and threads give the same result as the C code") {
+                // widths with and without leftover pixels for the kernels
+                for (unsigned width: {64u, 70u, 1920u}) {
+                    const unsigned height = 128;
+                    const auto frame = random_frame(width, height);
+                    const auto expected = scale(plain, frame, width, height, width / 2, height / 2);
+                    CHECK(scale(simd, frame, width, height, width / 2, height / 2) == expected);
+                    CHECK(scale(threaded, frame, width, height, width / 2, height / 2) == expected);
+                }
+            }
+        }
+
+        WHEN("scaling by another ratio") {
+            const unsigned width = 90, height = 60;
+            std::vector<uint8_t> frame(width * height * 4, 200);
+
+            THEN("a plain color is kept") {
+                const auto scaled = scale(simd, frame, width, height, 64, 42);
+                CHECK(scaled == std::vector<uint8_t>(64 * 42 * 4, 200));
+            }
+
+            THEN("threads give the same result") {
+                const auto random = random_frame(width, height);
+                CHECK(scale(threaded, random, width, height, 60, 40) ==
+                      scale(plain, random, width, height, 60, 40));
+            }
+        }
+
+        WHEN("the size does not change") {
+            const auto frame = random_frame(32, 16);
+
+            THEN("the frame is copied") {
+                CHECK(scale(simd, frame, 32, 16, 32, 16) == frame);
+            }
+        }
+
+        WHEN("the frame would be enlarged") {
+            std::vector<uint8_t> frame(16 * 16 * 4);
+            std::vector<uint8_t> scaled(32 * 16 * 4);
+
+            THEN("it is refused") {
+                CHECK_THROWS_AS(simd.scale(frame.data(), 16 * 4, 16, 16,
+                                           scaled.data(), 32 * 4, 32, 16),
+                                std::logic_error);
+            }
+        }
+    }
+}
+
+SCENARIO("test choosing the size of the stream", "[scale]") {
+    GIVEN("a maximum size") {
+        ssa::ScaleSettings settings;
+        REQUIRE(ssa::parse_scale_option(settings, "scale.max-size", "1920x1080"));
+        ssa::ScaleSelector selector(settings);
+
+        THEN("larger frames are scaled to fit, keeping the aspect ratio") {
+            ssa::FrameSize size = selector.size(3840, 2160, 1.0, 0);
+            CHECK(size.width == 1920);
+            CHECK(size.height == 1080);
+            size = selector.size(2560, 1600, 1.0, 0);
+            CHECK(size.width == 1728);
+            CHECK(size.height == 1080);
+        }
+
+        THEN("scaled sizes are even") {
+            const ssa::FrameSize size = selector.size(3001, 2001, 1.0, 0);
+            CHECK(size.width % 2 == 0);
+            CHECK(size.height % 2 == 0);
+            CHECK(size.width <= 1920);
+            CHECK(size.height <= 1080);
+        }
+
+        THEN("smaller frames are not scaled, even with an odd size") {
+            const ssa::FrameSize size = selector.size(1279, 719, 1.0, 0);
+            CHECK(size.width == 1279);
+            CHECK(size.height == 719);
+        }
+
+        THEN("the rate does not change the size") {
+            const ssa::FrameSize size = selector.size(1280, 720, 0.2, 0);
+            CHECK(size.width == 1280);
+        }
+    }
+
+    GIVEN("invalid options") {
+        ssa::ScaleSettings settings;
+
+        THEN("they are refused") {
+            CHECK_THROWS_AS(ssa::parse_scale_option(settings, "scale.max-size", "1920"),
+                            std::runtime_error);
+            CHECK_THROWS_AS(ssa::parse_scale_option(settings, "scale.max-size", "8x8"),
+                            std::runtime_error);
+            CHECK_THROWS_AS(ssa::parse_scale_option(settings, "scale.adaptive", "yes"),
+                            std::runtime_error);
+            CHECK(!ssa::parse_scale_option(settings, "capture.damage", "on"));
+            CHECK(!settings.enabled());
+        }
+    }
+
+    GIVEN("an adaptive size") {
+        ssa::ScaleSettings settings;
+        REQUIRE(ssa::parse_scale_option(settings, "scale.adaptive", "on"));
+        ssa::ScaleSelector selector(settings);
+        uint64_t time = 1000000;
+
+        THEN("the full size is used at the full rate") {
+            CHECK(selector.size(1920, 1080, 1.0, time).width == 1920);
+        }
+
+        WHEN("the rate is low") {
+            ssa::FrameSize size = selector.size(1920, 1080, 0.3, time);
+
+            THEN("the size is lowered by steps, each held for a while") {
+                CHECK(size.width == 1440);
+                CHECK(size.height == 810);
+                size = selector.size(1920, 1080, 0.3, time + ssa::ScaleSelector::hold_time - 1);
+                CHECK(size.width == 1440);
+                size = selector.size(1920, 1080, 0.3, time + ssa::ScaleSelector::hold_time);
+                CHECK(size.width == 960);
+                CHECK(size.height == 540);
+                // the smallest step
+                size = selector.size(1920, 1080, 0.3, time + 10 * ssa::ScaleSelector::hold_time);
+                CHECK(size.width == 960);
+            }
+
+            THEN("the size is raised once the rate recovered long enough") {
+                time += ssa::ScaleSelector::hold_time;
+                CHECK(selector.size(1920, 1080, 1.0, time).width == 1440);
+                time += ssa::ScaleSelector::raise_time - 1;
+                CHECK(selector.size(1920, 1080, 1.0, time).width == 1440);
+                CHECK(selector.size(1920, 1080, 1.0, time + 1).width == 1920);
+            }
+
+            THEN("a too large size is tried again later and later") {
+                uint64_t raise_time = ssa::ScaleSelector::raise_time;
+                for (unsigned n = 0; n < 3; ++n) {
+                    // wait for the raise, then go down right away
+                    const uint64_t start = time + ssa::ScaleSelector::hold_time;
+                    for (time = start; selector.step() == 1; time += 100000) {
+                        selector.size(1920, 1080, 1.0, time);
+                    }
+                    CHECK(time - start >= raise_time);
+                    CHECK(time - start <= raise_time + 100000);
+                    time += ssa::ScaleSelector::hold_time;
+                    selector.size(1920, 1080, 0.3, time);
+                    CHECK(selector.step() == 1);
+                    raise_time *= 2;
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,167 @@
+/* The unit test for the pacing of the frames.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+#include <time.h>
+
+#include "frame-scheduler.hpp"
+
+
+namespace ssa = spice::streaming_agent;
+
+namespace {
+
+const uint64_t ms = 1000000u;
+
+uint64_t get_time()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+} // namespace
+
+SCENARIO("test scheduling frames", "[scheduler]") {
+    GIVEN("A scheduler at 10 frames per second") {
+        ssa::FrameScheduler scheduler;
+        const uint64_t start = 1000 * ms;
+
+        THEN("the first frame is due immediately") {
+            CHECK(scheduler.next_deadline(start, 10) == start);
+        }
+
+        WHEN("frames take some time to be encoded") {
+            scheduler.next_deadline(start, 10);
+
+            THEN("the deadlines do not drift") {
+                CHECK(scheduler.next_deadline(start + 30 * ms, 10) == start + 100 * ms);
+                CHECK(scheduler.next_deadline(start + 170 * ms, 10) == start + 200 * ms);
+                CHECK(scheduler.next_deadline(start + 250 * ms, 10) == start + 300 * ms);
+            }
+
+            THEN("a late frame is followed by one on time") {
+                CHECK(scheduler.next_deadline(start + 150 * ms, 10) == start + 100 * ms);
+                CHECK(scheduler.next_deadline(start + 160 * ms, 10) == start + 200 * ms);
+            }
+        }
+
+        WHEN("a whole period was missed") {
+            scheduler.next_deadline(start, 10);
+            const uint64_t deadline = scheduler.next_deadline(start + 450 * ms, 10);
+            scheduler.woke_up(start + 450 * ms);
+
+            THEN("the schedule restarts instead of bursting") {
+                CHECK(deadline == start + 450 * ms);
+                CHECK(scheduler.next_deadline(start + 460 * ms, 10) == start + 550 * ms);
+                CHECK(scheduler.stats().missed == 1);
+            }
+        }
+
+        WHEN("a frame waited for the screen to change") {
+            scheduler.next_deadline(start, 10);
+            scheduler.woke_up(start);
+            // damage came after the deadlines of the next frames
+            scheduler.restart(start + 450 * ms);
+
+            THEN("the next frame is due a period later, not right away") {
+                CHECK(scheduler.next_deadline(start + 460 * ms, 10) == start + 550 * ms);
+                scheduler.woke_up(start + 550 * ms);
+                CHECK(scheduler.stats().missed == 0);
+                CHECK(scheduler.stats().frames == 2);
+            }
+        }
+
+        WHEN("a frame waited less than a period") {
+            scheduler.next_deadline(start, 10);
+            scheduler.restart(start + 50 * ms);
+
+            THEN("the schedule is kept") {
+                CHECK(scheduler.next_deadline(start + 60 * ms, 10) == start + 100 * ms);
+            }
+        }
+
+        WHEN("the frame rate changes") {
+            scheduler.next_deadline(start, 10);
+
+            THEN("the schedule restarts") {
+                CHECK(scheduler.next_deadline(start + 20 * ms, 20) == start + 20 * ms);
+                CHECK(scheduler.next_deadline(start + 30 * ms, 20) == start + 70 * ms);
+            }
+        }
+
+        WHEN("waking up after the deadlines") {
+            scheduler.next_deadline(start, 10);
+            scheduler.woke_up(start + 2 * ms);
+            scheduler.next_deadline(start + 10 * ms, 10);
+            scheduler.woke_up(start + 104 * ms);
+
+            THEN("the jitter is accounted") {
+                CHECK(scheduler.stats().frames == 2);
+                CHECK(scheduler.stats().max_jitter == 4 * ms);
+                CHECK(scheduler.stats().mean_jitter() == 3 * ms);
+            }
+        }
+    }
+
+    GIVEN("A scheduler at 100 frames per second") {
+        ssa::FrameScheduler scheduler;
+
+        WHEN("waiting for some frames") {
+            const uint64_t before = get_time();
+            for (unsigned n = 0; n < 6; ++n) {
+                scheduler.wait(100);
+            }
+            const uint64_t elapsed = get_time() - before;
+
+            THEN("the frames follow the rate") {
+                CHECK(elapsed >= 50 * ms);
+                CHECK(scheduler.stats().frames == 6);
+            }
+        }
+    }
+}
+
+SCENARIO("test waiting for the screen to settle", "[scheduler]") {
+    GIVEN("A timer waiting for 2 ms without changes, at most 10 ms") {
+        ssa::SettleTimer timer(2 * ms, 10 * ms);
+        const uint64_t start = 1000 * ms;
+        timer.start(start);
+
+        THEN("a single change settles after the quiet time") {
+            CHECK(timer.deadline() == start + 2 * ms);
+        }
+
+        WHEN("the frame is drawn in a few steps") {
+            timer.changed(start + 1 * ms);
+            timer.changed(start + 3 * ms);
+
+            THEN("it settles after the last one") {
+                CHECK(timer.deadline() == start + 5 * ms);
+            }
+        }
+
+        WHEN("the content keeps changing") {
+            for (uint64_t time = start; time < start + 20 * ms; time += ms) {
+                timer.changed(time);
+            }
+
+            THEN("the wait is bounded") {
+                CHECK(timer.deadline() == start + 10 * ms);
+            }
+        }
+    }
+
+    GIVEN("A maximum shorter than the quiet time") {
+        ssa::SettleTimer timer(2 * ms, 1 * ms);
+        timer.start(0);
+
+        THEN("the quiet time is still waited") {
+            CHECK(timer.deadline() == 2 * ms);
+        }
+    }
+}
@@ -0,0 +1,172 @@
+/* The unit test for the JPEG encoding functions.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+#include <jpeglib.h>
+
+#include "jpeg.hpp"
+
+
+namespace {
+
+std::vector<uint8_t> make_frame(unsigned width, unsigned height)
+{
+    std::vector<uint8_t> frame(width * height * 4);
+    for (unsigned y = 0; y < height; ++y) {
+        for (unsigned x = 0; x < width; ++x) {
+            uint8_t *pixel = &frame[(y * width + x) * 4];
+            pixel[0] = x * 3;
+            pixel[1] = y * 5;
+            pixel[2] = (x * y) >> 4;
+            pixel[3] = 0;
+        }
+    }
+    return frame;
+}
+
+std::vector<uint8_t> decode(std::vector<uint8_t> &jpeg, unsigned &width, unsigned &height)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, jpeg.data(), jpeg.size());
+    jpeg_read_header(&cinfo, TRUE);
+    jpeg_start_decompress(&cinfo);
+
+    width = cinfo.output_width;
+    height = cinfo.output_height;
+    const size_t stride = width * cinfo.output_components;
+    std::vector<uint8_t> pixels(stride * height);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = &pixels[cinfo.output_scanline * stride];
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    // no warning means no restart marker out of sequence or corrupted data
+    CHECK(jerr.num_warnings == 0);
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return pixels;
+}
+
+std::vector<uint8_t> decode(std::vector<uint8_t> &&jpeg)
+{
+    unsigned width, height;
+    return decode(jpeg, width, height);
+}
+
+} // namespace
+
+SCENARIO("test encoding frames in strips", "[jpeg][strips]") {
+    GIVEN("A frame spanning multiple strips") {
+        const unsigned width = 100, height = 150;
+        std::vector<uint8_t> frame = make_frame(width, height);
+        const unsigned count = JpegStripEncoder::strip_count(height);
+        JpegStripEncoder encoder;
+        std::vector<uint8_t> reference, buffer;
+
+        REQUIRE(count > 2);
+
+        WHEN("the frame is encoded") {
+            write_JPEG_file(reference, 80, frame.data(), width, height);
+            encoder.encode(buffer, 80, frame.data(), width, height,
+                           std::vector<bool>(count, true));
+
+            THEN("it decodes to the same image as a single strip encoding") {
+                unsigned w, h;
+                std::vector<uint8_t> pixels = decode(buffer, w, h);
+                CHECK(w == width);
+                CHECK(h == height);
+                CHECK(pixels == decode(std::move(reference)));
+            }
+        }
+
+        WHEN("a strip changes") {
+            encoder.encode(buffer, 80, frame.data(), width, height,
+                           std::vector<bool>(count, true));
+            std::vector<uint8_t> first = buffer;
+
+            for (unsigned x = 0; x < width * 4; ++x) {
+                frame[JpegStripEncoder::strip_height * width * 4 + x] = 0xff;
+            }
+            std::vector<bool> dirty(count, false);
+            dirty[1] = true;
+            encoder.encode(buffer, 80, frame.data(), width, height, dirty);
+
+            THEN("only that strip is compressed again") {
+                write_JPEG_file(reference, 80, frame.data(), width, height);
+                CHECK(buffer != first);
+                CHECK(decode(std::move(buffer)) == decode(std::move(reference)));
+            }
+        }
+
+        WHEN("the frame is encoded by multiple threads") {
+            JpegStripEncoder threaded_encoder(4);
+            write_JPEG_file(reference, 80, frame.data(), width, height);
+            threaded_encoder.encode(buffer, 80, frame.data(), width, height,
+                                    std::vector<bool>(count, true));
+
+            THEN("it decodes to the same image as a single thread encoding") {
+                CHECK(decode(std::move(buffer)) == decode(std::move(reference)));
+            }
+        }
+
+        WHEN("the quality changes") {
+            encoder.encode(buffer, 80, frame.data(), width, height,
+                           std::vector<bool>(count, true));
+            encoder.encode(buffer, 30, frame.data(), width, height,
+                           std::vector<bool>(count, false));
+
+            THEN("all the strips are compressed again") {
+                write_JPEG_file(reference, 30, frame.data(), width, height);
+                CHECK(decode(std::move(buffer)) == decode(std::move(reference)));
+            }
+        }
+    
+        WHEN("the frame is encoded with other options") {
+            THEN("it decodes to the same image as a single strip encoding") {
+                for (auto subsampling: {JpegSubsampling::Yuv422, JpegSubsampling::Yuv444}) {
+                    JpegOptions options;
+                    options.subsampling = subsampling;
+                    options.fast_dct = true;
+                    JpegStripEncoder options_encoder(1, options);
+                    write_JPEG_file(reference, 80, frame.data(), width, height, options);
+                    options_encoder.encode(buffer, 80, frame.data(), width, height,
+                                           std::vector<bool>(count, true));
+                    CHECK(decode(std::move(buffer)) == decode(std::move(reference)));
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("test the worst case size of the JPEG images", "[jpeg][size]") {
+    GIVEN("A frame of noise") {
+        const unsigned width = 77, height = 45;
+        std::vector<uint8_t> frame(width * height * 4);
+        uint32_t seed = 1;
+        for (auto &byte: frame) {
+            seed = seed * 1103515245 + 12345;
+            byte = seed >> 24;
+        }
+
+        THEN("the compressed image fits in the worst case size") {
+            for (auto subsampling: {JpegSubsampling::Yuv420, JpegSubsampling::Yuv422,
+                                    JpegSubsampling::Yuv444}) {
+                JpegOptions options;
+                options.subsampling = subsampling;
+                std::vector<uint8_t> jpeg;
+                write_JPEG_file(jpeg, 100, frame.data(), width, height, options);
+                CHECK(jpeg.size() <= jpeg_max_size(width, height, subsampling));
+                CHECK(decode(std::move(jpeg)).size() == width * height * 3);
+            }
+        }
+    }
+}
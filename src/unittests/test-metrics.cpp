@@ -0,0 +1,98 @@
+/* The unit test for the runtime metrics.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+
+#include "metrics.hpp"
+
+
+namespace ssa = spice::streaming_agent;
+
+SCENARIO("test recording durations in a histogram", "[metrics]") {
+    GIVEN("A histogram of the values from 1 to 1000") {
+        ssa::Histogram histogram;
+        for (uint64_t value = 1; value <= 1000; ++value) {
+            histogram.record(value);
+        }
+
+        THEN("the count and the sum are exact") {
+            CHECK(histogram.count() == 1000);
+            CHECK(histogram.sum() == 500500);
+        }
+
+        THEN("the percentiles are within the bucket resolution") {
+            CHECK(histogram.percentile(0.5) >= 500);
+            CHECK(histogram.percentile(0.5) <= 500 * 1.125);
+            CHECK(histogram.percentile(0.99) >= 990);
+            CHECK(histogram.percentile(0.99) <= 990 * 1.125);
+            CHECK(histogram.percentile(1) >= 1000);
+        }
+
+        THEN("the small values are counted exactly") {
+            CHECK(histogram.count_below(0) == 0);
+            CHECK(histogram.count_below(7) == 7);
+            CHECK(histogram.count_below(1000000) == 1000);
+        }
+    }
+
+    GIVEN("Large values") {
+        ssa::Histogram histogram;
+        histogram.record(UINT64_MAX);
+
+        THEN("they are counted in the last bucket") {
+            CHECK(histogram.percentile(1) == UINT64_MAX);
+        }
+    }
+}
+
+SCENARIO("test exporting the metrics", "[metrics]") {
+    GIVEN("Some metrics") {
+        ssa::Metrics metrics;
+        metrics.capture_time.record(200);
+        metrics.capture_time.record(3000);
+        metrics.frames_sent = 2;
+
+        WHEN("formatted") {
+            const std::string text = metrics.format();
+
+            THEN("they follow the Prometheus text format") {
+                CHECK(text.find("# TYPE spice_streaming_agent_capture_seconds histogram\n") !=
+                      std::string::npos);
+                CHECK(text.find("spice_streaming_agent_capture_seconds_bucket{le=\"0.0001\"} 0\n") !=
+                      std::string::npos);
+                CHECK(text.find("spice_streaming_agent_capture_seconds_bucket{le=\"0.00025\"} 1\n") !=
+                      std::string::npos);
+                CHECK(text.find("spice_streaming_agent_capture_seconds_bucket{le=\"+Inf\"} 2\n") !=
+                      std::string::npos);
+                CHECK(text.find("spice_streaming_agent_capture_seconds_count 2\n") !=
+                      std::string::npos);
+                CHECK(text.find("spice_streaming_agent_frames_sent_total 2\n") != std::string::npos);
+            }
+        }
+
+        WHEN("dumped to a file") {
+            char dir[] = "/tmp/test-metrics-XXXXXX";
+            REQUIRE(mkdtemp(dir));
+            const std::string filename = std::string(dir) + "/metrics.prom";
+            metrics.dump(filename);
+
+            THEN("the file holds the formatted metrics") {
+                std::ifstream file(filename);
+                std::stringstream content;
+                content << file.rdbuf();
+                CHECK(content.str() == metrics.format());
+            }
+
+            unlink(filename.c_str());
+            rmdir(dir);
+        }
+    }
+}
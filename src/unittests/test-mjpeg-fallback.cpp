@@ -14,6 +14,9 @@ SCENARIO("test parsing mjpeg plugin options", "[mjpeg][options]") {
             std::vector<ssa::ConfigureOption> options = {
                 {"framerate", "20"},
                 {"mjpeg.quality", "90"},
+                {"mjpeg.threads", "4"},
+                {"mjpeg.subsampling", "444"},
+                {"mjpeg.dct", "fast"},
                 {NULL, NULL}
             };
 
@@ -23,6 +26,9 @@ SCENARIO("test parsing mjpeg plugin options", "[mjpeg][options]") {
             THEN("the options are set in the plugin") {
                 CHECK(new_options.fps == 20);
                 CHECK(new_options.quality == 90);
+                CHECK(new_options.threads == 4);
+                CHECK(new_options.jpeg.subsampling == JpegSubsampling::Yuv444);
+                CHECK(new_options.jpeg.fast_dct);
             }
         }
 
@@ -53,5 +59,64 @@ SCENARIO("test parsing mjpeg plugin options", "[mjpeg][options]") {
                 );
             }
         }
+
+        WHEN("passing an invalid subsampling") {
+            std::vector<ssa::ConfigureOption> options = {
+                {"mjpeg.subsampling", "411"},
+                {NULL, NULL}
+            };
+
+            THEN("ParseOptions throws an exception") {
+                REQUIRE_THROWS_WITH(
+                    plugin.ParseOptions(options.data()),
+                    "Invalid value '411' for option 'mjpeg.subsampling'."
+                );
+            }
+        }
+
+        WHEN("passing capture options") {
+            std::vector<ssa::ConfigureOption> options = {
+                {"capture.damage", "off"},
+                {"capture.min-framerate", "5"},
+                {"capture.output", "Virtual-2"},
+                {NULL, NULL}
+            };
+
+            plugin.ParseOptions(options.data());
+            ssa::MjpegSettings new_options = plugin.Options();
+
+            THEN("the capture options are set in the plugin") {
+                CHECK(new_options.capture.use_damage == false);
+                CHECK(new_options.capture.min_fps == 5);
+                CHECK(new_options.capture.output == "Virtual-2");
+            }
+        }
+
+        WHEN("passing all as the captured output") {
+            std::vector<ssa::ConfigureOption> options = {
+                {"capture.output", "all"},
+                {NULL, NULL}
+            };
+
+            plugin.ParseOptions(options.data());
+
+            THEN("the whole screen is captured") {
+                CHECK(plugin.Options().capture.output.empty());
+            }
+        }
+
+        WHEN("passing an invalid capture option value") {
+            std::vector<ssa::ConfigureOption> options = {
+                {"capture.damage", "maybe"},
+                {NULL, NULL}
+            };
+
+            THEN("ParseOptions throws an exception") {
+                REQUIRE_THROWS_WITH(
+                    plugin.ParseOptions(options.data()),
+                    "Invalid value 'maybe' for option 'capture.damage'."
+                );
+            }
+        }
     }
 }
@@ -0,0 +1,115 @@
+/* The unit test for the adaptation of the stream rate.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+
+#include "rate-controller.hpp"
+
+
+namespace ssa = spice::streaming_agent;
+
+namespace {
+
+const uint64_t ms = 1000000u;
+
+// send frames every 40 ms blocking for the given part of the interval
+void send_frames(ssa::RateController &controller, uint64_t &time, unsigned count, double load)
+{
+    for (unsigned n = 0; n < count; ++n) {
+        time += 40 * ms;
+        controller.frame_sent(time, 40 * ms * load);
+    }
+}
+
+} // namespace
+
+SCENARIO("test adapting the stream rate", "[rate]") {
+    GIVEN("A new rate controller") {
+        ssa::RateController controller;
+        uint64_t time = 1000 * ms;
+
+        THEN("the full rate is used") {
+            CHECK(controller.level() == 100);
+            CHECK(controller.factor() == 1.0);
+        }
+
+        WHEN("the device never blocks") {
+            send_frames(controller, time, 200, 0);
+
+            THEN("the rate is unchanged") {
+                CHECK(controller.level() == 100);
+            }
+        }
+
+        WHEN("the device blocks for a short time") {
+            send_frames(controller, time, 5, 0.9);
+
+            THEN("the rate is not lowered yet") {
+                CHECK(controller.level() == 100);
+            }
+        }
+
+        WHEN("the device stays backed up") {
+            send_frames(controller, time, 25, 0.9);
+            const unsigned lowered = controller.level();
+
+            THEN("the rate is lowered") {
+                CHECK(lowered < 100);
+            }
+
+            AND_WHEN("it keeps blocking") {
+                send_frames(controller, time, 500, 1.0);
+
+                THEN("the rate does not go below the minimum") {
+                    CHECK(controller.level() == ssa::RateController::min_level);
+                }
+            }
+
+            AND_WHEN("the device drains") {
+                send_frames(controller, time, 10, 0);
+                const unsigned drained = controller.level();
+                send_frames(controller, time, 60, 0);
+                const unsigned raised = controller.level();
+                send_frames(controller, time, 500, 0);
+
+                THEN("the rate is slowly raised back to the full rate") {
+                    CHECK(drained <= lowered);
+                    CHECK(raised > drained);
+                    CHECK(raised < 100);
+                    CHECK(controller.level() == 100);
+                }
+            }
+        }
+    }
+
+    GIVEN("A device blocking for 2 ms of each 40 ms interval") {
+        ssa::RateController controller;
+
+        WHEN("the times are in ns") {
+            uint64_t time = 1000 * ms;
+            send_frames(controller, time, 200, 0.05);
+
+            THEN("the light backpressure keeps the full rate") {
+                CHECK(controller.level() == 100);
+            }
+        }
+
+        WHEN("the capture times are in us by mistake") {
+            // with the times a thousand times too small, the delay between
+            // two changes takes this many frames
+            uint64_t time = 1000 * ms;
+            for (unsigned n = 0; n < 13000; ++n) {
+                time += 40 * ms;
+                controller.frame_sent(time / 1000, 2 * ms);
+            }
+
+            THEN("the device looks saturated and the rate is lowered") {
+                CHECK(controller.level() < 100);
+            }
+        }
+    }
+}
@@ -0,0 +1,99 @@
+/* The unit test for the classification of the screen content.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+
+#include "scene-classifier.hpp"
+
+
+namespace ssa = spice::streaming_agent;
+
+namespace {
+
+const uint64_t interval = 100000;
+
+// feed samples every 100 ms for duration, the first changes of each period
+// samples show changed, return the time the scene changed, 0 if it did not
+uint64_t feed(ssa::SceneClassifier &classifier, uint64_t &time, uint64_t duration,
+              double changed, unsigned period = 1, unsigned changes = 1)
+{
+    uint64_t changed_at = 0;
+    for (uint64_t end = time + duration; time < end; time += interval) {
+        const bool change = (time / interval) % period < changes;
+        if (classifier.update(time, change ? changed : 0) && !changed_at) {
+            changed_at = time;
+        }
+    }
+    return changed_at;
+}
+
+}
+
+SCENARIO("test classifying the screen content", "[scene]") {
+    GIVEN("A new classifier") {
+        ssa::SceneClassifier classifier;
+        uint64_t time = 1000000;
+
+        THEN("the content is static") {
+            CHECK(classifier.scene() == ssa::Scene::Static);
+        }
+
+        WHEN("a video plays") {
+            const uint64_t start = time;
+            const uint64_t changed_at = feed(classifier, time, 10000000, 0.25);
+
+            THEN("the content becomes motion once it held long enough") {
+                CHECK(classifier.scene() == ssa::Scene::Motion);
+                CHECK(changed_at >= start + ssa::SceneClassifier::stable_time);
+                CHECK(changed_at <= start + ssa::SceneClassifier::window +
+                      ssa::SceneClassifier::stable_time);
+            }
+
+            THEN("the content becomes static again when the video stops") {
+                CHECK(feed(classifier, time, 10000000, 0) != 0);
+                CHECK(classifier.scene() == ssa::Scene::Static);
+            }
+
+            THEN("a shorter pause keeps the motion") {
+                CHECK(feed(classifier, time, 2000000, 0) == 0);
+                CHECK(classifier.scene() == ssa::Scene::Motion);
+            }
+
+            THEN("dropping some frames keeps the motion") {
+                // 2 samples out of 3 changed, above static_changes
+                CHECK(feed(classifier, time, 10000000, 0.25, 3, 2) == 0);
+                CHECK(classifier.scene() == ssa::Scene::Motion);
+            }
+        }
+
+        WHEN("text is typed") {
+            feed(classifier, time, 10000000, 0.001);
+
+            THEN("the content stays static") {
+                CHECK(classifier.scene() == ssa::Scene::Static);
+            }
+        }
+
+        WHEN("a document is scrolled for a second") {
+            const uint64_t changed_at = feed(classifier, time, 1000000, 0.9) +
+                feed(classifier, time, 10000000, 0);
+
+            THEN("the content stays static") {
+                CHECK(changed_at == 0);
+                CHECK(classifier.scene() == ssa::Scene::Static);
+            }
+        }
+
+        WHEN("large changes happen now and then") {
+            feed(classifier, time, 10000000, 0.5, 2);
+
+            THEN("the content stays static") {
+                CHECK(classifier.scene() == ssa::Scene::Static);
+            }
+        }
+    }
+}
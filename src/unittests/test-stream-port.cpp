@@ -8,6 +8,8 @@
 #include <catch/catch.hpp>
 #include <sys/socket.h>
 #include <signal.h>
+#include <thread>
+#include <vector>
 
 #include "stream-port.hpp"
 #include "error.hpp"
@@ -56,6 +58,44 @@ SCENARIO("test basic IO on the stream port", "[port][io]") {
             CHECK(std::string(buf, src_size) == src_buf);
         }
 
+        WHEN("writing multiple buffers") {
+            struct iovec iov[] = {
+                { (void *) "bre", 3 },
+                { nullptr, 0 },
+                { (void *) "keke", 4 },
+            };
+            ssa::writev_all(fd[1], iov, 3);
+            char buf[10];
+            CHECK(read(fd[0], buf, src_size) == src_size);
+            CHECK(std::string(buf, src_size) == src_buf);
+        }
+
+        WHEN("writing multiple buffers bigger than the socket buffer") {
+            std::vector<uint8_t> header(7), data(1024 * 1024);
+            for (size_t i = 0; i < header.size(); ++i) {
+                header[i] = i;
+            }
+            for (size_t i = 0; i < data.size(); ++i) {
+                data[i] = i * 7 + 3;
+            }
+            std::vector<uint8_t> received(header.size() + data.size());
+
+            // partial writes happen as the reader is slower than the writer
+            std::thread reader([&] {
+                ssa::read_all(fd[0], received.data(), received.size());
+            });
+            struct iovec iov[] = {
+                { header.data(), header.size() },
+                { data.data(), data.size() },
+            };
+            ssa::writev_all(fd[1], iov, 2);
+            reader.join();
+
+            std::vector<uint8_t> expected(header);
+            expected.insert(expected.end(), data.begin(), data.end());
+            CHECK(received == expected);
+        }
+
         WHEN("closing the remote end and trying to read") {
             CHECK(write(fd[0], src_buf, src_size) == src_size);
             char buf[10];
@@ -0,0 +1,103 @@
+/* The unit test for the thread writing the messages to the stream port.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <string>
+#include <thread>
+
+#include "stream-writer.hpp"
+#include "stream-port.hpp"
+#include "error.hpp"
+
+
+namespace ssa = spice::streaming_agent;
+
+namespace {
+
+struct iovec make_iov(const std::string &data)
+{
+    return { const_cast<char *>(data.data()), data.size() };
+}
+
+std::string read_string(int fd, size_t size)
+{
+    std::string data(size, '\0');
+    ssa::read_all(fd, &data[0], size);
+    return data;
+}
+
+} // namespace
+
+/*
+ * A fifo is used as the port, unlike a socketpair it can be opened by name.
+ */
+SCENARIO("test writing messages to the stream port", "[port][writer]") {
+    GIVEN("A writer attached to a fifo") {
+        char dir[] = "/tmp/test-stream-writer-XXXXXX";
+        REQUIRE(mkdtemp(dir));
+        const std::string fifo = std::string(dir) + "/port";
+        REQUIRE(mkfifo(fifo.c_str(), 0600) == 0);
+        int reader = open(fifo.c_str(), O_RDONLY | O_NONBLOCK);
+        REQUIRE(reader >= 0);
+
+        {
+            ssa::StreamPort port(fifo);
+            ssa::StreamWriter writer(port);
+
+            WHEN("messages are posted and written") {
+                const std::string posted = "cursor", frame = "frame";
+                struct iovec iov = make_iov(posted);
+                writer.post(&iov, 1);
+                iov = make_iov(frame);
+                writer.write(&iov, 1);
+
+                THEN("they are all written, the frame once write returns") {
+                    CHECK(read_string(reader, posted.size() + frame.size()) == posted + frame);
+                }
+            }
+
+            WHEN("messages are posted while a large message is being written") {
+                // larger than the fifo buffer, the writer waits for the reader
+                const std::string frame(256 * 1024, 'f');
+                std::thread sender([&] {
+                    struct iovec iov = make_iov(frame);
+                    writer.write(&iov, 1);
+                });
+                int pending = 0;
+                while (ioctl(reader, FIONREAD, &pending) == 0 && pending == 0) {
+                    usleep(1000);
+                }
+
+                const std::string old_cursor = "old", new_cursor = "new", reply = "reply";
+                struct iovec iov = make_iov(old_cursor);
+                writer.post(&iov, 1, 1);
+                iov = make_iov(reply);
+                writer.post(&iov, 1);
+                iov = make_iov(new_cursor);
+                writer.post(&iov, 1, 1);
+
+                THEN("they follow the large message, only the last one of a coalesce key is kept") {
+                    CHECK(read_string(reader, frame.size()) == frame);
+                    sender.join();
+                    CHECK(read_string(reader, new_cursor.size() + reply.size()) == new_cursor + reply);
+                }
+                if (sender.joinable()) {
+                    sender.join();
+                }
+            }
+        }
+
+        close(reader);
+        unlink(fifo.c_str());
+        rmdir(dir);
+    }
+}
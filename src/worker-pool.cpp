@@ -0,0 +1,98 @@
+/* A pool of threads running the same task on many items.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "worker-pool.hpp"
+
+
+namespace spice {
+namespace streaming_agent {
+
+WorkerPool::WorkerPool(unsigned threads)
+{
+    for (unsigned n = 1; n < threads; ++n) {
+        workers.emplace_back(&WorkerPool::worker, this);
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        quit = true;
+        work_cond.notify_all();
+    }
+    for (auto &thread: workers) {
+        thread.join();
+    }
+}
+
+// process items of the current job till none is left, called with the lock held
+void WorkerPool::process(std::unique_lock<std::mutex> &lock)
+{
+    while (next < count) {
+        const unsigned n = next++;
+        lock.unlock();
+        try {
+            (*task)(n);
+        } catch (...) {
+            lock.lock();
+            if (!error) {
+                error = std::current_exception();
+            }
+            lock.unlock();
+        }
+        lock.lock();
+        if (--pending == 0) {
+            done_cond.notify_all();
+        }
+    }
+}
+
+void WorkerPool::worker()
+{
+    unsigned seen_generation = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        work_cond.wait(lock, [&]{ return quit || generation != seen_generation; });
+        if (quit) {
+            return;
+        }
+        seen_generation = generation;
+        process(lock);
+    }
+}
+
+void WorkerPool::run(unsigned count, const std::function<void(unsigned)> &task)
+{
+    if (workers.empty() || count <= 1) {
+        for (unsigned n = 0; n < count; ++n) {
+            task(n);
+        }
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    this->task = &task;
+    this->count = count;
+    next = 0;
+    pending = count;
+    error = nullptr;
+    ++generation;
+    work_cond.notify_all();
+
+    process(lock);
+    done_cond.wait(lock, [this]{ return pending == 0; });
+    this->task = nullptr;
+    this->count = 0;
+
+    if (error) {
+        std::exception_ptr e = error;
+        error = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+}} // namespace spice::streaming_agent
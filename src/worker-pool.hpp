@@ -0,0 +1,55 @@
+/* A pool of threads running the same task on many items.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_WORKER_POOL_HPP
+#define SPICE_STREAMING_AGENT_WORKER_POOL_HPP
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace spice {
+namespace streaming_agent {
+
+class WorkerPool
+{
+public:
+    /*! Create a pool, the calling thread counts as one of the threads */
+    WorkerPool(unsigned threads);
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+    ~WorkerPool();
+
+    /*! Call task(n) for n in [0, count) using all the threads.
+     * Returns when all the calls are done. If a call throws, the
+     * exception is rethrown here once the other calls completed.
+     */
+    void run(unsigned count, const std::function<void(unsigned)> &task);
+
+    unsigned size() const { return workers.size() + 1; }
+
+private:
+    void worker();
+    void process(std::unique_lock<std::mutex> &lock);
+
+    std::mutex mutex;
+    std::condition_variable work_cond, done_cond;
+    std::vector<std::thread> workers;
+    const std::function<void(unsigned)> *task = nullptr;
+    unsigned count = 0, next = 0, pending = 0;
+    // incremented for each run() so workers pick up a job only once
+    unsigned generation = 0;
+    std::exception_ptr error;
+    bool quit = false;
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_WORKER_POOL_HPP
@@ -0,0 +1,321 @@
+/* Screen grabbing from X11, using MIT-SHM when available.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#include "x11-capture.hpp"
+
+#include <X11/extensions/Xrandr.h>
+#include <cstdlib>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <syslog.h>
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+
+
+namespace spice {
+namespace streaming_agent {
+
+namespace {
+
+// the error handler is global to the process, while other threads use
+// Xlib on their own displays, only the errors of trapped_display are
+// trapped and the swap of the handler is serialized
+std::mutex trap_mutex;
+Display *trapped_display = nullptr;
+XErrorHandler previous_handler = nullptr;
+bool x_error_trapped = false;
+
+int trap_x_error(Display *display, XErrorEvent *error)
+{
+    if (error->display != trapped_display) {
+        return previous_handler ? previous_handler(display, error) : 0;
+    }
+    x_error_trapped = true;
+    return 0;
+}
+
+} // namespace
+
+bool parse_capture_option(CaptureSettings &settings, const std::string &name, const std::string &value)
+{
+    if (name == "capture.damage") {
+        if (value == "on") {
+            settings.use_damage = true;
+        } else if (value == "off") {
+            settings.use_damage = false;
+        } else {
+            throw std::runtime_error("Invalid value '" + value + "' for option 'capture.damage'.");
+        }
+    } else if (name == "capture.min-framerate") {
+        try {
+            settings.min_fps = std::stoi(value);
+        } catch (const std::exception &e) {
+            throw std::runtime_error("Invalid value '" + value + "' for option 'capture.min-framerate'.");
+        }
+        if (settings.min_fps <= 0) {
+            throw std::runtime_error("Invalid value '" + value + "' for option 'capture.min-framerate'.");
+        }
+    } else if (name == "capture.output") {
+        settings.output = value == "all" ? "" : value;
+    } else if (name == "capture.sync") {
+        if (value == "on") {
+            settings.sync = true;
+        } else if (value == "off") {
+            settings.sync = false;
+        } else {
+            throw std::runtime_error("Invalid value '" + value + "' for option 'capture.sync'.");
+        }
+    } else {
+        return parse_scale_option(settings.scale, name, value);
+    }
+    return true;
+}
+
+constexpr std::chrono::milliseconds OutputSelector::refresh_interval;
+
+OutputSelector::OutputSelector(Display *display, const std::string &output) :
+    display(display),
+    output(output)
+{
+    if (output.empty()) {
+        return;
+    }
+
+    int event_base, error_base, major = 0, minor = 0;
+    if (!XRRQueryExtension(display, &event_base, &error_base) ||
+        !XRRQueryVersion(display, &major, &minor) || major * 100 + minor < 103) {
+        syslog(LOG_WARNING, "XRandR 1.3 is not available, capturing the whole screen");
+        return;
+    }
+    use_randr = true;
+}
+
+bool OutputSelector::find_output(ScreenArea &area)
+{
+    Window win = DefaultRootWindow(display);
+    XRRScreenResources *resources = XRRGetScreenResourcesCurrent(display, win);
+    if (!resources) {
+        return false;
+    }
+
+    // the index counts the active outputs only, in the server's order
+    char *end;
+    const long index = strtol(output.c_str(), &end, 10);
+    const bool by_index = !output.empty() && *end == '\0';
+    const RROutput primary = output == "primary" ? XRRGetOutputPrimary(display, win) : None;
+
+    bool result = false;
+    int active = 0;
+    for (int i = 0; !result && i < resources->noutput; ++i) {
+        XRROutputInfo *info = XRRGetOutputInfo(display, resources, resources->outputs[i]);
+        if (!info) {
+            continue;
+        }
+        if (info->connection == RR_Connected && info->crtc) {
+            bool selected;
+            if (by_index) {
+                selected = active == index;
+            } else if (output == "primary") {
+                // without a primary output the first active one is used
+                selected = primary == None ? active == 0 : primary == resources->outputs[i];
+            } else {
+                selected = output == info->name;
+            }
+            ++active;
+
+            XRRCrtcInfo *crtc = selected ? XRRGetCrtcInfo(display, resources, info->crtc) : nullptr;
+            if (crtc) {
+                if (crtc->width && crtc->height) {
+                    area.x = crtc->x;
+                    area.y = crtc->y;
+                    area.width = crtc->width;
+                    area.height = crtc->height;
+                    result = true;
+                }
+                XRRFreeCrtcInfo(crtc);
+            }
+        }
+        XRRFreeOutputInfo(info);
+    }
+    XRRFreeScreenResources(resources);
+    return result;
+}
+
+ScreenArea OutputSelector::area()
+{
+    XWindowAttributes win_info;
+    XGetWindowAttributes(display, DefaultRootWindow(display), &win_info);
+
+    const auto now = std::chrono::steady_clock::now();
+    if ((unsigned) win_info.width == root.width && (unsigned) win_info.height == root.height &&
+        now < last_query + refresh_interval) {
+        return current;
+    }
+    root.x = win_info.x;
+    root.y = win_info.y;
+    root.width = win_info.width;
+    root.height = win_info.height;
+    last_query = now;
+
+    ScreenArea area;
+    if (!use_randr || !find_output(area)) {
+        if (use_randr && found) {
+            syslog(LOG_WARNING, "Output '%s' is not active, capturing the whole screen",
+                   output.c_str());
+            found = false;
+        }
+        current = root;
+        return current;
+    }
+    if (!found) {
+        syslog(LOG_NOTICE, "Output '%s' is active, capturing it", output.c_str());
+        found = true;
+    }
+
+    // a crtc can extend beyond the screen while it is being reconfigured
+    area.x = std::max(area.x, 0);
+    area.y = std::max(area.y, 0);
+    const int width = std::min<int>(area.width, (int) root.width - area.x);
+    const int height = std::min<int>(area.height, (int) root.height - area.y);
+    area.width = std::max(width, 0);
+    area.height = std::max(height, 0);
+    current = area.width && area.height ? area : root;
+    return current;
+}
+
+ShmImage::ShmImage(Display *display, unsigned width, unsigned height) : display(display)
+{
+    int screen = XDefaultScreen(display);
+
+    image = XShmCreateImage(display, DefaultVisual(display, screen), DefaultDepth(display, screen),
+                            ZPixmap, nullptr, &shm_info, width, height);
+    if (!image) {
+        throw std::runtime_error("XShmCreateImage failed");
+    }
+
+    shm_info.shmid = shmget(IPC_PRIVATE, image->bytes_per_line * image->height, IPC_CREAT | 0600);
+    if (shm_info.shmid < 0) {
+        destroy();
+        throw std::runtime_error("Cannot create a shared memory segment");
+    }
+
+    shm_info.shmaddr = image->data = (char *) shmat(shm_info.shmid, nullptr, 0);
+    if (shm_info.shmaddr == (char *) -1) {
+        shmctl(shm_info.shmid, IPC_RMID, nullptr);
+        shm_info.shmid = -1;
+        shm_info.shmaddr = image->data = nullptr;
+        destroy();
+        throw std::runtime_error("Cannot attach the shared memory segment");
+    }
+    shm_info.readOnly = False;
+
+    // attaching fails asynchronously, for instance on a remote display
+    XSync(display, False);
+    bool trapped;
+    Bool attached;
+    {
+        std::lock_guard<std::mutex> lock(trap_mutex);
+        trapped_display = display;
+        x_error_trapped = false;
+        previous_handler = XSetErrorHandler(trap_x_error);
+        attached = XShmAttach(display, &shm_info);
+        XSync(display, False);
+        XSetErrorHandler(previous_handler);
+        trapped = x_error_trapped;
+        trapped_display = nullptr;
+    }
+
+    // the segment will be released as soon as both sides detach from it
+    shmctl(shm_info.shmid, IPC_RMID, nullptr);
+
+    if (!attached || trapped) {
+        // not attached on the server side, nothing to detach
+        shm_info.shmid = -1;
+        destroy();
+        throw std::runtime_error("The X server cannot attach the shared memory segment");
+    }
+}
+
+ShmImage::~ShmImage()
+{
+    destroy();
+}
+
+void ShmImage::destroy()
+{
+    if (!image) {
+        return;
+    }
+
+    if (shm_info.shmid >= 0) {
+        XShmDetach(display, &shm_info);
+    }
+    if (shm_info.shmaddr) {
+        shmdt(shm_info.shmaddr);
+    }
+    // the data is not owned by Xlib
+    image->data = nullptr;
+    XDestroyImage(image);
+    image = nullptr;
+}
+
+bool ShmImage::grab(Window win, int x, int y)
+{
+    return XShmGetImage(display, win, image, x, y, AllPlanes);
+}
+
+X11Capture::X11Capture(Display *display) : display(display)
+{
+    use_shm = XShmQueryExtension(display);
+    if (!use_shm) {
+        syslog(LOG_NOTICE, "MIT-SHM extension not available, falling back to XGetImage");
+    }
+}
+
+X11Capture::~X11Capture()
+{
+    destroy_image();
+}
+
+void X11Capture::destroy_image()
+{
+    shm_image.reset();
+    if (image) {
+        XDestroyImage(image);
+        image = nullptr;
+    }
+}
+
+XImage *X11Capture::grab(Window win, int x, int y, unsigned width, unsigned height)
+{
+    if (use_shm) {
+        XImage *shm = shm_image ? shm_image->get() : nullptr;
+        if (!shm || (unsigned) shm->width != width || (unsigned) shm->height != height) {
+            destroy_image();
+            try {
+                shm_image.reset(new ShmImage(display, width, height));
+            } catch (const std::exception &e) {
+                syslog(LOG_WARNING, "Failed to set up MIT-SHM capture, falling back to XGetImage: %s",
+                       e.what());
+                use_shm = false;
+            }
+        }
+    }
+
+    if (use_shm) {
+        if (shm_image->grab(win, x, y)) {
+            return shm_image->get();
+        }
+        return nullptr;
+    }
+
+    destroy_image();
+    image = XGetImage(display, win, x, y, width, height, AllPlanes, ZPixmap);
+    return image;
+}
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,150 @@
+/* Screen grabbing from X11, using MIT-SHM when available.
+ *
+ * \copyright
+ * Copyright 2018 Red Hat Inc. All rights reserved.
+ */
+
+#ifndef SPICE_STREAMING_AGENT_X11_CAPTURE_HPP
+#define SPICE_STREAMING_AGENT_X11_CAPTURE_HPP
+
+#include "frame-scaler.hpp"
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Settings of the X11 screen capture, shared by the plugins
+ * grabbing the screen through X11Capture.
+ */
+struct CaptureSettings
+{
+    /*! Only grab a new frame when the screen content changed */
+    bool use_damage = true;
+    /*! Minimum rate of frames sent while the screen content does not change */
+    int min_fps = 1;
+    /*! XRandR output to capture, by name, index or "primary", the whole
+     * screen if empty */
+    std::string output;
+    /*! Grab a frame once the screen changes settled rather than right at
+     * the deadline of the frame, needs use_damage */
+    bool sync = false;
+    /*! Size of the stream, the frames are scaled down to it */
+    ScaleSettings scale;
+};
+
+/*!
+ * Parse a "capture.*" or "scale.*" option.
+ * Throws std::runtime_error for an invalid value.
+ * \return false if the option is not a capture option
+ */
+bool parse_capture_option(CaptureSettings &settings, const std::string &name, const std::string &value);
+
+/*! An area of the screen, in root window coordinates */
+struct ScreenArea
+{
+    int x = 0, y = 0;
+    unsigned width = 0, height = 0;
+};
+
+/*!
+ * Finds the area of the screen to capture: the area of the XRandR output
+ * selected with the capture.output option, or the whole root window.
+ *
+ * The layout is queried again when the root window is resized and at
+ * most every refresh_interval otherwise, so following an output which is
+ * moved, resized or switched off does not cost round trips on each frame.
+ */
+class OutputSelector
+{
+public:
+    OutputSelector(Display *display, const std::string &output);
+
+    /*! \return the area to capture, the whole root window if the output
+     * is not active */
+    ScreenArea area();
+
+    static constexpr std::chrono::milliseconds refresh_interval{1000};
+
+private:
+    bool find_output(ScreenArea &area);
+
+    Display *const display;
+    const std::string output;
+    bool use_randr = false;
+    ScreenArea root, current;
+    std::chrono::steady_clock::time_point last_query;
+    // to only log when the output appears or disappears
+    bool found = true;
+};
+
+/*!
+ * An image in a shared memory segment attached to the X server.
+ */
+class ShmImage
+{
+public:
+    /*! Throws std::runtime_error if the segment cannot be created or attached */
+    ShmImage(Display *display, unsigned width, unsigned height);
+    ShmImage(const ShmImage &) = delete;
+    ShmImage &operator=(const ShmImage &) = delete;
+    ~ShmImage();
+
+    XImage *get() const { return image; }
+
+    /*! Grab the area of a window at x, y with the size of the image */
+    bool grab(Window win, int x, int y);
+
+private:
+    void destroy();
+
+    Display *const display;
+    XImage *image = nullptr;
+    XShmSegmentInfo shm_info = {};
+};
+
+/*!
+ * Grabs images of a window.
+ *
+ * If the X server supports the MIT-SHM extension the image is read
+ * through a shared memory segment which is kept across grabs and only
+ * reallocated when the size of the grabbed area changes. Otherwise (or
+ * if attaching the segment fails, e.g. on a remote display) it falls
+ * back to XGetImage.
+ */
+class X11Capture
+{
+public:
+    X11Capture(Display *display);
+    X11Capture(const X11Capture &) = delete;
+    X11Capture &operator=(const X11Capture &) = delete;
+    ~X11Capture();
+
+    /*! Grab an area of a window.
+     * The returned image is owned by this object and is valid till the
+     * next call. Returns nullptr on failure.
+     */
+    XImage *grab(Window win, int x, int y, unsigned width, unsigned height);
+
+    bool using_shm() const { return use_shm; }
+
+private:
+    void destroy_image();
+
+    Display *const display;
+    bool use_shm = false;
+    std::unique_ptr<ShmImage> shm_image;
+    // image read with XGetImage
+    XImage *image = nullptr;
+};
+
+}} // namespace spice::streaming_agent
+
+#endif // SPICE_STREAMING_AGENT_X11_CAPTURE_HPP